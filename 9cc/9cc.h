@@ -1,14 +1,58 @@
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE // struct ucred
+
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 typedef struct Type Type;
 
+/*********
+ * mem.c *
+ *********/
+// Subsystems that own memory
+typedef enum {
+	MEM_DRIVER, // Input, caches, snapshots, profiles and the server
+	MEM_TOKENIZE,
+	MEM_PARSE,
+	MEM_TYPE,
+	MEM_OPT, // AST optimizations and frame layout
+	MEM_IR,  // IR, its passes and register allocation
+	MEM_CODEGEN,
+	MEM_INTERP,
+	MEM_NPOOLS,
+} MemPool;
+
+void *mem_alloc(MemPool pool, size_t size);
+void *mem_realloc(MemPool pool, void *p, size_t size);
+char *mem_strndup(MemPool pool, char *s, size_t n);
+char *mem_strdup(MemPool pool, char *s);
+void mem_free(void *p);
+void mem_teardown();
+void print_mem_report();
+void mem_exit();
+
 /**************
  * tokenize.c *
  **************/
@@ -26,32 +70,46 @@ struct Token {
 	TokenKind kind;
 	Token *next;
 
-	int val;
+	long val;
 	char *str;
 	int len;
 
-	char *contents; // String literal including '\0'
-	char cont_len;  // String literal
+	char *contents; // String literal
+	long cont_len;  // Length of the literal including '\0'
 };
 
-void error(char *fmt, ...);
-void error_at(char *loc, char *fmt, ...);
-void error_tok(Token *tok, char *fmt, ...);
+__attribute__((noreturn)) void error(char *fmt, ...);
+__attribute__((noreturn)) void error_at(char *loc, char *fmt, ...);
+__attribute__((noreturn)) void error_tok(Token *tok, char *fmt, ...);
 Token *peek(char *s);
 Token *consume(char *op);
-char *strndup(char *p, int len);
 Token *consume_ident();
 void expect(char *op);
-int expect_number();
+long expect_number();
 char *expect_ident();
 bool at_eof();
 Token *new_token(TokenKind kind, Token *cur, char *str, int len);
+bool startswith(char *p, char *q);
+bool is_alnum(char c);
 Token *tokenize();
 
 extern char *filename;
 extern char *user_input; // Input program
 extern Token *token; // Current token
 
+/**********
+ * scan.c *
+ **********/
+extern char *input_end;
+
+void init_scanner();
+char *skip_space(char *p);
+char *skip_ident(char *p);
+char *find_newline(char *p);
+char *find_comment_end(char *p);
+char *find_str_end(char *p);
+void bench_tokenize();
+
 /***********
  * parse.c *
  ***********/
@@ -79,6 +137,9 @@ typedef enum {
 	ND_VAR,       // Local variable
 	ND_NUM,       // Integer
 	ND_NULL,      // Empty statement
+	ND_VFILL,     // Vector fill of `val` elements (-O)
+	ND_VCOPY,     // Vector copy of `val` elements (-O)
+	ND_VSUM,      // Vector sum of `val` elements (-O)
 } NodeKind;
 
 // Variable
@@ -89,11 +150,14 @@ struct Var {
 	bool is_local; // local or global
 
 	// Local variable
-	int offset;    // Offset from RBP
+	int offset;      // Offset from RBP
+	int scope_begin; // Number of the block declaring the variable
+	int scope_end;   // Last number of the blocks nested in it
 
 	// Global variable
 	char *contents;
-	int cont_len;
+	long cont_len;
+	char *mem; // Its memory in --interp
 };
 
 typedef struct VarList VarList;
@@ -128,18 +192,38 @@ struct Node {
 	Node *args;
 
 	Var *var;  // Used for ND_VAR
-	int val;   // Used for ND_NUM
+	long val;  // Used for ND_NUM
+
+	// Profile counters of "if", "while" and "for", set by assign_counters()
+	char *prof_fn; // Function owning the counters
+	int prof_id;   // Index of the first of two counters
 };
 
+typedef struct BB BB;
+
 typedef struct Function Function;
 struct Function {
 	Function *next;
 	char *name;
+	Type *ty; // Return type
 	VarList *params;
 
 	Node *node;
 	VarList *locals;
+	VarList *literals; // String literals
 	int stack_size;
+
+	// IR
+	BB *bb;     // Basic blocks. The first one is the entry.
+	int nreg;   // Number of virtual registers
+	int nlabel; // Number of basic block labels
+
+	int ncounters; // Number of profile counters
+	long entry;    // Offset of its bytecode in --interp
+
+	// Register allocation
+	int spill_size;   // Stack size for spilled registers, below `stack_size`
+	int callee_saved; // Bitmask of callee-saved registers in use
 };
 
 typedef struct {
@@ -147,6 +231,11 @@ typedef struct {
 	Function *fns;
 } Program;
 
+Node *new_node(NodeKind kind, Token *tok);
+Node *new_binary(NodeKind kind, Node *lhs, Node *rhs, Token *tok);
+Node *new_num(long val, Token *tok);
+Node *new_unary(NodeKind kind, Node *expr, Token *tok);
+Node *new_var(Var *var, Token *tok);
 Program *program();
 
 /************
@@ -155,6 +244,7 @@ Program *program();
 typedef enum {
 	TY_CHAR,
 	TY_INT,
+	TY_LONG,
 	TY_PTR,
 	TY_ARRAY,
 } TypeKind;
@@ -167,13 +257,293 @@ struct Type {
 
 Type *char_type();
 Type *int_type();
+Type *long_type();
 Type *pointer_to(Type *base);
 Type *array_of(Type *base, int size);
 int size_of(Type *ty);
+int align_of(Type *ty);
+bool is_integer(Type *ty);
+bool can_return_call(Function *fn, Node *call);
 
 void add_type(Program *prog);
 
+/************
+ * interp.c *
+ ************/
+void interpret(Program *prog);
+
+/*************
+ * profile.c *
+ *************/
+extern char *profile_path;
+
+void assign_counters(Program *prog);
+void emit_counter(char *fn, int idx);
+void emit_profile_table(Function *fn);
+void load_profile();
+long stmt_count(Node *node, int k);
+long entry_count(char *name);
+bool is_hot(char *name);
+bool is_cold(char *name);
+unsigned long profile_hash(unsigned long h);
+
+/****************
+ * instrument.c *
+ ****************/
+extern char *enter_hook;
+extern char *exit_hook;
+
+bool is_instrumented(Function *fn);
+void emit_enter_hook(Function *fn);
+void emit_exit_hook(Function *fn);
+void emit_tail_exit_hook(Function *fn);
+void emit_function_name(Function *fn);
+
+/***********
+ * debug.c *
+ ***********/
+int line_of(char *loc);
+void emit_file_directive();
+void emit_loc(Token *tok);
+void emit_stmt_loc(Node *node);
+void emit_fn_start(Function *fn);
+void emit_fn_end(Function *fn);
+void emit_frame_setup();
+void emit_frame_teardown();
+void emit_cfi_saved(char *reg, int offset);
+void emit_cfi_remember();
+void emit_cfi_restore();
+void emit_cfi_adjust(int bytes);
+
+/************
+ * inline.c *
+ ************/
+int count_nodes(Node *node);
+Node *copy_tree(Node *node);
+Function *find_function(Program *prog, char *name);
+int inline_functions(Program *prog, int size_limit);
+
+/*********
+ * dce.c *
+ *********/
+bool eval_const(Node *node, long *val);
+void eliminate_dead_code(Program *prog, int *nstmts, int *nvars);
+
+/***********
+ * frame.c *
+ ***********/
+int layout_frame(Function *fn);
+
+/**********
+ * loop.c *
+ **********/
+void optimize_loops(Program *prog, int *nunrolled, int *nvectorized);
+
+/************
+ * gen_ir.c *
+ ************/
+typedef enum {
+	IR_IMM,   // r0 = imm
+	IR_MOV,   // r0 = r1
+	IR_ADD,   // r0 = r1 + (r2 or imm)
+	IR_SUB,   // r0 = r1 - (r2 or imm)
+	IR_MUL,   // r0 = r1 * (r2 or imm)
+	IR_DIV,   // r0 = r1 / (r2 or imm)
+	IR_EQ,    // r0 = r1 == (r2 or imm)
+	IR_NE,    // r0 = r1 != (r2 or imm)
+	IR_LT,    // r0 = r1 < (r2 or imm)
+	IR_LE,    // r0 = r1 <= (r2 or imm)
+	IR_LVAR,  // r0 = address of a local variable
+	IR_GVAR,  // r0 = address of a global variable
+	IR_LOAD,  // r0 = [r1]
+	IR_STORE, // [r1] = r2
+	IR_PARAM, // r0 = imm-th parameter
+	IR_CALL,  // r0 = name(args...)
+	IR_RET,   // return r1
+	IR_JMP,   // goto bb1
+	IR_BR,    // if r1 goto bb1 else goto bb2
+	IR_CAST,  // r0 = r1 sign-extended from its lowest `size` bytes
+	IR_PHI,   // r0 = args[i] if control came from bbs[i]
+	IR_VFILL, // Stores r2 to `imm` elements of `size` bytes from r1
+	IR_VCOPY, // Copies `imm` elements of `size` bytes from r2 to r1
+	IR_VSUM,  // r0 = sum of `imm` elements of `size` bytes from r1
+	IR_COUNT, // Increments profile counter `imm` of function `name`
+} IROp;
+
+// Virtual register
+typedef struct Reg Reg;
+struct Reg {
+	int vn;    // Virtual register number
+	int rn;    // Physical register assigned by alloc_regs(), or -1
+	int spill; // Stack offset if no physical register was assigned
+};
+
+typedef struct IR IR;
+struct IR {
+	IROp op;
+	IR *next;
+
+	Reg *r0;
+	Reg *r1;
+	Reg *r2;   // If NULL, `imm` is used as the second operand
+	long imm;
+
+	int size;  // IR_LOAD, IR_STORE, IR_CAST and vector operations
+	Var *var;  // IR_LVAR, IR_GVAR
+
+	// IR_JMP, IR_BR
+	BB *bb1;
+	BB *bb2;
+
+	// IR_CALL, IR_PHI
+	char *name; // Also the function of IR_COUNT
+	Reg **args;
+	int nargs;
+	bool is_tail; // The callee can reuse our frame
+	BB **bbs;     // Incoming blocks of IR_PHI
+
+	Token *tok; // Statement it came from, for .loc
+};
+
+// Basic block
+struct BB {
+	BB *next;
+	int label;
+	IR *ir;
+	bool reachable;
+	long count; // Execution count from the profile, or -1
+
+	// CFG and dominator tree, set by compute_cfg()
+	BB **pred;
+	int npred;
+	int rpo;  // Reverse postorder number
+	BB *idom; // Immediate dominator
+};
+
+extern Function *ir_fn; // new_reg() allocates registers of this function
+
+IR *new_ir(IROp op);
+Reg *new_reg();
+BB *new_bb();
+void gen_ir(Program *prog);
+
+/*********
+ * ssa.c *
+ *********/
+IR *last_inst(BB *bb);
+int get_succs(BB *bb, BB **succ);
+void remove_unreachable(Function *fn);
+void compute_cfg(Function *fn);
+bool dominates(BB *a, BB *b);
+Reg **use_at(IR *ir, int i);
+bool is_pure(IR *ir);
+void insert_before_terminator(BB *bb, IR *ir);
+void remove_phi_edge(BB *bb, BB *pred);
+void build_ssa(Function *fn);
+void leave_ssa(Function *fn);
+
+/**************
+ * liveness.c *
+ **************/
+
+typedef struct Interval Interval;
+struct Interval {
+	Reg *reg;
+	int start;
+	int end;
+	int weight;        // Estimated cost of spilling
+	bool crosses_call; // Must survive a call clobbering caller-saved registers
+};
+
+Interval **compute_intervals(Function *fn);
+
+/**************
+ * regalloc.c *
+ **************/
+extern char *regs[];
+extern char *regs8[];
+extern char *regs32[];
+
+void alloc_regs(Program *prog);
+
+/************
+ * irdump.c *
+ ************/
+void dump_ir(Function *fn, char *title);
+
+/*********
+ * opt.c *
+ *********/
+void run_passes(Program *prog, bool dump);
+
+/*************
+ * gen_x86.c *
+ *************/
+void gen_x86_fn(Function *fn);
+void gen_x86(Program *prog);
+
+/**********
+ * main.c *
+ **********/
+extern int opt_level;
+extern bool opt_info;
+extern bool dump_ir_flag;
+extern bool profile_generate;
+extern bool profile_use;
+extern bool instrument_functions;
+extern bool debug_info;
+extern bool interp;
+extern bool mem_report;
+extern bool use_cache;
+
+int align_to(int n, int align);
+void parse_args(int argc, char **argv);
+void optimize(Program *prog);
+void compile(int argc, char **argv);
+
+/***********
+ * cache.c *
+ ***********/
+extern char *cache_dir;
+extern long cache_limit;
+
+unsigned long hash_bytes(unsigned long h, void *p, long len);
+unsigned long compiler_id();
+bool cache_lookup(char *input, int argc, char **argv);
+void cache_store();
+void print_cache_stats();
+
+/**************
+ * snapshot.c *
+ **************/
+void save_ast(Program *prog);
+Program *load_ast(char *path);
+
+/**********
+ * incr.c *
+ **********/
+void compile_incremental(int argc, char **argv);
+
+/************
+ * server.c *
+ ************/
+extern char *socket_path;
+
+void run_server();
+bool request_compile(int argc, char **argv, int *status);
+
 /*************
  * codegen.c *
  *************/
+extern char *argreg1[];
+extern char *argreg4[];
+extern char *argreg8[];
+
+void gen_mul_imm(char *reg, long val);
+void gen_div_imm(long d);
+bool fn_any_node(Function *fn, bool (*pred)(Node *));
+bool is_local_addr(Node *node);
+void emit_vars(VarList *vars);
+void emit_data(Program *prog);
+void codegen_fn(Function *fn);
 void codegen(Program *prog);
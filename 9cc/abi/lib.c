@@ -0,0 +1,10 @@
+// Functions built by gcc for abi/tests, which calls them from code
+// built by 9cc.
+
+int neg(void) {
+	return -1;
+}
+
+int sub_int(int a, int b) {
+	return a - b;
+}
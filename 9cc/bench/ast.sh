@@ -0,0 +1,22 @@
+#!/bin/bash
+# Compiles a large generated file from source and from an AST
+# snapshot, and reports the time of each. The outputs must agree.
+set -e
+cd "$(dirname "$0")"
+TIMEFORMAT='%3Rs'
+N=${N:-2000}
+
+for i in $(seq $N); do
+	echo "int f$i(int *a, int n) { int s; s = 0; int i;"
+	echo "  for (i = 0; i < n; i = i + 1) { if (a[i] < $i) s = s + a[i]; else s = s - 1; }"
+	echo "  return ({ int t; t = s * 2; t + $i; }); }"
+done > tmp-big
+echo "int main() { return 0; }" >> tmp-big
+
+../9cc --emit-ast tmp-big > tmp-big.ast
+
+echo -n "source: "
+time (for i in 1 2 3 4 5; do ../9cc tmp-big > tmp-big.s; done)
+echo -n "snapshot: "
+time (for i in 1 2 3 4 5; do ../9cc --from-ast tmp-big.ast > tmp-big-ast.s; done)
+cmp tmp-big.s tmp-big-ast.s
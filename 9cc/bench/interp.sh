@@ -0,0 +1,28 @@
+#!/bin/bash
+# Compares running a program with --interp against compiling,
+# assembling, linking and running it, on a short script and on the
+# benchmark kernels. The outputs must agree.
+set -e
+cd "$(dirname "$0")"
+TIMEFORMAT='%3Rs'
+
+cat > tmp-script <<'END'
+int square(int x) { return x * x; }
+int main() {
+	int i;
+	for (i = 1; i <= 10; i = i + 1)
+		printf("%d squared is %d\n", i, square(i));
+	return 0;
+}
+END
+
+for prog in tmp-script kernels; do
+	echo "$prog:"
+	echo -n "  native: "
+	time (../9cc $prog > tmp-interp.s &&
+		  gcc -static -o tmp-interp tmp-interp.s 2> /dev/null &&
+		  ./tmp-interp > tmp-native.out)
+	echo -n "  interp: "
+	time ../9cc --interp $prog > tmp-interp.out
+	cmp tmp-native.out tmp-interp.out
+done
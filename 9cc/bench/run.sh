@@ -0,0 +1,13 @@
+#!/bin/bash
+# Compiles the benchmark kernels at each optimization level and
+# reports the run time of each. The outputs must agree.
+set -e
+cd "$(dirname "$0")"
+TIMEFORMAT='%3Rs'
+
+for opt in -O0 -O; do
+	../9cc $opt kernels > tmp$opt.s
+	gcc -static -o tmp$opt tmp$opt.s
+	echo -n "$opt: "
+	time ./tmp$opt
+done
@@ -0,0 +1,37 @@
+#!/bin/bash
+# Compiles many small files one process at a time, first directly and
+# then through a compile server, and reports the throughput of each.
+# The outputs must agree.
+set -e
+cd "$(dirname "$0")"
+N=${N:-500}
+SOCK=$PWD/tmp-server.sock
+
+rm -rf tmp-files
+mkdir tmp-files
+for i in $(seq $N); do
+	echo "int f$i(int x) { return x * $i + 1; } int main() { return f$i(3); }" \
+		> tmp-files/$i.c
+done
+
+now() { date +%s%N; }
+
+# Prints files per second for a run that took from $1 to $2 ns
+rate() { echo "$(( N * 1000000000 / ($2 - $1) )) files/s"; }
+
+start=$(now)
+for i in $(seq $N); do ../9cc tmp-files/$i.c > tmp-files/$i.s; done
+end=$(now)
+echo "direct: $(rate $start $end)"
+
+../9cc --server --socket=$SOCK &
+pid=$!
+trap "kill $pid" EXIT
+while [ ! -S $SOCK ]; do sleep 0.01; done
+
+start=$(now)
+for i in $(seq $N); do ../9cc --use-server --socket=$SOCK tmp-files/$i.c > tmp-files/$i.srv.s; done
+end=$(now)
+echo "server: $(rate $start $end)"
+
+for i in $(seq $N); do cmp tmp-files/$i.s tmp-files/$i.srv.s; done
@@ -0,0 +1,20 @@
+#!/bin/bash
+# Measures the throughput of the tokenizer with each scanner on a
+# generated file with long comments, identifiers and string literals.
+set -e
+cd "$(dirname "$0")"
+N=${N:-2000}
+
+for i in $(seq $N); do
+	echo "/* Function number $i adds up the elements of an array. The comment"
+	echo " * is long so that it spans several vectors of the scanner. */"
+	echo "int accumulate_elements_of_array_$i(int *array_of_numbers, int number_of_elements) {"
+	echo "        int accumulated_total; accumulated_total = 0; // running sum of the elements"
+	echo "        char *message; message = \"a string literal which is long enough to matter\";"
+	echo "        return accumulated_total + $i;"
+	echo "}"
+done > tmp-tokenize
+
+for s in scalar sse2 avx2; do
+	NINECC_SCAN=$s ../9cc --bench-tokenize tmp-tokenize
+done
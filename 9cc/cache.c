@@ -0,0 +1,290 @@
+#include "9cc.h"
+
+// Content-addressed cache of generated assembly.
+//
+// The output of 9cc is a function of the input bytes, the flags and
+// the compiler itself (and the profile with -fprofile-use), so a hash
+// of them names an entry in the cache directory. On a hit, the entry
+// is copied to stdout and the input is never tokenized or parsed. On a
+// miss, stdout is redirected to a temporary file in the cache
+// directory, which cache_store() copies to the real stdout and renames
+// to the entry.
+//
+// Entries are evicted least recently used first (by mtime, which a
+// hit updates) when their total size exceeds `cache_limit`.
+
+char *cache_dir;                     // --cache-dir=DIR
+long cache_limit = 64 * 1024 * 1024; // --cache-size=N
+
+char entry_path[PATH_MAX];
+char tmp_path[PATH_MAX];
+int saved_stdout = -1;
+
+// 64-bit FNV-1a
+unsigned long hash_bytes(unsigned long h, void *p, long len) {
+	unsigned char *s = p;
+	for (long i = 0; i < len; i++) {
+		h ^= s[i];
+		h *= 0x100000001b3;
+	}
+	return h;
+}
+
+unsigned long hash_str(unsigned long h, char *s) {
+	// Include the terminator so that "ab","c" and "a","bc" differ
+	return hash_bytes(h, s, strlen(s) + 1);
+}
+
+// Returns a hash identifying the running compiler binary, so that
+// a rebuilt 9cc doesn't reuse output of the old one. It is computed
+// once, since /proc/self/exe stays the binary we were started from.
+unsigned long compiler_id() {
+	static unsigned long id;
+	if (id)
+		return id;
+
+	unsigned long h = 0xcbf29ce484222325;
+	struct stat st;
+	if (!stat("/proc/self/exe", &st)) {
+		h = hash_bytes(h, &st.st_size, sizeof(st.st_size));
+		h = hash_bytes(h, &st.st_mtime, sizeof(st.st_mtime));
+	}
+	id = h;
+	return id;
+}
+
+void init_cache_dir() {
+	if (!cache_dir)
+		cache_dir = getenv("NINECC_CACHE_DIR");
+	if (!cache_dir) {
+		char *home = getenv("HOME");
+		if (!home)
+			error("cannot find cache directory: HOME is not set");
+		static char buf[PATH_MAX];
+		snprintf(buf, sizeof(buf), "%s/.cache/9cc", home);
+		cache_dir = buf;
+	}
+
+	// Create the directory and its parents
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s", cache_dir);
+	for (char *p = path + 1;; p++) {
+		if (*p != '/' && *p != '\0')
+			continue;
+		char c = *p;
+		*p = '\0';
+		if (mkdir(path, 0755) && errno != EEXIST)
+			error("cannot create %s: %s", path, strerror(errno));
+		*p = c;
+		if (c == '\0')
+			break;
+	}
+}
+
+// The hit and miss counters are in a single file, which concurrent
+// runs sharing the cache directory update under an exclusive lock and
+// read under a shared one, so that no count is lost and no one sees
+// the file half-written.
+
+// Reads the counters from the locked stats file
+void scan_stats(int fd, long *hits, long *misses) {
+	char buf[64];
+	long n = pread(fd, buf, sizeof(buf) - 1, 0);
+	*hits = *misses = 0;
+	if (n <= 0)
+		return;
+	buf[n] = '\0';
+	if (sscanf(buf, "%ld %ld", hits, misses) != 2)
+		*hits = *misses = 0;
+}
+
+void read_stats(long *hits, long *misses) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/stats", cache_dir);
+	*hits = *misses = 0;
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return;
+	if (!flock(fd, LOCK_SH))
+		scan_stats(fd, hits, misses);
+	close(fd);
+}
+
+void count(bool hit) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/stats", cache_dir);
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd == -1)
+		return;
+	if (flock(fd, LOCK_EX)) {
+		close(fd);
+		return;
+	}
+
+	long hits, misses;
+	scan_stats(fd, &hits, &misses);
+	if (hit)
+		hits++;
+	else
+		misses++;
+
+	char buf[64];
+	int len = snprintf(buf, sizeof(buf), "%ld %ld\n", hits, misses);
+	if (pwrite(fd, buf, len, 0) == len)
+		ftruncate(fd, len);
+	close(fd);
+}
+
+void copy_to_stdout(char *path) {
+	FILE *fp = fopen(path, "r");
+	if (!fp)
+		error("cannot open %s: %s", path, strerror(errno));
+
+	char buf[65536];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+		fwrite(buf, 1, n, stdout);
+	fclose(fp);
+}
+
+bool is_entry(char *name) {
+	int len = strlen(name);
+	return len == 18 && !strcmp(name + 16, ".s");
+}
+
+typedef struct {
+	char *path;
+	long size;
+	long mtime;
+} Entry;
+
+int cmp_mtime(const void *a, const void *b) {
+	const Entry *x = a;
+	const Entry *y = b;
+	return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+// Returns the entries of the cache directory and their total size
+Entry *list_entries(int *n, long *total) {
+	DIR *dir = opendir(cache_dir);
+	if (!dir)
+		error("cannot open %s: %s", cache_dir, strerror(errno));
+
+	int cap = 64;
+	Entry *ents = mem_realloc(MEM_DRIVER, NULL, cap * sizeof(Entry));
+	*n = 0;
+	*total = 0;
+
+	for (struct dirent *de; (de = readdir(dir));) {
+		if (!is_entry(de->d_name))
+			continue;
+
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/%s", cache_dir, de->d_name);
+		struct stat st;
+		if (stat(path, &st))
+			continue;
+
+		if (*n == cap) {
+			cap *= 2;
+			ents = mem_realloc(MEM_DRIVER, ents, cap * sizeof(Entry));
+		}
+		ents[*n].path = mem_strdup(MEM_DRIVER, path);
+		ents[*n].size = st.st_size;
+		ents[*n].mtime = st.st_mtime;
+		*total += st.st_size;
+		(*n)++;
+	}
+	closedir(dir);
+	return ents;
+}
+
+// Removes least recently used entries until the cache fits in the limit
+void evict() {
+	int n;
+	long total;
+	Entry *ents = list_entries(&n, &total);
+	if (total <= cache_limit)
+		return;
+
+	qsort(ents, n, sizeof(Entry), cmp_mtime);
+	for (int i = 0; i < n && total > cache_limit; i++)
+		if (!unlink(ents[i].path))
+			total -= ents[i].size;
+}
+
+void remove_tmp() {
+	if (tmp_path[0])
+		unlink(tmp_path);
+}
+
+// Looks up the assembly for `input` compiled with the options in
+// `argv`. If found, writes it to stdout and returns true. Otherwise,
+// redirects stdout so that cache_store() can save the output.
+bool cache_lookup(char *input, int argc, char **argv) {
+	init_cache_dir();
+
+	unsigned long h = compiler_id();
+
+	// The cache options don't affect the output, and the input file
+	// name only does with -g
+	for (int i = 1; i < argc; i++)
+		if (argv[i] != filename && strncmp(argv[i], "--cache", 7))
+			h = hash_str(h, argv[i]);
+	if (debug_info)
+		h = hash_str(h, filename);
+	h = hash_str(h, input);
+	h = profile_hash(h);
+
+	snprintf(entry_path, sizeof(entry_path), "%s/%016lx.s", cache_dir, h);
+
+	if (!access(entry_path, R_OK)) {
+		copy_to_stdout(entry_path);
+		utimensat(AT_FDCWD, entry_path, NULL, 0);
+		count(true);
+		return true;
+	}
+
+	count(false);
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s/tmp.XXXXXX", cache_dir);
+	int fd = mkstemp(tmp_path);
+	if (fd == -1)
+		error("cannot create %s: %s", tmp_path, strerror(errno));
+	atexit(remove_tmp);
+
+	fflush(stdout);
+	saved_stdout = dup(1);
+	dup2(fd, 1);
+	close(fd);
+	return false;
+}
+
+// Saves the output written since cache_lookup() and copies it to stdout
+void cache_store() {
+	fflush(stdout);
+	dup2(saved_stdout, 1);
+	close(saved_stdout);
+
+	copy_to_stdout(tmp_path);
+	if (rename(tmp_path, entry_path))
+		error("cannot rename %s: %s", tmp_path, strerror(errno));
+	tmp_path[0] = '\0';
+	evict();
+}
+
+void print_cache_stats() {
+	init_cache_dir();
+
+	long hits, misses;
+	read_stats(&hits, &misses);
+	int n;
+	long total;
+	list_entries(&n, &total);
+
+	fprintf(stderr, "cache: %s\n", cache_dir);
+	fprintf(stderr, "hits: %ld\n", hits);
+	fprintf(stderr, "misses: %ld\n", misses);
+	fprintf(stderr, "entries: %d\n", n);
+	fprintf(stderr, "size: %ld bytes (limit %ld)\n", total, cache_limit);
+}
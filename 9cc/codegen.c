@@ -1,12 +1,208 @@
 #include "9cc.h"
 
 char *argreg1[] = {"dil", "sil", "dl",  "cl",  "r8b", "r9b"};
+char *argreg4[] = {"edi", "esi", "edx", "ecx", "r8d", "r9d"};
 char *argreg8[] = {"rdi", "rsi", "rdx", "rcx", "r8",  "r9" };
 
 int labelseq = 0;
 char *funcname;
+Function *gen_fn;
+bool instrumented; // is_instrumented(gen_fn)
+bool has_frame;     // The current function has a RBP-based frame
+bool can_tail_call; // No pointer into the current frame can escape
+
+// Parameters whose address is never taken stay in registers: in the
+// registers the stack machine doesn't use in leaf functions, and in
+// callee-saved registers otherwise.
+char *leaf_regs[] = {"r10", "rsi", "r11", "rcx", "r8", "r9"};
+char *callee_saved[] = {"rbx", "r12", "r13", "r14", "r15"};
+Var *reg_vars[6];
+char *var_regs[6];
+int nreg_vars;
+int nsaved; // Number of callee-saved registers in use
+int stack_size;
+
+int depth; // Number of values pushed to the stack
 
 void gen(Node *node);
+void gen_epilogue();
+
+// Counts `n` slots pushed (or popped, if negative) by the stack
+// machine. Without a frame, they move the CFA.
+void adjust_depth(int n) {
+	depth += n;
+	if (!has_frame)
+		emit_cfi_adjust(n * 8);
+}
+
+void push(char *reg) {
+	printf("	push %s\n", reg);
+	adjust_depth(1);
+}
+
+void pop(char *reg) {
+	printf("	pop %s\n", reg);
+	adjust_depth(-1);
+}
+
+// Returns log2(n) if n is a power of two, or -1 otherwise
+int log2_of(long n) {
+	if (n <= 0 || (n & (n - 1)))
+		return -1;
+	int k = 0;
+	while (n > 1) {
+		n >>= 1;
+		k++;
+	}
+	return k;
+}
+
+// Multiplies `reg` by a constant with shift and lea where possible
+void gen_mul_imm(char *reg, long val) {
+	if (val < 0) {
+		gen_mul_imm(reg, -val);
+		printf("	neg %s\n", reg);
+		return;
+	}
+
+	if (val == 0) {
+		printf("	mov %s, 0\n", reg);
+		return;
+	}
+
+	int k = log2_of(val);
+	if (k >= 0) {
+		if (k > 0)
+			printf("	shl %s, %d\n", reg, k);
+		return;
+	}
+
+	// 3, 5 and 9 times a power of two fit in a single lea plus shift
+	for (int m = 3; m <= 9; m = m * 2 - 1) {
+		if (val % m == 0 && (k = log2_of(val / m)) >= 0) {
+			printf("	lea %s, [%s+%s*%d]\n", reg, reg, reg, m - 1);
+			if (k > 0)
+				printf("	shl %s, %d\n", reg, k);
+			return;
+		}
+	}
+
+	printf("	imul %s, %s, %ld\n", reg, reg, val);
+}
+
+// Computes the magic number and shift amount to replace signed
+// division by `d` with a multiply-high (Hacker's Delight, 10-1).
+// `d` must not be -1, 0 or 1.
+void div_magic(long d, long *magic, int *shift) {
+	unsigned long two63 = 1UL << 63;
+	unsigned long ad = d < 0 ? -(unsigned long)d : d;
+	unsigned long t = two63 + ((unsigned long)d >> 63);
+	unsigned long anc = t - 1 - t % ad;
+	unsigned long q1 = two63 / anc;
+	unsigned long r1 = two63 - q1 * anc;
+	unsigned long q2 = two63 / ad;
+	unsigned long r2 = two63 - q2 * ad;
+	unsigned long delta;
+	int p = 63;
+
+	do {
+		p++;
+		q1 *= 2;
+		r1 *= 2;
+		if (r1 >= anc) {
+			q1++;
+			r1 -= anc;
+		}
+		q2 *= 2;
+		r2 *= 2;
+		if (r2 >= ad) {
+			q2++;
+			r2 -= ad;
+		}
+		delta = ad - r2;
+	} while (q1 < delta || (q1 == delta && r1 == 0));
+
+	*magic = q2 + 1;
+	if (d < 0)
+		*magic = -*magic;
+	*shift = p - 64;
+}
+
+// Divides RAX by a constant, rounding toward zero like idiv.
+// Clobbers RDX and RDI.
+void gen_div_imm(long d) {
+	if (d == 1)
+		return;
+	if (d == -1) {
+		printf("	neg rax\n");
+		return;
+	}
+
+	long ad = d < 0 ? -d : d;
+	int k = log2_of(ad);
+	if (k >= 0) {
+		// Add 2^k-1 to negative dividends so that the shift truncates toward zero
+		printf("	cqo\n");
+		printf("	shr rdx, %d\n", 64 - k);
+		printf("	add rax, rdx\n");
+		printf("	sar rax, %d\n", k);
+		if (d < 0)
+			printf("	neg rax\n");
+		return;
+	}
+
+	long magic;
+	int shift;
+	div_magic(d, &magic, &shift);
+
+	printf("	mov rdi, rax\n");
+	printf("	mov rax, %ld\n", magic);
+	printf("	imul rdi\n");
+	if (d > 0 && magic < 0)
+		printf("	add rdx, rdi\n");
+	if (d < 0 && magic > 0)
+		printf("	sub rdx, rdi\n");
+	if (shift > 0)
+		printf("	sar rdx, %d\n", shift);
+	printf("	mov rax, rdx\n");
+	printf("	shr rax, 63\n");
+	printf("	add rax, rdx\n");
+}
+
+// Returns the SIB scale for pointer arithmetic on `node`,
+// or 0 if the element size doesn't fit in an addressing mode.
+int index_scale(Node *node) {
+	if (node->kind != ND_ADD || !node->ty->base)
+		return 0;
+	int sz = size_of(node->ty->base);
+	if (sz == 1 || sz == 2 || sz == 4 || sz == 8)
+		return sz;
+	return 0;
+}
+
+// x[i] is lowered to *(x+i). Evaluates x and i of such a node and
+// writes an operand addressing the element to `buf`, using
+// scaled-index addressing instead of computing the sum.
+void gen_index(Node *node, char *buf) {
+	int scale = index_scale(node);
+
+	// Unless the offset doesn't fit in a 32-bit displacement
+	if (node->rhs->kind == ND_NUM) {
+		long disp = node->rhs->val * scale;
+		if (disp == (int)disp) {
+			gen(node->lhs);
+			pop("rax");
+			sprintf(buf, "[rax+%ld]", disp);
+			return;
+		}
+	}
+
+	gen(node->lhs);
+	gen(node->rhs);
+	pop("rdi");
+	pop("rax");
+	sprintf(buf, "[rax+rdi*%d]", scale);
+}
 
 // Pushes the given node's address to the stack
 void gen_addr(Node *node) {
@@ -15,16 +211,23 @@ void gen_addr(Node *node) {
 		Var *var = node->var;
 		if (var->is_local) {
 			printf("	lea rax, [rbp-%d]\n", var->offset);
-			printf("	push rax\n");
+			push("rax");
 		} else {
 			// Original: printf("	push offset %s\n", var->name);
 			// Note: calculate relative address to avoid PIE error
 			printf("	lea rax, [rip + %s]\n", var->name);
-			printf("	push rax\n");
+			push("rax");
 		}
 		return;
 	}
 	case ND_DEREF:
+		if (index_scale(node->lhs)) {
+			char addr[32];
+			gen_index(node->lhs, addr);
+			printf("	lea rax, %s\n", addr);
+			push("rax");
+			return;
+		}
 		gen(node->lhs);
 		return;
 	}
@@ -38,42 +241,263 @@ void gen_lval(Node *node) {
 	gen_addr(node);
 }
 
-void load(Type *ty) {
-	printf("	pop rax\n");
-	if (size_of(ty) == 1)
-		printf("	movsx rax, byte ptr [rax]\n");
+// Loads a value of the given type from `addr` to `reg`
+void load_to(char *reg, Type *ty, char *addr) {
+	int sz = size_of(ty);
+	if (sz == 1)
+		printf("	movsx %s, byte ptr %s\n", reg, addr);
+	else if (sz == 4)
+		printf("	movsxd %s, dword ptr %s\n", reg, addr);
 	else
-		printf("	mov rax, [rax]\n");
-	printf("	push rax\n");
+		printf("	mov %s, %s\n", reg, addr);
+}
+
+void load_from(Type *ty, char *addr) {
+	load_to("rax", ty, addr);
+}
+
+void load(Type *ty) {
+	pop("rax");
+	load_from(ty, "[rax]");
+	push("rax");
 }
 
 void store(Type *ty) {
-	printf("	pop rdi\n");
-	printf("	pop rax\n");
-	if (size_of(ty) == 1)
+	pop("rdi");
+	pop("rax");
+	int sz = size_of(ty);
+	if (sz == 1)
 		printf("	mov [rax], dil\n");
+	else if (sz == 4)
+		printf("	mov [rax], edi\n");
 	else
 		printf("	mov [rax], rdi\n");
-	printf("	push rdi\n");
+	push("rdi");
+}
+
+// Returns the register holding a parameter, or NULL if it's in memory
+char *var_reg(Var *var) {
+	for (int i = 0; i < nreg_vars; i++)
+		if (reg_vars[i] == var)
+			return var_regs[i];
+	return NULL;
+}
+
+// Returns true if an argument can be loaded to its register with a
+// single instruction that doesn't touch other registers
+bool is_simple_arg(Node *node) {
+	return node->kind == ND_NUM || node->kind == ND_VAR ||
+		   (node->kind == ND_ADDR && node->lhs->kind == ND_VAR);
+}
+
+void load_simple_arg(char *reg, Node *node) {
+	if (node->kind == ND_NUM) {
+		printf("	mov %s, %ld\n", reg, node->val);
+		return;
+	}
+
+	Var *var = (node->kind == ND_ADDR) ? node->lhs->var : node->var;
+	char addr[64];
+	if (var->is_local)
+		sprintf(addr, "[rbp-%d]", var->offset);
+	else
+		sprintf(addr, "[rip + %s]", var->name);
+
+	if (node->kind == ND_ADDR || var->ty->kind == TY_ARRAY) {
+		printf("	lea %s, %s\n", reg, addr);
+		return;
+	}
+	if (var_reg(var)) {
+		printf("	mov %s, %s\n", reg, var_reg(var));
+		return;
+	}
+	load_to(reg, var->ty, addr);
+}
+
+// Evaluates arguments of a function call. The first six are passed in
+// registers and the rest on the stack, pushed from right to left.
+// Simple arguments are loaded directly into their registers after the
+// others have been evaluated. Unless `is_tail`, RSP is padded so that
+// it is 16-byte aligned at the call. Returns the number of stack
+// slots to release after the call.
+int gen_args(Node *node, bool is_tail) {
+	int nargs = 0;
+	for (Node *arg = node->args; arg; arg = arg->next)
+		nargs++;
+
+	Node **args = mem_alloc(MEM_CODEGEN, nargs * sizeof(Node *));
+	int i = 0;
+	for (Node *arg = node->args; arg; arg = arg->next)
+		args[i++] = arg;
+
+	int nreg = nargs < 6 ? nargs : 6;
+	int nstack = nargs - nreg;
+	int pad = is_tail ? 0 : (depth + nstack) % 2;
+	if (pad) {
+		printf("	sub rsp, 8\n");
+		adjust_depth(1);
+	}
+
+	for (i = nargs - 1; i >= nreg; i--)
+		gen(args[i]);
+
+	for (i = 0; i < nreg; i++)
+		if (!is_simple_arg(args[i]))
+			gen(args[i]);
+	for (i = nreg - 1; i >= 0; i--)
+		if (!is_simple_arg(args[i]))
+			pop(argreg8[i]);
+	for (i = 0; i < nreg; i++)
+		if (is_simple_arg(args[i]))
+			load_simple_arg(argreg8[i], args[i]);
+
+	return nstack + pad;
+}
+
+bool is_tail_call(Node *node) {
+	if (node->kind != ND_FUNCALL || !can_tail_call || !can_return_call(gen_fn, node))
+		return false;
+
+	int nargs = 0;
+	for (Node *arg = node->args; arg; arg = arg->next)
+		nargs++;
+	return nargs <= sizeof(argreg8) / sizeof(*argreg8);
+}
+
+// Emits arithmetic with a constant operand without materializing
+// it on the stack. Returns false if `node` doesn't qualify.
+bool gen_binary_imm(Node *node) {
+	switch (node->kind) {
+	case ND_ADD:
+	case ND_SUB: {
+		if (node->rhs->kind != ND_NUM)
+			return false;
+		long val = node->rhs->val;
+		if (node->ty->base)
+			val *= size_of(node->ty->base);
+		if (val != (int)val)
+			return false;
+		gen(node->lhs);
+		pop("rax");
+		printf("	%s rax, %ld\n", node->kind == ND_ADD ? "add" : "sub", val);
+		push("rax");
+		return true;
+	}
+	case ND_MUL: {
+		Node *lhs = node->lhs;
+		Node *rhs = node->rhs;
+		if (lhs->kind == ND_NUM) {
+			lhs = node->rhs;
+			rhs = node->lhs;
+		}
+		if (rhs->kind != ND_NUM || rhs->val != (int)rhs->val)
+			return false;
+		gen(lhs);
+		pop("rax");
+		gen_mul_imm("rax", rhs->val);
+		push("rax");
+		return true;
+	}
+	case ND_DIV:
+		if (node->rhs->kind != ND_NUM || node->rhs->val == 0 ||
+			node->rhs->val != (int)node->rhs->val)
+			return false;
+		gen(node->lhs);
+		pop("rax");
+		gen_div_imm(node->rhs->val);
+		push("rax");
+		return true;
+	}
+	return false;
+}
+
+// Jump target in the current function. It is numbered, and emitted,
+// only if something jumps to it.
+typedef struct {
+	char *name;
+	int seq; // 0 until the first jump to it
+} Label;
+
+// Where control goes after the statement passed to the next gen(),
+// by falling through or by a jump that follows it. NULL if unknown.
+Label *cont_label;
+Label *return_label;
+bool unreachable; // The last instruction was an unconditional jump
+
+Label *new_code_label(char *name) {
+	Label *l = mem_alloc(MEM_CODEGEN, sizeof(Label));
+	l->name = name;
+	return l;
+}
+
+void jump(char *insn, Label *l) {
+	// Nothing reaches a jump right after another
+	if (unreachable)
+		return;
+	if (!l->seq)
+		l->seq = ++labelseq;
+	printf("	%s .L%s.%s.%d\n", insn, l->name, funcname, l->seq);
+	if (!strcmp(insn, "jmp"))
+		unreachable = true;
+}
+
+void emit_label(Label *l) {
+	if (!l->seq)
+		return;
+	printf(".L%s.%s.%d:\n", l->name, funcname, l->seq);
+	unreachable = false;
+}
+
+// Emits the target of a backward jump, which isn't taken yet
+void emit_loop_label(Label *l) {
+	l->seq = ++labelseq;
+	emit_label(l);
+}
+
+// Counts an edge of a statement with -fprofile-generate
+void count_edge(Node *node, int k) {
+	if (profile_generate && node->prof_fn)
+		emit_counter(node->prof_fn, node->prof_id + k);
 }
 
 void gen(Node *node) {
+	Label *cont = cont_label;
+	cont_label = NULL;
+	emit_stmt_loc(node);
+
 	switch (node->kind) {
 	case ND_NULL:
 		return;
 	case ND_NUM:
-		printf("	push %d\n", node->val);
+		// push takes at most a 32-bit immediate
+		if (node->val != (int)node->val) {
+			printf("	mov rax, %ld\n", node->val);
+			push("rax");
+			return;
+		}
+		printf("	push %ld\n", node->val);
+		adjust_depth(1);
 		return;
 	case ND_EXPR_STMT:
 		gen(node->lhs);
 		printf("	add rsp, 8\n");
+		adjust_depth(-1);
 		return;
 	case ND_VAR:
+		if (var_reg(node->var)) {
+			push(var_reg(node->var));
+			return;
+		}
 		gen_addr(node);
 		if (node->ty->kind != TY_ARRAY)
 			load(node->ty);
 		return;
 	case ND_ASSIGN:
+		if (node->lhs->kind == ND_VAR && var_reg(node->lhs->var)) {
+			gen(node->rhs);
+			load_to(var_reg(node->lhs->var), node->ty, "[rsp]");
+			return;
+		}
 		gen_lval(node->lhs);
 		gen(node->rhs);
 		store(node->ty);
@@ -82,118 +506,173 @@ void gen(Node *node) {
 		gen_addr(node->lhs);
 		return;
 	case ND_DEREF:
+		if (node->ty->kind != TY_ARRAY && index_scale(node->lhs)) {
+			char addr[32];
+			gen_index(node->lhs, addr);
+			load_from(node->ty, addr);
+			push("rax");
+			return;
+		}
 		gen(node->lhs);
 		if (node->ty->kind != TY_ARRAY)
 			load(node->ty);
 		return;
 	case ND_IF: {
-		int seq = labelseq++;
-		if (node->els) {
-			gen(node->cond);
-			printf("	pop rax\n");
-			printf("	cmp rax, 0\n");
-			printf("	je .Lelse%d\n", seq);
-			gen(node->then);
-			printf("	jmp .Lend%d\n", seq);
-			printf(".Lelse%d:\n", seq);
+		// The branches meet at the end of the statement. If it is
+		// followed by a jump, they jump straight to its target.
+		Label *end = cont ? cont : new_code_label("end");
+		gen(node->cond);
+		pop("rax");
+		printf("	cmp rax, 0\n");
+		if (node->els && stmt_count(node, 1) > stmt_count(node, 0)) {
+			// The profile says the else branch is taken more often,
+			// so it is the one that falls through
+			Label *then = new_code_label("then");
+			jump("jne", then);
+			count_edge(node, 1);
+			cont_label = end;
 			gen(node->els);
-			printf(".Lend%d:\n", seq);
+			jump("jmp", end);
+			emit_label(then);
+			count_edge(node, 0);
+			cont_label = end;
+			gen(node->then);
+		} else if (node->els || profile_generate) {
+			Label *els = new_code_label("else");
+			jump("je", els);
+			count_edge(node, 0);
+			cont_label = end;
+			gen(node->then);
+			jump("jmp", end);
+			emit_label(els);
+			count_edge(node, 1);
+			cont_label = end;
+			if (node->els)
+				gen(node->els);
 		} else {
-			gen(node->cond);
-			printf("	pop rax\n");
-			printf("	cmp rax, 0\n");
-			printf("	je .Lend%d\n", seq);
+			jump("je", end);
+			cont_label = end;
 			gen(node->then);
-			printf(".Lend%d:\n", seq);
 		}
+		if (end != cont)
+			emit_label(end);
 		return;
 	}
 	case ND_WHILE: {
-		int seq = labelseq++;
-		printf(".Lbegin%d:\n", seq);
+		// Rotated: the condition is tested at the bottom, where it
+		// is first entered from the top
+		Label *body = new_code_label("body");
+		Label *cond = new_code_label("cond");
+		jump("jmp", cond);
+		emit_loop_label(body);
+		count_edge(node, 0);
+		gen(node->then);
+		emit_label(cond);
 		gen(node->cond);
-		printf("	pop rax\n");
+		pop("rax");
 		printf("	cmp rax, 0\n");
-		printf("	je .Lend%d\n", seq);
-		gen(node->then);
-		printf("	jmp .Lbegin%d\n", seq);
-		printf(".Lend%d:\n", seq);
+		jump("jne", body);
+		count_edge(node, 1);
 		return;
 	}
 	case ND_FOR: {
-		int seq = labelseq++;
+		Label *body = new_code_label("body");
+		Label *cond = new_code_label("cond");
 		if (node->init)
 			gen(node->init);
-		printf(".Lbegin%d:\n", seq);
+		if (node->cond)
+			jump("jmp", cond);
+		emit_loop_label(body);
+		count_edge(node, 0);
+		gen(node->then);
+		if (node->inc)
+			gen(node->inc);
 		if (node->cond) {
+			emit_label(cond);
 			gen(node->cond);
-			printf("	pop rax\n");
+			pop("rax");
 			printf("	cmp rax, 0\n");
-			printf("	je .Lend%d\n", seq);
+			jump("jne", body);
+		} else {
+			jump("jmp", body);
 		}
-		gen(node->then);
-		if (node->inc)
-			gen(node->inc);
-		printf("	jmp .Lbegin%d\n", seq);
-		printf(".Lend%d:\n", seq);
+		count_edge(node, 1);
 		return;
 	}
 	case ND_BLOCK:
+		// The last statement continues where the block does
+		for (Node *n = node->body; n; n = n->next) {
+			if (!n->next)
+				cont_label = cont;
+			gen(n);
+		}
+		return;
 	case ND_STMT_EXPR:
 		for (Node *n = node->body; n; n = n->next)
 			gen(n);
 		return;
 	case ND_FUNCALL: {
-		int nargs = 0;
-		for (Node *arg = node->args; arg; arg = arg->next) {
-			gen(arg);
-			nargs++;
-		}
-
-		for (int i = nargs - 1; i >= 0; i--)
-			printf("	pop %s\n", argreg8[i]);
+		int n = gen_args(node, false);
 
-		// We need to align RSP to a 16 bytes boundary before calling a function
-		// because it is an ABI requirement.
 		// RAX is set to 0 for variadic function.
-		int seq = labelseq++;
-		printf("	mov rax, rsp\n");
-		printf("	and rax, 15\n");
-		printf("	jnz .Lcall%d\n", seq);
 		printf("	mov rax, 0\n");
 		printf("	call %s\n", node->funcname);
-		printf("	jmp .Lend%d\n", seq);
-		printf(".Lcall%d:\n", seq);
-		printf("	sub rsp, 8\n");
-		printf("	mov rax, 0\n");
-		printf("	call %s\n", node->funcname);
-		printf("	add rsp, 8\n");
-		printf(".Lend%d:\n", seq);
-		printf("	push rax\n");
+		if (n) {
+			printf("	add rsp, %d\n", n * 8);
+			adjust_depth(-n);
+		}
+
+		// The upper bits of a char or int result are unspecified
+		if (node->ty->kind == TY_CHAR)
+			printf("	movsx rax, al\n");
+		else if (node->ty->kind == TY_INT)
+			printf("	movsxd rax, eax\n");
+		push("rax");
 		return;
 	}
 	case ND_RETURN:
+		if (is_tail_call(node->lhs)) {
+			// Reuse our frame for the callee: pass arguments in registers,
+			// tear down the frame and jump, so that the callee returns
+			// directly to our caller.
+			gen_args(node->lhs, true);
+			if (instrumented)
+				emit_tail_exit_hook(gen_fn);
+			emit_cfi_remember();
+			gen_epilogue();
+			printf("	mov rax, 0\n");
+			printf("	jmp %s\n", node->lhs->funcname);
+			unreachable = true;
+			emit_cfi_restore();
+			return;
+		}
 		gen(node->lhs);
-		printf("	pop rax\n");
-		printf("	jmp .Lreturn.%s\n", funcname);
+		pop("rax");
+
+		// Unless we fall through to the epilogue anyway
+		if (cont != return_label)
+			jump("jmp", return_label);
 		return;
 	}
 
+	if (gen_binary_imm(node))
+		return;
+
 	gen(node->lhs);
 	gen(node->rhs);
 
-	printf("	pop rdi\n");
-	printf("	pop rax\n");
+	pop("rdi");
+	pop("rax");
 
 	switch (node->kind) {
 	case ND_ADD:
 		if (node->ty->base)
-			printf("	imul rdi, %d\n", size_of(node->ty->base)); // support pointer operation: &x+8 -> &x+1
+			gen_mul_imm("rdi", size_of(node->ty->base)); // support pointer operation: &x+8 -> &x+1
 		printf("	add rax, rdi\n");
 		break;
 	case ND_SUB:
 		if (node->ty->base)
-			printf("	imul rdi, %d\n", size_of(node->ty->base));
+			gen_mul_imm("rdi", size_of(node->ty->base));
 		printf("	sub rax, rdi\n");
 		break;
 	case ND_MUL:
@@ -225,13 +704,11 @@ void gen(Node *node) {
 		break;
 	}
 
-	printf("	push rax\n");
+	push("rax");
 }
 
-void emit_data(Program *prog) {
-	printf(".data\n");
-
-	for (VarList *vl = prog->globals; vl; vl = vl->next) {
+void emit_vars(VarList *vars) {
+	for (VarList *vl = vars; vl; vl = vl->next) {
 		Var *var = vl->var;
 		printf("%s:\n", var->name);
 
@@ -240,55 +717,228 @@ void emit_data(Program *prog) {
 			continue;
 		}
 
-		for (int i = 0; i < var->cont_len; i++) {
+		// The terminating '\0' isn't in the contents
+		for (long i = 0; i < var->cont_len - 1; i++)
 			printf("	.byte %d\n", var->contents[i]);
-		}
+		printf("	.byte 0\n");
 	}
 }
 
+void emit_data(Program *prog) {
+	printf(".data\n");
+	emit_vars(prog->globals);
+	for (Function *fn = prog->fns; fn; fn = fn->next)
+		emit_vars(fn->literals);
+}
+
+// Moves an incoming argument to the register or stack slot of its
+// parameter. Arguments beyond the sixth are above the return address.
 void load_arg(Var *var, int idx) {
 	int sz = size_of(var->ty);
+	char *reg = var_reg(var);
+
+	if (idx >= 6) {
+		char addr[32];
+		sprintf(addr, "[rbp+%d]", 16 + (idx - 6) * 8);
+		if (reg) {
+			load_to(reg, var->ty, addr);
+			return;
+		}
+		printf("	mov rax, %s\n", addr);
+		printf("	mov [rbp-%d], %s\n", var->offset,
+			   sz == 1 ? "al" : sz == 4 ? "eax" : "rax");
+		return;
+	}
+
+	// The upper bits of a narrow argument are unspecified
+	if (reg) {
+		if (sz == 1)
+			printf("	movsx %s, %s\n", reg, argreg1[idx]);
+		else if (sz == 4)
+			printf("	movsxd %s, %s\n", reg, argreg4[idx]);
+		else if (strcmp(reg, argreg8[idx]))
+			printf("	mov %s, %s\n", reg, argreg8[idx]);
+		return;
+	}
+
 	if (sz == 1) {
 		printf("	mov [rbp-%d], %s\n", var->offset, argreg1[idx]);
+	} else if (sz == 4) {
+		printf("	mov [rbp-%d], %s\n", var->offset, argreg4[idx]);
 	} else {
 		assert(sz == 8);
 		printf("	mov [rbp-%d], %s\n", var->offset, argreg8[idx]);
 	}
 }
 
-void emit_text(Program *prog) {
-	printf(".text\n");
+// Returns true if `pred` holds for any node in the given subtree
+bool any_node(Node *node, bool (*pred)(Node *)) {
+	if (!node)
+		return false;
+	if (pred(node))
+		return true;
+
+	if (any_node(node->lhs, pred) || any_node(node->rhs, pred) ||
+		any_node(node->cond, pred) || any_node(node->then, pred) ||
+		any_node(node->els, pred) || any_node(node->init, pred) ||
+		any_node(node->inc, pred))
+		return true;
+
+	for (Node *n = node->body; n; n = n->next)
+		if (any_node(n, pred))
+			return true;
+	for (Node *n = node->args; n; n = n->next)
+		if (any_node(n, pred))
+			return true;
+	return false;
+}
+
+bool is_funcall(Node *node) {
+	return node->kind == ND_FUNCALL;
+}
+
+bool is_return(Node *node) {
+	return node->kind == ND_RETURN;
+}
+
+// A return inside a statement expression leaves the values pushed
+// before it on the stack, which only the frame teardown pops
+bool returns_from_stmt_expr(Node *node) {
+	return node->kind == ND_STMT_EXPR && any_node(node, is_return);
+}
+
+// Returns true if the node computes an address of a local variable,
+// either explicitly with & or by array-to-pointer decay.
+bool is_local_addr(Node *node) {
+	if (node->kind == ND_ADDR)
+		return node->lhs->kind != ND_VAR || node->lhs->var->is_local;
+	return node->kind == ND_VAR && node->var->is_local &&
+		   node->ty->kind == TY_ARRAY;
+}
+
+bool fn_any_node(Function *fn, bool (*pred)(Node *)) {
+	for (Node *node = fn->node; node; node = node->next)
+		if (any_node(node, pred))
+			return true;
+	return false;
+}
+
+Var *addr_var;
+
+bool takes_addr_var(Node *node) {
+	return node->kind == ND_ADDR && node->lhs->kind == ND_VAR &&
+		   node->lhs->var == addr_var;
+}
+
+// Chooses the parameters that live in registers
+void assign_param_regs(Function *fn, bool is_leaf) {
+	nreg_vars = 0;
+	nsaved = 0;
 
-	for (Function *fn = prog->fns; fn; fn = fn->next) {
-		printf(".global %s\n", fn->name);
-		printf("%s:\n", fn->name);
-		funcname = fn->name;
-
-		// Prologue
-		printf("	push rbp\n");
-		printf("	mov rbp, rsp\n");
-		printf("	sub rsp, %d\n", fn->stack_size);
-
-		// Push arguments to the stack
-		int i = 0;
-		for (VarList *vl = fn->params; vl; vl = vl->next)
-			load_arg(vl->var, i++);
-
-		// Emit code
-		for (Node *node = fn->node; node; node = node->next)
-			gen(node);
-
-		// Epilogue
-		printf(".Lreturn.%s:\n", funcname);
-		printf("	mov rsp, rbp\n");
-		printf("	pop rbp\n");
-		printf("	ret\n");
+	int i = 0;
+	for (VarList *vl = fn->params; vl && i < 6; vl = vl->next, i++) {
+		Var *var = vl->var;
+		addr_var = var;
+		if (var->ty->kind == TY_ARRAY || fn_any_node(fn, takes_addr_var))
+			continue;
+
+		if (is_leaf) {
+			var_regs[nreg_vars] = leaf_regs[i];
+		} else {
+			if (nsaved == sizeof(callee_saved) / sizeof(*callee_saved))
+				continue;
+			var_regs[nreg_vars] = callee_saved[nsaved++];
+		}
+		reg_vars[nreg_vars++] = var;
+	}
+}
+
+// Restores callee-saved registers and tears down the frame
+void gen_epilogue() {
+	if (!has_frame)
+		return;
+	for (int i = 0; i < nsaved; i++)
+		printf("	mov %s, [rbp-%d]\n", callee_saved[i], stack_size + i * 8 + 8);
+	emit_frame_teardown();
+}
+
+void codegen_fn(Function *fn) {
+	emit_fn_start(fn);
+	funcname = fn->name;
+	gen_fn = fn;
+	labelseq = 0;
+	return_label = new_code_label("return");
+	unreachable = false;
+
+	bool is_leaf = !fn_any_node(fn, is_funcall);
+	assign_param_regs(fn, is_leaf);
+
+	// A leaf function without locals in memory never touches RBP,
+	// so it doesn't need a frame. The hooks need one.
+	instrumented = is_instrumented(fn);
+	has_frame = !is_leaf || instrumented || fn_any_node(fn, returns_from_stmt_expr);
+	for (VarList *vl = fn->locals; vl; vl = vl->next)
+		if (!var_reg(vl->var))
+			has_frame = true;
+
+	// A tail call frees our frame before the callee runs,
+	// so it must not be able to see a pointer into it.
+	can_tail_call = !fn_any_node(fn, is_local_addr);
+
+	// Prologue. RSP is kept 16-byte aligned relative to the
+	// values pushed by the stack machine, which are counted in `depth`.
+	stack_size = fn->stack_size;
+	if (has_frame) {
+		emit_frame_setup();
+		printf("	sub rsp, %d\n", align_to(stack_size + nsaved * 8, 16));
+		for (int i = 0; i < nsaved; i++) {
+			printf("	mov [rbp-%d], %s\n", stack_size + i * 8 + 8, callee_saved[i]);
+			emit_cfi_saved(callee_saved[i], stack_size + i * 8 + 8);
+		}
 	}
+	depth = 0;
+
+	if (instrumented)
+		emit_enter_hook(fn);
+
+	// Move arguments to their registers or stack slots
+	int i = 0;
+	for (VarList *vl = fn->params; vl; vl = vl->next)
+		load_arg(vl->var, i++);
+
+	if (profile_generate)
+		emit_counter(fn->name, 0);
+
+	// Emit code
+	for (Node *node = fn->node; node; node = node->next) {
+		if (!node->next)
+			cont_label = return_label;
+		gen(node);
+	}
+
+	// Epilogue
+	emit_label(return_label);
+	if (instrumented)
+		emit_exit_hook(fn);
+	gen_epilogue();
+	printf("	ret\n");
+	emit_fn_end(fn);
+
+	if (profile_generate)
+		emit_profile_table(fn);
+	if (instrumented)
+		emit_function_name(fn);
 }
 
+void emit_text(Program *prog) {
+	printf(".text\n");
+	for (Function *fn = prog->fns; fn; fn = fn->next)
+		codegen_fn(fn);
+}
 
 void codegen(Program *prog) {
 	printf(".intel_syntax noprefix\n");
+	emit_file_directive();
 	emit_data(prog);
 	emit_text(prog);
 }
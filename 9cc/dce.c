@@ -0,0 +1,297 @@
+#include "9cc.h"
+
+// Dead code elimination on the AST.
+//
+// Removes statements that can't be reached or have no effect, folds
+// branches on constant conditions and drops locals that are no longer
+// referenced, so that they don't take space in the frame.
+
+int removed_stmts;
+
+// Evaluates a constant integer expression.
+// Returns false if `node` is not a constant.
+bool eval_const(Node *node, long *val) {
+	long l, r;
+
+	switch (node->kind) {
+	case ND_NUM:
+		*val = node->val;
+		return true;
+	case ND_ADD:
+	case ND_SUB:
+	case ND_MUL:
+	case ND_DIV:
+	case ND_EQ:
+	case ND_NE:
+	case ND_LT:
+	case ND_LE:
+		if (node->lhs->ty->base || node->rhs->ty->base)
+			return false;
+		if (!eval_const(node->lhs, &l) || !eval_const(node->rhs, &r))
+			return false;
+		break;
+	default:
+		return false;
+	}
+
+	switch (node->kind) {
+	case ND_ADD:
+		*val = l + r;
+		return true;
+	case ND_SUB:
+		*val = l - r;
+		return true;
+	case ND_MUL:
+		*val = l * r;
+		return true;
+	case ND_DIV:
+		if (r == 0)
+			return false;
+		*val = l / r;
+		return true;
+	case ND_EQ:
+		*val = l == r;
+		return true;
+	case ND_NE:
+		*val = l != r;
+		return true;
+	case ND_LT:
+		*val = l < r;
+		return true;
+	default:
+		*val = l <= r;
+		return true;
+	}
+}
+
+// Returns true if evaluating an expression may do anything other
+// than computing its value. Statement expressions are assumed to.
+bool has_side_effects(Node *node) {
+	if (!node)
+		return false;
+
+	switch (node->kind) {
+	case ND_ASSIGN:
+	case ND_FUNCALL:
+	case ND_STMT_EXPR:
+		return true;
+	}
+	return has_side_effects(node->lhs) || has_side_effects(node->rhs);
+}
+
+// Returns true if control never falls through the statement
+bool terminates(Node *node) {
+	switch (node->kind) {
+	case ND_RETURN:
+		return true;
+	case ND_BLOCK: {
+		Node *last = node->body;
+		while (last->next)
+			last = last->next;
+		return terminates(last);
+	}
+	case ND_IF:
+		return node->els && terminates(node->then) && terminates(node->els);
+	}
+	return false;
+}
+
+Node *null_stmt(Node *node) {
+	return new_node(ND_NULL, node->tok);
+}
+
+Node *prune(Node *node);
+void prune_expr(Node *node);
+
+// Prunes a statement list. The last node of a statement expression is
+// its value, so it's always kept.
+Node *prune_list(Node *node, bool is_stmt_expr) {
+	Node head;
+	head.next = NULL;
+	Node *cur = &head;
+
+	for (Node *n = node; n;) {
+		Node *next = n->next;
+
+		if (is_stmt_expr && !next) {
+			prune_expr(n);
+			cur = cur->next = n;
+			break;
+		}
+
+		Node *stmt = prune(n);
+		if (stmt->kind != ND_NULL)
+			cur = cur->next = stmt;
+
+		if (stmt->kind != ND_NULL && terminates(stmt)) {
+			// The rest is unreachable
+			for (Node *m = next; m && (!is_stmt_expr || m->next); m = m->next) {
+				if (m->kind != ND_NULL)
+					removed_stmts++;
+				next = m->next;
+			}
+		}
+		n = next;
+	}
+
+	cur->next = NULL;
+	return head.next;
+}
+
+// Prunes statement expressions nested in an expression
+void prune_expr(Node *node) {
+	if (!node)
+		return;
+
+	prune_expr(node->lhs);
+	prune_expr(node->rhs);
+	for (Node *n = node->args; n; n = n->next)
+		prune_expr(n);
+
+	if (node->kind == ND_STMT_EXPR)
+		node->body = prune_list(node->body, true);
+}
+
+// Returns a pruned statement. ND_NULL is returned if nothing is left.
+Node *prune(Node *node) {
+	long val;
+
+	switch (node->kind) {
+	case ND_IF:
+		prune_expr(node->cond);
+		if (eval_const(node->cond, &val)) {
+			removed_stmts++;
+			if (val)
+				return prune(node->then);
+			return node->els ? prune(node->els) : null_stmt(node);
+		}
+
+		node->then = prune(node->then);
+		if (node->els) {
+			node->els = prune(node->els);
+			if (node->els->kind == ND_NULL)
+				node->els = NULL;
+		}
+		if (node->then->kind == ND_NULL && !node->els &&
+			!has_side_effects(node->cond)) {
+			removed_stmts++;
+			return null_stmt(node);
+		}
+		return node;
+	case ND_WHILE:
+		prune_expr(node->cond);
+		if (eval_const(node->cond, &val) && !val) {
+			removed_stmts++;
+			return null_stmt(node);
+		}
+		node->then = prune(node->then);
+		return node;
+	case ND_FOR:
+		if (node->init) {
+			node->init = prune(node->init);
+			if (node->init->kind == ND_NULL)
+				node->init = NULL;
+		}
+		if (node->cond) {
+			prune_expr(node->cond);
+			if (eval_const(node->cond, &val) && !val) {
+				removed_stmts++;
+				return node->init ? node->init : null_stmt(node);
+			}
+		}
+		node->then = prune(node->then);
+		if (node->inc) {
+			node->inc = prune(node->inc);
+			if (node->inc->kind == ND_NULL)
+				node->inc = NULL;
+		}
+		return node;
+	case ND_BLOCK:
+		node->body = prune_list(node->body, false);
+		if (!node->body)
+			return null_stmt(node);
+		return node;
+	case ND_EXPR_STMT:
+		prune_expr(node->lhs);
+		if (!has_side_effects(node->lhs)) {
+			removed_stmts++;
+			return null_stmt(node);
+		}
+		return node;
+	case ND_RETURN:
+		prune_expr(node->lhs);
+		return node;
+	}
+	return node;
+}
+
+VarList *used_vars;
+
+void mark_used(Node *node) {
+	if (!node)
+		return;
+
+	if (node->kind == ND_VAR) {
+		for (VarList *vl = used_vars; vl; vl = vl->next)
+			if (vl->var == node->var)
+				return;
+		VarList *vl = mem_alloc(MEM_OPT, sizeof(VarList));
+		vl->var = node->var;
+		vl->next = used_vars;
+		used_vars = vl;
+		return;
+	}
+
+	mark_used(node->lhs);
+	mark_used(node->rhs);
+	mark_used(node->cond);
+	mark_used(node->then);
+	mark_used(node->els);
+	mark_used(node->init);
+	mark_used(node->inc);
+	for (Node *n = node->body; n; n = n->next)
+		mark_used(n);
+	for (Node *n = node->args; n; n = n->next)
+		mark_used(n);
+}
+
+bool is_used(Function *fn, Var *var) {
+	for (VarList *vl = fn->params; vl; vl = vl->next)
+		if (vl->var == var)
+			return true;
+	for (VarList *vl = used_vars; vl; vl = vl->next)
+		if (vl->var == var)
+			return true;
+	return false;
+}
+
+// Removes dead code from all functions.
+// Stores the number of removed statements and locals in *nstmts and
+// *nvars.
+void eliminate_dead_code(Program *prog, int *nstmts, int *nvars) {
+	removed_stmts = 0;
+	*nvars = 0;
+
+	for (Function *fn = prog->fns; fn; fn = fn->next) {
+		fn->node = prune_list(fn->node, false);
+
+		used_vars = NULL;
+		for (Node *node = fn->node; node; node = node->next)
+			mark_used(node);
+
+		VarList head;
+		head.next = NULL;
+		VarList *cur = &head;
+
+		for (VarList *vl = fn->locals; vl; vl = vl->next) {
+			if (is_used(fn, vl->var))
+				cur = cur->next = vl;
+			else
+				(*nvars)++;
+		}
+		cur->next = NULL;
+		fn->locals = head.next;
+	}
+
+	*nstmts = removed_stmts;
+}
@@ -0,0 +1,111 @@
+#include "9cc.h"
+
+// Symbol and unwind information for profilers and debuggers.
+//
+// Each function is marked as a function symbol with a size, and its
+// frame is described with CFI directives, from which the assembler
+// builds .eh_frame, so that perf and gdb can unwind through it. With
+// -g, statements are also marked with .loc directives, from which the
+// assembler builds a DWARF line table.
+//
+// The frame is either RBP-based, in which case the CFA is RBP+16 from
+// the prologue on, or absent, in which case the CFA moves with every
+// push and pop of the stack machine.
+
+// Position of the last line_of() lookup
+char *line_input;
+char *line_pos;
+int line_no;
+
+// Line of the last .loc in the current function
+int loc_line;
+
+// Returns the line number of `loc` in the input. Statements are
+// mostly looked up in order, so the scan continues from the last
+// lookup when it can.
+int line_of(char *loc) {
+	if (line_input != user_input || loc < line_pos) {
+		line_input = user_input;
+		line_pos = user_input;
+		line_no = 1;
+	}
+	for (; line_pos < loc; line_pos++)
+		if (*line_pos == '\n')
+			line_no++;
+	return line_no;
+}
+
+void emit_file_directive() {
+	if (debug_info)
+		printf(".file 1 \"%s\"\n", filename);
+}
+
+// Marks the following code as coming from the line of `tok`
+void emit_loc(Token *tok) {
+	if (!debug_info || !tok)
+		return;
+	int line = line_of(tok->str);
+	if (line == loc_line)
+		return;
+	printf("	.loc 1 %d\n", line);
+	loc_line = line;
+}
+
+// Emitted for statements. Blocks have nothing of their own to mark.
+void emit_stmt_loc(Node *node) {
+	switch (node->kind) {
+	case ND_EXPR_STMT:
+	case ND_RETURN:
+	case ND_IF:
+	case ND_WHILE:
+	case ND_FOR:
+		emit_loc(node->tok);
+	}
+}
+
+void emit_fn_start(Function *fn) {
+	printf(".global %s\n", fn->name);
+	printf(".type %s, @function\n", fn->name);
+	printf("%s:\n", fn->name);
+	printf("	.cfi_startproc\n");
+	loc_line = 0;
+}
+
+void emit_fn_end(Function *fn) {
+	printf("	.cfi_endproc\n");
+	printf(".size %s, .-%s\n", fn->name, fn->name);
+}
+
+void emit_frame_setup() {
+	printf("	push rbp\n");
+	printf("	.cfi_def_cfa_offset 16\n");
+	printf("	.cfi_offset rbp, -16\n");
+	printf("	mov rbp, rsp\n");
+	printf("	.cfi_def_cfa_register rbp\n");
+}
+
+void emit_frame_teardown() {
+	printf("	mov rsp, rbp\n");
+	printf("	pop rbp\n");
+	printf("	.cfi_def_cfa rsp, 8\n");
+}
+
+// Records that callee-saved register `reg` was saved at [rbp-offset]
+void emit_cfi_saved(char *reg, int offset) {
+	printf("	.cfi_offset %s, %d\n", reg, -offset - 16);
+}
+
+// A tail call tears down the frame in the middle of the function.
+// The code after its jump still runs in the frame.
+void emit_cfi_remember() {
+	printf("	.cfi_remember_state\n");
+}
+
+void emit_cfi_restore() {
+	printf("	.cfi_restore_state\n");
+}
+
+// Records that RSP moved by `bytes` in a function without a frame
+void emit_cfi_adjust(int bytes) {
+	printf("	.cfi_adjust_cfa_offset %d\n", bytes);
+}
@@ -0,0 +1,67 @@
+#include "9cc.h"
+
+// Assigns stack offsets to local variables.
+//
+// Each variable is aligned to its natural alignment. Variables are
+// placed in order of decreasing alignment to reduce padding, and the
+// order is otherwise kept. Variables whose block scopes don't overlap
+// are never alive at the same time, so they may share stack slots.
+// Each variable goes to the lowest offset that doesn't overlap with a
+// variable already placed whose scope overlaps its own.
+
+bool scopes_overlap(Var *a, Var *b) {
+	return a->scope_begin <= b->scope_end && b->scope_begin <= a->scope_end;
+}
+
+// Returns true if the stack ranges of two placed variables overlap
+bool slots_overlap(Var *a, int offset, int size, Var *b) {
+	int b_size = size_of(b->ty);
+	return offset - size < b->offset && b->offset - b_size < offset;
+}
+
+// Returns the offset for `var`, given the variables placed before it
+int find_offset(Var *var, Var **placed, int nplaced) {
+	int size = size_of(var->ty);
+	int align = align_of(var->ty);
+
+	for (int offset = align_to(size, align);; offset += align) {
+		bool ok = true;
+		for (int i = 0; i < nplaced && ok; i++)
+			if (scopes_overlap(var, placed[i]) &&
+				slots_overlap(var, offset, size, placed[i]))
+				ok = false;
+		if (ok)
+			return offset;
+	}
+}
+
+// Sets the offsets of the locals of `fn` and its stack size.
+// Returns the number of bytes saved compared to giving every
+// variable its own slot.
+int layout_frame(Function *fn) {
+	int n = 0;
+	for (VarList *vl = fn->locals; vl; vl = vl->next)
+		n++;
+
+	// Stable sort by decreasing alignment
+	Var **vars = mem_alloc(MEM_OPT, n * sizeof(Var *));
+	int i = 0;
+	for (int align = 8; align > 0; align /= 2)
+		for (VarList *vl = fn->locals; vl; vl = vl->next)
+			if (align_of(vl->var->ty) == align)
+				vars[i++] = vl->var;
+	assert(i == n);
+
+	int stack_size = 0;
+	int unshared = 0;
+	for (i = 0; i < n; i++) {
+		Var *var = vars[i];
+		var->offset = find_offset(var, vars, i);
+		if (var->offset > stack_size)
+			stack_size = var->offset;
+		unshared += size_of(var->ty);
+	}
+
+	fn->stack_size = align_to(stack_size, 8);
+	return align_to(unshared, 8) - fn->stack_size;
+}
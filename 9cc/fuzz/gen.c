@@ -0,0 +1,528 @@
+// Random program generator for fuzz/run.sh. Prints a program in the
+// subset of C that 9cc accepts to stdout.
+//
+//   gen SEED [REPS]
+//
+// The programs use globals, pointers, arrays, for and while loops, if
+// statements and statement expressions, and main() prints a hash of
+// everything they compute. They are written so that 9cc and gcc must
+// agree on the output:
+//
+//  - 9cc evaluates every expression in 64 bits and only truncates on
+//    stores, so all arithmetic has a long operand and gcc wraps on
+//    overflow with -fwrapv, as 9cc does.
+//  - Array indices are constants or loop counters whose loop stays in
+//    bounds, and every variable is assigned before it is read.
+//  - Assignments and calls are statements, never operands, so the
+//    order of evaluation of operands doesn't matter.
+//  - Divisors are constants other than 0 and -1.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define LEN 16       // Length of every array
+#define MAX_FUNCS 5
+#define MAX_DEPTH 3  // Nesting of expressions
+#define MAX_LOOPS 2  // Nesting of loops
+
+typedef enum { CHAR, INT, LONG } Kind;
+
+char *kind_names[] = {"char", "int", "long"};
+
+typedef struct {
+	char name[16];
+	Kind kind;
+	bool array;   // An array of LEN elements
+	bool ptr;     // A pointer to one
+	bool counter; // A loop counter, which only loops assign
+} Var;
+
+Var vars[256];
+int nvars;
+int nglobals;
+
+int nfuncs;
+int cur_fn;     // Functions may call only those defined before them
+int loop_depth; // Counters i0..i<loop_depth-1> are in bounds
+int indent;
+int ntemps;     // Statement expression temporaries in the function
+int ncalls;
+
+unsigned long rng = 88172645463325252UL;
+
+int rnd(int n) {
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng % n;
+}
+
+bool chance(int percent) {
+	return rnd(100) < percent;
+}
+
+void tab() {
+	for (int i = 0; i < indent; i++)
+		printf("\t");
+}
+
+Var *add_var(Kind kind, bool array, bool ptr) {
+	Var *v = &vars[nvars];
+	char *prefix = ptr ? "p" : array ? "a" : "v";
+	if (nvars < nglobals || cur_fn < 0)
+		prefix = ptr ? "gp" : array ? "ga" : "g";
+	snprintf(v->name, sizeof(v->name), "%s%d", prefix, nvars);
+	v->kind = kind;
+	v->array = array;
+	v->ptr = ptr;
+	v->counter = false;
+	nvars++;
+	return v;
+}
+
+// Picks a random variable matching the predicate, or returns NULL
+Var *pick(bool (*pred)(Var *, Kind), Kind kind) {
+	int n = 0;
+	for (int i = 0; i < nvars; i++)
+		if (pred(&vars[i], kind))
+			n++;
+	if (n == 0)
+		return NULL;
+	int k = rnd(n);
+	for (int i = 0; i < nvars; i++)
+		if (pred(&vars[i], kind) && k-- == 0)
+			return &vars[i];
+	return NULL;
+}
+
+bool is_scalar(Var *v, Kind kind) {
+	return !v->array && !v->ptr && v->kind == kind;
+}
+
+bool is_assignable(Var *v, Kind kind) {
+	return !v->array && !v->ptr && !v->counter;
+}
+
+bool is_indexable(Var *v, Kind kind) {
+	return v->array || v->ptr;
+}
+
+bool is_indexable_kind(Var *v, Kind kind) {
+	return (v->array || v->ptr) && v->kind == kind;
+}
+
+bool is_global_array(Var *v, Kind kind) {
+	return v - vars < nglobals && v->array && v->kind == kind;
+}
+
+bool is_array(Var *v, Kind kind) {
+	return v->array && v->kind == kind;
+}
+
+bool is_ptr(Var *v, Kind kind) {
+	return v->ptr;
+}
+
+// An index in [0, LEN)
+void index_expr() {
+	if (loop_depth > 0 && chance(70)) {
+		int d = rnd(loop_depth);
+		if (chance(25))
+			printf("%d - i%d", LEN - 1, d);
+		else
+			printf("i%d", d);
+		return;
+	}
+	printf("%d", rnd(LEN));
+}
+
+void element(Var *v) {
+	if (v->ptr && chance(50)) {
+		printf("*(%s + ", v->name);
+		index_expr();
+		printf(")");
+		return;
+	}
+	printf("%s[", v->name);
+	index_expr();
+	printf("]");
+}
+
+void any_expr(int depth);
+
+// Prints an expression of type long
+void long_expr(int depth) {
+	int r = rnd(depth < MAX_DEPTH ? 10 : 4);
+	Var *v;
+
+	switch (r) {
+	case 0:
+	case 1:
+		if ((v = pick(is_scalar, LONG))) {
+			printf("%s", v->name);
+			return;
+		}
+		break;
+	case 2:
+	case 3:
+		if ((v = pick(is_indexable_kind, LONG))) {
+			element(v);
+			return;
+		}
+		break;
+	case 4:
+	case 5:
+	case 6: {
+		char *op = (char *[]){"+", "-", "*"}[rnd(3)];
+		printf("(");
+		if (chance(50)) {
+			long_expr(depth + 1);
+			printf(" %s ", op);
+			any_expr(depth + 1);
+		} else {
+			any_expr(depth + 1);
+			printf(" %s ", op);
+			long_expr(depth + 1);
+		}
+		printf(")");
+		return;
+	}
+	case 7:
+		printf("(");
+		long_expr(depth + 1);
+		if (chance(70))
+			printf(" / %d)", 2 + rnd(19));
+		else
+			printf(" / (0 - %d))", 2 + rnd(19));
+		return;
+	case 8: {
+		// A statement expression with its own temporary
+		int t = ntemps++;
+		printf("({ long t%d = ", t);
+		long_expr(depth + 1);
+		printf("; ");
+		for (int i = rnd(3); i > 0; i--) {
+			printf("t%d = (t%d %s ", t, t, (char *[]){"+", "-", "*"}[rnd(3)]);
+			any_expr(depth + 1);
+			printf("); ");
+		}
+		printf("t%d; })", t);
+		return;
+	}
+	case 9:
+		// Through its address, which keeps it in memory
+		if ((v = pick(is_scalar, LONG))) {
+			printf("*&%s", v->name);
+			return;
+		}
+		break;
+	}
+
+	if ((v = pick(is_scalar, LONG)))
+		printf("%s", v->name);
+	else
+		printf("i0");
+}
+
+// Prints an expression of any type. Those that aren't long are
+// small, so that no operation on them can overflow an int.
+void any_expr(int depth) {
+	Var *v;
+
+	switch (rnd(depth < MAX_DEPTH ? 6 : 5)) {
+	case 0:
+	case 1:
+		long_expr(depth);
+		return;
+	case 2:
+		if ((v = pick(is_scalar, rnd(2) ? CHAR : INT))) {
+			printf("%s", v->name);
+			return;
+		}
+		break;
+	case 3:
+		if ((v = pick(is_indexable_kind, rnd(2) ? CHAR : INT))) {
+			element(v);
+			return;
+		}
+		break;
+	case 5:
+		printf("(");
+		any_expr(depth + 1);
+		printf(" %s ", (char *[]){"==", "!=", "<", "<=", ">", ">="}[rnd(6)]);
+		any_expr(depth + 1);
+		printf(")");
+		return;
+	}
+	printf("%d", rnd(100));
+}
+
+void stmts(int n);
+
+void block(int n) {
+	printf("{\n");
+	indent++;
+	stmts(n);
+	indent--;
+	tab();
+	printf("}");
+}
+
+void loop_header(int d, int start, int end) {
+	printf("for (i%d = %d; i%d < %d; i%d = i%d + 1) ", d, start, d, end, d, d);
+}
+
+// The loops that loop.c vectorizes
+void vector_loop() {
+	int d = loop_depth;
+	Var *dst = pick(is_indexable, 0);
+	if (!dst)
+		return;
+
+	tab();
+	loop_header(d, rnd(4), LEN - rnd(4));
+	loop_depth++;
+	Var *src = pick(is_indexable_kind, dst->kind);
+	Var *sum = pick(is_assignable, 0);
+	switch (rnd(3)) {
+	case 0:
+		printf("%s[i%d] = ", dst->name, d);
+		any_expr(MAX_DEPTH);
+		break;
+	case 1:
+		printf("%s[i%d] = %s[i%d]", dst->name, d, src->name, d);
+		break;
+	case 2:
+		printf("%s = %s + %s[i%d]", sum->name, sum->name, src->name, d);
+		break;
+	}
+	printf(";\n");
+	loop_depth--;
+}
+
+void stmt() {
+	Var *v;
+
+	switch (rnd(loop_depth < MAX_LOOPS ? 11 : 7)) {
+	case 0:
+	case 1:
+		if ((v = pick(is_assignable, 0))) {
+			tab();
+			printf("%s = ", v->name);
+			any_expr(0);
+			printf(";\n");
+			return;
+		}
+		break;
+	case 2:
+	case 3:
+		if ((v = pick(is_indexable, 0))) {
+			tab();
+			element(v);
+			printf(" = ");
+			any_expr(0);
+			printf(";\n");
+			return;
+		}
+		break;
+	case 4:
+		tab();
+		printf("if (");
+		any_expr(1);
+		printf(") ");
+		block(1 + rnd(3));
+		if (chance(50)) {
+			printf(" else ");
+			block(1 + rnd(3));
+		}
+		printf("\n");
+		return;
+	case 5:
+		// Calls are statements and not in loops, so that their side
+		// effects are ordered and their number is bounded
+		if (cur_fn > 0 && loop_depth == 0 && ncalls < 2) {
+			int callee = rnd(cur_fn);
+			ncalls++;
+			tab();
+			printf("h = h * 31 + f%d(", callee);
+			for (int i = 0; i < 6; i++) {
+				if (i > 0)
+					printf(", ");
+				any_expr(1);
+			}
+			Var *a = pick(is_global_array, LONG);
+			printf(", %s);\n", a->name);
+			return;
+		}
+		break;
+	case 6:
+		if ((v = pick(is_ptr, 0))) {
+			Var *a = pick(is_array, v->kind);
+			tab();
+			printf("%s = %s;\n", v->name, a->name);
+			return;
+		}
+		break;
+	case 7:
+	case 8: {
+		int d = loop_depth++;
+		tab();
+		loop_header(d, rnd(4), LEN - rnd(8));
+		block(1 + rnd(3));
+		printf("\n");
+		loop_depth--;
+		return;
+	}
+	case 9: {
+		int d = loop_depth++;
+		tab();
+		printf("i%d = %d;\n", d, rnd(4));
+		tab();
+		printf("while (i%d < %d) {\n", d, LEN - rnd(8));
+		indent++;
+		stmts(1 + rnd(3));
+		tab();
+		printf("i%d = i%d + 1;\n", d, d);
+		indent--;
+		tab();
+		printf("}\n");
+		loop_depth--;
+		return;
+	}
+	case 10:
+		vector_loop();
+		return;
+	}
+
+	tab();
+	printf("h = h * 31 + ");
+	long_expr(0);
+	printf(";\n");
+}
+
+void stmts(int n) {
+	for (int i = 0; i < n; i++)
+		stmt();
+}
+
+// Prints a statement adding the values of `v` to h
+void hash_var(Var *v) {
+	tab();
+	if (v->array)
+		printf("for (i0 = 0; i0 < %d; i0 = i0 + 1) h = h * 31 + %s[i0];\n",
+			   LEN, v->name);
+	else
+		printf("h = h * 31 + %s;\n", v->name);
+}
+
+void function(int n) {
+	cur_fn = n;
+	nvars = nglobals;
+	ntemps = 0;
+	ncalls = 0;
+	indent = 1;
+
+	// Six scalars and a pointer to a global long array
+	Var *params[6];
+	printf("long f%d(", n);
+	for (int i = 0; i < 6; i++) {
+		params[i] = add_var(rnd(3), false, false);
+		printf("%s %s, ", kind_names[params[i]->kind], params[i]->name);
+	}
+	Var *p = add_var(LONG, false, true);
+	printf("long *%s) {\n", p->name);
+	printf("\tlong h = %d;\n", rnd(100));
+	for (int i = 0; i < MAX_LOOPS; i++) {
+		printf("\tlong i%d = 0;\n", i);
+		Var *v = add_var(LONG, false, false);
+		snprintf(v->name, sizeof(v->name), "i%d", i);
+		v->counter = true;
+	}
+
+	for (int i = 1 + rnd(4); i > 0; i--) {
+		Var *v = add_var(rnd(3), false, false);
+		nvars--; // Not readable in its own initializer
+		printf("\t%s %s = ", kind_names[v->kind], v->name);
+		any_expr(1);
+		nvars++;
+		printf(";\n");
+	}
+
+	for (int i = rnd(3); i > 0; i--) {
+		Var *v = add_var(rnd(3), true, false);
+		printf("\t%s %s[%d];\n", kind_names[v->kind], v->name, LEN);
+		printf("\tfor (i0 = 0; i0 < %d; i0 = i0 + 1) %s[i0] = i0 * %d + %d;\n",
+			   LEN, v->name, rnd(50), rnd(50));
+	}
+
+	if (chance(50)) {
+		Var *a = pick(is_array, rnd(3));
+		if (a) {
+			Var *q = add_var(a->kind, false, true);
+			printf("\t%s *%s = %s;\n", kind_names[a->kind], q->name, a->name);
+		}
+	}
+
+	stmts(3 + rnd(8));
+
+	for (int i = nglobals; i < nvars; i++)
+		if (!vars[i].ptr && !vars[i].counter)
+			hash_var(&vars[i]);
+	printf("\treturn h;\n}\n\n");
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s SEED [REPS]\n", argv[0]);
+		return 1;
+	}
+	rng += strtoul(argv[1], NULL, 10) * 2654435761UL;
+	int reps = argc > 2 ? atoi(argv[2]) : 1000;
+	for (int i = 0; i < 16; i++)
+		rnd(1);
+
+	printf("// Generated by fuzz/gen %s\n\n", argv[1]);
+
+	// Globals are zero, so they are readable from the start. There
+	// is always a long array to pass to functions.
+	cur_fn = -1;
+	Var *a = add_var(LONG, true, false);
+	printf("long %s[%d];\n", a->name, LEN);
+	for (int i = rnd(6); i > 0; i--) {
+		Var *v = add_var(rnd(3), chance(40), false);
+		if (v->array)
+			printf("%s %s[%d];\n", kind_names[v->kind], v->name, LEN);
+		else
+			printf("%s %s;\n", kind_names[v->kind], v->name);
+	}
+	nglobals = nvars;
+	printf("\n");
+
+	nfuncs = 1 + rnd(MAX_FUNCS);
+	for (int i = 0; i < nfuncs; i++)
+		function(i);
+
+	// main() calls each function with arguments depending on the
+	// repetition, and prints the hash of the results and the globals
+	cur_fn = -1;
+	nvars = nglobals;
+	printf("int main() {\n");
+	printf("\tlong h = 0;\n");
+	printf("\tlong r = 0;\n");
+	printf("\tlong i0 = 0;\n");
+	indent = 1;
+	printf("\tfor (r = 0; r < %d; r = r + 1) {\n", reps);
+	for (int i = 0; i < nfuncs; i++) {
+		printf("\t\th = h * 31 + f%d(r", i);
+		for (int j = 1; j < 6; j++)
+			printf(", r * %d + %d", rnd(10), rnd(100));
+		printf(", %s);\n", a->name);
+	}
+	printf("\t}\n");
+	for (int i = 0; i < nglobals; i++)
+		hash_var(&vars[i]);
+	printf("\tprintf(\"%%ld\\n\", h);\n");
+	printf("\treturn 0;\n}\n");
+	return 0;
+}
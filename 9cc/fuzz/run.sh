@@ -0,0 +1,96 @@
+#!/bin/bash
+# Differential fuzzing. Generates random programs with gen.c, builds
+# each with gcc -O0 as the reference and with gcc -O2, 9cc, 9cc -O and
+# 9cc --interp, and checks that they all print the same.
+#
+# The instruction count of the assembly and the run time of each build
+# are printed per program and in total, so that a change to the code
+# generators shows up both as a mismatch and as a slowdown.
+#
+#   N=50 SEED=1 REPS=1000 ./fuzz/run.sh
+#
+# A program whose outputs differ is kept as fuzz/fail-<seed>.c, and the
+# run fails.
+set -e
+cd "$(dirname "$0")"
+
+N=${N:-50}       # Number of programs
+SEED=${SEED:-1}  # Seed of the first one
+REPS=${REPS:-1000} # Times main() runs the functions of a program
+
+modes=(gcc-O0 gcc-O2 9cc 9cc-O interp)
+
+gcc -O2 -o tmp-gen gen.c
+
+# Prints the milliseconds between two $EPOCHREALTIME values
+ms() {
+	echo $(( (${2/[.,]/} - ${1/[.,]/}) / 1000 ))
+}
+
+# Writes tmp-<mode>.s for a mode that compiles to assembly
+build() {
+	case $1 in
+	gcc-O0) gcc -O0 -fwrapv -w -include stdio.h -S -o tmp-$1.s tmp-prog.c ;;
+	gcc-O2) gcc -O2 -fwrapv -w -include stdio.h -S -o tmp-$1.s tmp-prog.c ;;
+	9cc) ../9cc tmp-prog.c > tmp-$1.s ;;
+	9cc-O) ../9cc -O tmp-prog.c > tmp-$1.s ;;
+	esac
+}
+
+declare -A total_insns total_ms
+printf "%-6s" seed
+for m in "${modes[@]}"; do
+	printf " %15s" "$m"
+done
+printf "\n"
+
+failed=0
+for ((seed = SEED; seed < SEED + N; seed++)); do
+	./tmp-gen $seed $REPS > tmp-prog.c
+	line=$(printf "%-6d" $seed)
+	ok=1
+	for m in "${modes[@]}"; do
+		# The interpreter has no assembly, and its run time includes
+		# compiling
+		insns=-
+		if [ $m = interp ]; then
+			t0=$EPOCHREALTIME
+			../9cc --interp tmp-prog.c > tmp-$m.out 2>&1 || echo "exit $?" >> tmp-$m.out
+			t1=$EPOCHREALTIME
+		else
+			if ! build $m || ! gcc -static -o tmp-$m tmp-$m.s 2> /dev/null; then
+				echo "$m: build failed" > tmp-$m.out
+				ok=
+				break
+			fi
+			insns=$(grep -c $'^\t[a-z]' tmp-$m.s)
+			t0=$EPOCHREALTIME
+			./tmp-$m > tmp-$m.out 2>&1 || echo "exit $?" >> tmp-$m.out
+			t1=$EPOCHREALTIME
+		fi
+		t=$(ms $t0 $t1)
+		[ $insns = - ] || total_insns[$m]=$((${total_insns[$m]:-0} + insns))
+		total_ms[$m]=$((${total_ms[$m]:-0} + t))
+		line+=$(printf " %7s %5dms" $insns $t)
+		if ! cmp -s tmp-gcc-O0.out tmp-$m.out; then
+			ok=
+			break
+		fi
+	done
+	echo "$line"
+	if [ -z "$ok" ]; then
+		cp tmp-prog.c fail-$seed.c
+		echo "seed $seed: $m differs from gcc-O0, kept as fuzz/fail-$seed.c"
+		diff tmp-gcc-O0.out tmp-$m.out | head -5 | sed 's/^/    /' || true
+		failed=$((failed + 1))
+	fi
+done
+
+printf "%-6s" total
+for m in "${modes[@]}"; do
+	printf " %7s %5dms" "${total_insns[$m]:--}" "${total_ms[$m]:-0}"
+done
+printf "\n"
+echo "$N programs: $failed failed"
+
+[ $failed = 0 ]
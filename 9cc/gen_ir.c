@@ -0,0 +1,416 @@
+#include "9cc.h"
+
+// Lowers the typed AST to a linear IR: basic blocks of three-address
+// instructions over an unlimited number of virtual registers.
+// Local variables live in memory; they are accessed with explicit
+// IR_LVAR and IR_LOAD/IR_STORE instructions.
+
+Function *ir_fn;
+BB *out;      // Current basic block
+IR *out_last; // Last instruction of the current basic block
+BB *last_bb;  // Last basic block of the current function
+Token *stmt_tok; // Statement being lowered
+bool ir_can_tail_call;
+
+// A new block runs as often as the current one unless the profile
+// says otherwise
+BB *new_bb() {
+	BB *bb = mem_alloc(MEM_IR, sizeof(BB));
+	bb->label = ir_fn->nlabel++;
+	bb->count = out ? out->count : -1;
+	return bb;
+}
+
+Reg *new_reg() {
+	Reg *r = mem_alloc(MEM_IR, sizeof(Reg));
+	r->vn = ir_fn->nreg++;
+	return r;
+}
+
+IR *new_ir(IROp op) {
+	IR *ir = mem_alloc(MEM_IR, sizeof(IR));
+	ir->op = op;
+	return ir;
+}
+
+IR *emit(IROp op, Reg *r0, Reg *r1, Reg *r2) {
+	IR *ir = new_ir(op);
+	ir->r0 = r0;
+	ir->r1 = r1;
+	ir->r2 = r2;
+	ir->tok = stmt_tok;
+
+	if (out_last)
+		out_last->next = ir;
+	else
+		out->ir = ir;
+	out_last = ir;
+	return ir;
+}
+
+bool is_terminated() {
+	return out_last && (out_last->op == IR_JMP || out_last->op == IR_BR ||
+						out_last->op == IR_RET);
+}
+
+void jmp(BB *bb) {
+	IR *ir = emit(IR_JMP, NULL, NULL, NULL);
+	ir->bb1 = bb;
+}
+
+void br(Reg *r, BB *then, BB *els) {
+	IR *ir = emit(IR_BR, NULL, r, NULL);
+	ir->bb1 = then;
+	ir->bb2 = els;
+}
+
+// Starts emitting code to `bb`. If the current block doesn't end with
+// a jump, it falls through to `bb`.
+void start_bb(BB *bb) {
+	if (out && !is_terminated())
+		jmp(bb);
+
+	if (last_bb)
+		last_bb->next = bb;
+	else
+		ir_fn->bb = bb;
+	last_bb = bb;
+	out = bb;
+	out_last = NULL;
+}
+
+Reg *imm(long val) {
+	Reg *r = new_reg();
+	IR *ir = emit(IR_IMM, r, NULL, NULL);
+	ir->imm = val;
+	return r;
+}
+
+// Counts an edge of a statement with -fprofile-generate
+void count_ir(Node *node, int k) {
+	if (!profile_generate || !node->prof_fn)
+		return;
+	IR *ir = emit(IR_COUNT, NULL, NULL, NULL);
+	ir->name = node->prof_fn;
+	ir->imm = node->prof_id + k;
+}
+
+void set_count(BB *bb, long count) {
+	if (count >= 0)
+		bb->count = count;
+}
+
+Reg *gen_expr(Node *node);
+void gen_stmt(Node *node);
+
+// Returns a register holding the address of the given node
+Reg *gen_addr_ir(Node *node) {
+	switch (node->kind) {
+	case ND_VAR: {
+		Reg *r = new_reg();
+		IR *ir = emit(node->var->is_local ? IR_LVAR : IR_GVAR, r, NULL, NULL);
+		ir->var = node->var;
+		return r;
+	}
+	case ND_DEREF:
+		return gen_expr(node->lhs);
+	}
+
+	error_tok(node->tok, "not an lvalue");
+}
+
+Reg *gen_lval_ir(Node *node) {
+	if (node->ty->kind == TY_ARRAY)
+		error_tok(node->tok, "not an lvalue");
+	return gen_addr_ir(node);
+}
+
+Reg *load_ir(Type *ty, Reg *addr) {
+	if (ty->kind == TY_ARRAY)
+		return addr;
+
+	Reg *r = new_reg();
+	IR *ir = emit(IR_LOAD, r, addr, NULL);
+	ir->size = size_of(ty);
+	return r;
+}
+
+Reg *gen_binop(IROp op, Node *node) {
+	Reg *lhs = gen_expr(node->lhs);
+	int scale = 1;
+	if ((op == IR_ADD || op == IR_SUB) && node->ty->base)
+		scale = size_of(node->ty->base);
+
+	// Use an immediate operand if it fits in 32 bits
+	if (node->rhs->kind == ND_NUM && (op != IR_DIV || node->rhs->val != 0)) {
+		long val = node->rhs->val * scale;
+		if (val == (int)val) {
+			Reg *r = new_reg();
+			IR *ir = emit(op, r, lhs, NULL);
+			ir->imm = val;
+			return r;
+		}
+	}
+
+	Reg *rhs = gen_expr(node->rhs);
+	if (scale != 1) {
+		Reg *scaled = new_reg();
+		IR *ir = emit(IR_MUL, scaled, rhs, NULL);
+		ir->imm = scale;
+		rhs = scaled;
+	}
+
+	Reg *r = new_reg();
+	emit(op, r, lhs, rhs);
+	return r;
+}
+
+Reg *gen_funcall(Node *node, bool is_tail) {
+	int nargs = 0;
+	for (Node *arg = node->args; arg; arg = arg->next)
+		nargs++;
+
+	// Arguments passed on the stack would be in our frame
+	if (nargs > 6 || !can_return_call(ir_fn, node))
+		is_tail = false;
+
+	Reg **args = mem_alloc(MEM_IR, nargs * sizeof(Reg *));
+	int i = 0;
+	for (Node *arg = node->args; arg; arg = arg->next)
+		args[i++] = gen_expr(arg);
+
+	Reg *r = new_reg();
+	IR *ir = emit(IR_CALL, r, NULL, NULL);
+	ir->name = node->funcname;
+	ir->args = args;
+	ir->nargs = nargs;
+	ir->is_tail = is_tail;
+
+	// The upper bits of a char or int result are unspecified. A tail
+	// call leaves them to our caller.
+	int size = size_of(node->ty);
+	if (is_tail || size == 8)
+		return r;
+	Reg *val = new_reg();
+	IR *cast = emit(IR_CAST, val, r, NULL);
+	cast->size = size;
+	return val;
+}
+
+Reg *gen_expr(Node *node) {
+	switch (node->kind) {
+	case ND_NUM:
+		return imm(node->val);
+	case ND_VAR:
+		return load_ir(node->ty, gen_addr_ir(node));
+	case ND_DEREF:
+		return load_ir(node->ty, gen_expr(node->lhs));
+	case ND_ADDR:
+		return gen_addr_ir(node->lhs);
+	case ND_ASSIGN: {
+		Reg *addr = gen_lval_ir(node->lhs);
+		Reg *val = gen_expr(node->rhs);
+		IR *ir = emit(IR_STORE, NULL, addr, val);
+		ir->size = size_of(node->ty);
+		return val;
+	}
+	case ND_FUNCALL:
+		return gen_funcall(node, false);
+	case ND_STMT_EXPR: {
+		Node *n = node->body;
+		for (; n->next; n = n->next)
+			gen_stmt(n);
+		return gen_expr(n);
+	}
+	case ND_ADD:
+		return gen_binop(IR_ADD, node);
+	case ND_SUB:
+		return gen_binop(IR_SUB, node);
+	case ND_MUL:
+		return gen_binop(IR_MUL, node);
+	case ND_DIV:
+		return gen_binop(IR_DIV, node);
+	case ND_EQ:
+		return gen_binop(IR_EQ, node);
+	case ND_NE:
+		return gen_binop(IR_NE, node);
+	case ND_LT:
+		return gen_binop(IR_LT, node);
+	case ND_LE:
+		return gen_binop(IR_LE, node);
+	case ND_VFILL:
+	case ND_VCOPY: {
+		Reg *addr = gen_expr(node->lhs);
+		IR *ir = emit(node->kind == ND_VFILL ? IR_VFILL : IR_VCOPY, NULL, addr,
+					  gen_expr(node->rhs));
+		ir->imm = node->val;
+		ir->size = size_of(node->ty);
+		return addr;
+	}
+	case ND_VSUM: {
+		Reg *r = new_reg();
+		IR *ir = emit(IR_VSUM, r, gen_expr(node->lhs), NULL);
+		ir->imm = node->val;
+		ir->size = size_of(node->ty);
+		return r;
+	}
+	}
+
+	error_tok(node->tok, "invalid expression");
+}
+
+void gen_stmt(Node *node) {
+	if (node->kind != ND_BLOCK)
+		stmt_tok = node->tok;
+
+	switch (node->kind) {
+	case ND_NULL:
+		return;
+	case ND_EXPR_STMT:
+		gen_expr(node->lhs);
+		return;
+	case ND_RETURN: {
+		Reg *r;
+		if (node->lhs->kind == ND_FUNCALL && ir_can_tail_call)
+			r = gen_funcall(node->lhs, true);
+		else
+			r = gen_expr(node->lhs);
+		emit(IR_RET, NULL, r, NULL);
+
+		// Code after return is unreachable
+		start_bb(new_bb());
+		return;
+	}
+	case ND_IF: {
+		bool has_els = node->els || profile_generate;
+		BB *then = new_bb();
+		BB *els = new_bb();
+		BB *last = has_els ? new_bb() : els;
+		set_count(then, stmt_count(node, 0));
+		if (node->els)
+			set_count(els, stmt_count(node, 1));
+
+		br(gen_expr(node->cond), then, els);
+
+		// Lay out the more frequent branch first, so that it falls through
+		bool swap = node->els && els->count > then->count;
+		if (swap) {
+			start_bb(els);
+			count_ir(node, 1);
+			gen_stmt(node->els);
+			jmp(last);
+		}
+
+		start_bb(then);
+		count_ir(node, 0);
+		gen_stmt(node->then);
+		jmp(last);
+
+		if (has_els && !swap) {
+			start_bb(els);
+			count_ir(node, 1);
+			if (node->els)
+				gen_stmt(node->els);
+			jmp(last);
+		}
+
+		start_bb(last);
+		return;
+	}
+	case ND_WHILE: {
+		BB *cond = new_bb();
+		BB *body = new_bb();
+		BB *brk = new_bb();
+		set_count(body, stmt_count(node, 0));
+		if (body->count >= 0 && stmt_count(node, 1) >= 0)
+			cond->count = body->count + stmt_count(node, 1);
+
+		start_bb(cond);
+		br(gen_expr(node->cond), body, brk);
+
+		start_bb(body);
+		count_ir(node, 0);
+		gen_stmt(node->then);
+		jmp(cond);
+
+		start_bb(brk);
+		count_ir(node, 1);
+		return;
+	}
+	case ND_FOR: {
+		BB *cond = new_bb();
+		BB *body = new_bb();
+		BB *brk = new_bb();
+		set_count(body, stmt_count(node, 0));
+		if (body->count >= 0 && stmt_count(node, 1) >= 0)
+			cond->count = body->count + stmt_count(node, 1);
+
+		if (node->init)
+			gen_stmt(node->init);
+
+		start_bb(cond);
+		if (node->cond)
+			br(gen_expr(node->cond), body, brk);
+
+		start_bb(body);
+		count_ir(node, 0);
+		gen_stmt(node->then);
+		if (node->inc)
+			gen_stmt(node->inc);
+		jmp(cond);
+
+		start_bb(brk);
+		count_ir(node, 1);
+		return;
+	}
+	case ND_BLOCK:
+		for (Node *n = node->body; n; n = n->next)
+			gen_stmt(n);
+		return;
+	}
+
+	error_tok(node->tok, "invalid statement");
+}
+
+void gen_ir_fn(Function *fn) {
+	ir_fn = fn;
+	stmt_tok = NULL;
+	out = NULL;
+	out_last = NULL;
+	last_bb = NULL;
+	ir_can_tail_call = !fn_any_node(fn, is_local_addr);
+
+	start_bb(new_bb());
+	out->count = entry_count(fn->name);
+
+	// Store arguments to their stack slots
+	int i = 0;
+	for (VarList *vl = fn->params; vl; vl = vl->next) {
+		Reg *r = new_reg();
+		IR *ir = emit(IR_PARAM, r, NULL, NULL);
+		ir->imm = i++;
+
+		Reg *addr = new_reg();
+		ir = emit(IR_LVAR, addr, NULL, NULL);
+		ir->var = vl->var;
+
+		ir = emit(IR_STORE, NULL, addr, r);
+		ir->size = size_of(vl->var->ty);
+	}
+
+	if (profile_generate) {
+		IR *ir = emit(IR_COUNT, NULL, NULL, NULL);
+		ir->name = fn->name;
+	}
+
+	for (Node *node = fn->node; node; node = node->next)
+		gen_stmt(node);
+
+	// Falling off the end of a function returns 0
+	emit(IR_RET, NULL, imm(0), NULL);
+}
+
+void gen_ir(Program *prog) {
+	for (Function *fn = prog->fns; fn; fn = fn->next)
+		gen_ir_fn(fn);
+}
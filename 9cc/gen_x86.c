@@ -0,0 +1,525 @@
+#include "9cc.h"
+
+// x86-64 code generator for the IR.
+//
+// Virtual registers live in the physical registers chosen by
+// alloc_regs(). Spilled ones live in 8-byte stack slots below the
+// local variables. RAX, RDX, RDI and R11 are scratch registers for
+// operands that aren't in registers and for fixed-register
+// instructions such as idiv.
+
+Function *x86_fn;
+
+bool in_reg(Reg *r) {
+	return r->rn >= 0;
+}
+
+// Returns the location of a virtual register as an operand
+char *loc(Reg *r) {
+	if (in_reg(r))
+		return regs[r->rn];
+
+	char buf[32];
+	sprintf(buf, "qword ptr [rbp-%d]", r->spill);
+	return mem_strndup(MEM_CODEGEN, buf, 32);
+}
+
+// Returns the second operand of a binary instruction
+char *operand(IR *ir) {
+	if (ir->r2)
+		return loc(ir->r2);
+
+	char buf[32];
+	sprintf(buf, "%ld", ir->imm);
+	return mem_strndup(MEM_CODEGEN, buf, 32);
+}
+
+void mov(char *dst, char *src) {
+	if (strcmp(dst, src))
+		printf("	mov %s, %s\n", dst, src);
+}
+
+// Returns the register `r` is in, loading it to `scratch` if spilled
+char *use_reg(Reg *r, char *scratch) {
+	if (in_reg(r))
+		return loc(r);
+	mov(scratch, loc(r));
+	return scratch;
+}
+
+// Returns the register to compute the value of `r` in
+char *def_reg(Reg *r) {
+	return in_reg(r) ? loc(r) : "rax";
+}
+
+// Writes a value computed by def_reg() back to a spill slot
+void store_result(Reg *r, char *reg) {
+	mov(loc(r), reg);
+}
+
+// Emits moves from src[i] to dst[i] as if they were done at the same
+// time. A cycle of moves is broken by saving a value to R11.
+void parallel_move(char **dst, char **src, int n) {
+	bool *done = mem_alloc(MEM_CODEGEN, n * sizeof(bool));
+	int left = 0;
+	for (int i = 0; i < n; i++) {
+		done[i] = !strcmp(dst[i], src[i]);
+		if (!done[i])
+			left++;
+	}
+
+	while (left > 0) {
+		bool progress = false;
+
+		for (int i = 0; i < n; i++) {
+			if (done[i])
+				continue;
+
+			// A destination can be written once no other move reads it
+			bool blocked = false;
+			for (int j = 0; j < n; j++)
+				if (!done[j] && j != i && !strcmp(src[j], dst[i]))
+					blocked = true;
+			if (blocked)
+				continue;
+
+			mov(dst[i], src[i]);
+			done[i] = true;
+			left--;
+			progress = true;
+		}
+
+		if (progress)
+			continue;
+
+		// Every remaining move is part of a cycle
+		for (int i = 0; i < n; i++) {
+			if (done[i])
+				continue;
+			mov("r11", dst[i]);
+			for (int j = 0; j < n; j++)
+				if (!done[j] && !strcmp(src[j], dst[i]))
+					src[j] = "r11";
+			break;
+		}
+	}
+}
+
+// Callee-saved registers are saved below the spill slots
+int callee_saved_offset(int k) {
+	return x86_fn->stack_size + x86_fn->spill_size + k * 8 + 8;
+}
+
+void emit_epilogue() {
+	for (int rn = 0, k = 0; rn < 16; rn++)
+		if (x86_fn->callee_saved & (1 << rn))
+			printf("	mov %s, [rbp-%d]\n", regs[rn], callee_saved_offset(k++));
+	emit_frame_teardown();
+}
+
+void emit_cmp(IR *ir, char *insn) {
+	char *dst = def_reg(ir->r0);
+	printf("	cmp %s, %s\n", use_reg(ir->r1, "rax"), operand(ir));
+	printf("	%s al\n", insn);
+	printf("	movzb %s, al\n", dst);
+	store_result(ir->r0, dst);
+}
+
+void emit_binary(IR *ir, char *insn) {
+	char *dst = def_reg(ir->r0);
+	if (ir->r2 && !strcmp(dst, loc(ir->r2)))
+		dst = "rax";
+	mov(dst, loc(ir->r1));
+	printf("	%s %s, %s\n", insn, dst, operand(ir));
+	store_result(ir->r0, dst);
+}
+
+void emit_call(IR *ir) {
+	// Arguments beyond the sixth are pushed from right to left. RSP is
+	// aligned to 16 bytes because our frame size is a multiple of 16,
+	// so an odd number of them needs padding.
+	int nreg = ir->nargs < 6 ? ir->nargs : 6;
+	int nstack = ir->nargs - nreg;
+	if (nstack % 2)
+		printf("	sub rsp, 8\n");
+	for (int i = ir->nargs - 1; i >= nreg; i--)
+		printf("	push %s\n", loc(ir->args[i]));
+
+	char **dst = mem_alloc(MEM_CODEGEN, nreg * sizeof(char *));
+	char **src = mem_alloc(MEM_CODEGEN, nreg * sizeof(char *));
+	for (int i = 0; i < nreg; i++) {
+		dst[i] = argreg8[i];
+		src[i] = loc(ir->args[i]);
+	}
+	parallel_move(dst, src, nreg);
+
+	// RAX is set to 0 for variadic function
+	printf("	mov rax, 0\n");
+
+	// A tail call is always followed by a return of its result
+	if (ir->is_tail && ir->next && ir->next->op == IR_RET && ir->next->r1 == ir->r0) {
+		if (is_instrumented(x86_fn))
+			emit_tail_exit_hook(x86_fn);
+		emit_cfi_remember();
+		emit_epilogue();
+		printf("	jmp %s\n", ir->name);
+		emit_cfi_restore();
+		return;
+	}
+
+	printf("	call %s\n", ir->name);
+	if (nstack)
+		printf("	add rsp, %d\n", align_to(nstack, 2) * 8);
+	store_result(ir->r0, "rax");
+}
+
+//
+// Vector operations
+//
+// RDI points to the first element and RDX is the byte offset. Blocks
+// of 16 bytes are processed with SSE2 instructions, and the remaining
+// elements one at a time.
+
+int nvec;
+
+void emit_vec_loop(IR *ir, void (*vec)(IR *ir), void (*scalar)(IR *ir)) {
+	int c = nvec++;
+	long bytes = ir->imm * ir->size;
+	long vbytes = bytes & ~15;
+
+	printf("	mov rdx, 0\n");
+	if (vbytes) {
+		printf(".L.vec.%s.%d:\n", x86_fn->name, c);
+		vec(ir);
+		printf("	add rdx, 16\n");
+		printf("	cmp rdx, %ld\n", vbytes);
+		printf("	jl .L.vec.%s.%d\n", x86_fn->name, c);
+	}
+	if (bytes > vbytes) {
+		printf(".L.vrem.%s.%d:\n", x86_fn->name, c);
+		scalar(ir);
+		printf("	add rdx, %d\n", ir->size);
+		printf("	cmp rdx, %ld\n", bytes);
+		printf("	jl .L.vrem.%s.%d\n", x86_fn->name, c);
+	}
+}
+
+// Returns the name of a scratch register's lowest `size` bytes
+char *sized(char *reg, int size) {
+	if (size == 8)
+		return reg;
+	if (!strcmp(reg, "rax"))
+		return size == 4 ? "eax" : "al";
+	return size == 4 ? "r11d" : "r11b";
+}
+
+void fill_vec(IR *ir) {
+	printf("	movdqu [rdi+rdx], xmm0\n");
+}
+
+void fill_scalar(IR *ir) {
+	printf("	mov [rdi+rdx], %s\n", sized("rax", ir->size));
+}
+
+void copy_vec(IR *ir) {
+	printf("	movdqu xmm0, [rax+rdx]\n");
+	printf("	movdqu [rdi+rdx], xmm0\n");
+}
+
+void copy_scalar(IR *ir) {
+	printf("	mov %s, [rax+rdx]\n", sized("r11", ir->size));
+	printf("	mov [rdi+rdx], %s\n", sized("r11", ir->size));
+}
+
+void sum_vec(IR *ir) {
+	printf("	movdqu xmm1, [rdi+rdx]\n");
+	printf("	%s xmm0, xmm1\n", ir->size == 4 ? "paddd" : "paddq");
+}
+
+void sum_scalar(IR *ir) {
+	if (ir->size == 4) {
+		printf("	movsxd rax, dword ptr [rdi+rdx]\n");
+		printf("	add r11, rax\n");
+		return;
+	}
+	printf("	add r11, [rdi+rdx]\n");
+}
+
+void emit_vec(IR *ir) {
+	mov("rdi", loc(ir->r1));
+
+	switch (ir->op) {
+	case IR_VFILL:
+		// Broadcast the value to all lanes of XMM0
+		mov("rax", loc(ir->r2));
+		printf("	movq xmm0, rax\n");
+		if (ir->size == 1) {
+			printf("	punpcklbw xmm0, xmm0\n");
+			printf("	pshuflw xmm0, xmm0, 0\n");
+		}
+		if (ir->size == 4)
+			printf("	pshufd xmm0, xmm0, 0\n");
+		else
+			printf("	punpcklqdq xmm0, xmm0\n");
+		emit_vec_loop(ir, fill_vec, fill_scalar);
+		return;
+	case IR_VCOPY:
+		mov("rax", loc(ir->r2));
+		emit_vec_loop(ir, copy_vec, copy_scalar);
+		return;
+	case IR_VSUM:
+		// Sum lanes of elements in XMM0 and the rest in R11. The lanes
+		// of 4-byte elements wrap around like the 4-byte sum would.
+		printf("	pxor xmm0, xmm0\n");
+		printf("	mov r11, 0\n");
+		emit_vec_loop(ir, sum_vec, sum_scalar);
+		if (ir->size == 4) {
+			printf("	pshufd xmm1, xmm0, 0xee\n");
+			printf("	paddd xmm0, xmm1\n");
+			printf("	pshufd xmm1, xmm0, 0x55\n");
+			printf("	paddd xmm0, xmm1\n");
+			printf("	movd eax, xmm0\n");
+			printf("	movsxd rax, eax\n");
+		} else {
+			printf("	pshufd xmm1, xmm0, 0xee\n");
+			printf("	paddq xmm0, xmm1\n");
+			printf("	movq rax, xmm0\n");
+		}
+		printf("	add rax, r11\n");
+		store_result(ir->r0, "rax");
+		return;
+	}
+}
+
+// Moves incoming arguments to the locations of their IR_PARAM registers.
+// Arguments beyond the sixth are loaded from above the return address
+// once the register arguments are in place.
+void emit_params(Function *fn) {
+	int n = 0;
+	char *dst[6];
+	char *src[6];
+
+	for (BB *bb = fn->bb; bb; bb = bb->next) {
+		for (IR *ir = bb->ir; ir; ir = ir->next) {
+			if (ir->op == IR_PARAM && ir->imm < 6) {
+				dst[n] = loc(ir->r0);
+				src[n++] = argreg8[ir->imm];
+			}
+		}
+	}
+	parallel_move(dst, src, n);
+
+	for (BB *bb = fn->bb; bb; bb = bb->next) {
+		for (IR *ir = bb->ir; ir; ir = ir->next) {
+			if (ir->op == IR_PARAM && ir->imm >= 6) {
+				char *dst = def_reg(ir->r0);
+				printf("	mov %s, [rbp+%ld]\n", dst, 16 + (ir->imm - 6) * 8);
+				store_result(ir->r0, dst);
+			}
+		}
+	}
+}
+
+void emit_ir(IR *ir, BB *next) {
+	switch (ir->op) {
+	case IR_IMM: {
+		char *dst = def_reg(ir->r0);
+		printf("	mov %s, %ld\n", dst, ir->imm);
+		store_result(ir->r0, dst);
+		return;
+	}
+	case IR_MOV:
+		if (in_reg(ir->r0) || in_reg(ir->r1)) {
+			mov(loc(ir->r0), loc(ir->r1));
+			return;
+		}
+		mov("rax", loc(ir->r1));
+		mov(loc(ir->r0), "rax");
+		return;
+	case IR_CAST: {
+		char *dst = def_reg(ir->r0);
+		if (ir->size == 4) {
+			if (in_reg(ir->r1))
+				printf("	movsxd %s, %s\n", dst, regs32[ir->r1->rn]);
+			else
+				printf("	movsxd %s, dword ptr [rbp-%d]\n", dst, ir->r1->spill);
+		} else {
+			if (in_reg(ir->r1))
+				printf("	movsx %s, %s\n", dst, regs8[ir->r1->rn]);
+			else
+				printf("	movsx %s, byte ptr [rbp-%d]\n", dst, ir->r1->spill);
+		}
+		store_result(ir->r0, dst);
+		return;
+	}
+	case IR_ADD:
+		emit_binary(ir, "add");
+		return;
+	case IR_SUB:
+		emit_binary(ir, "sub");
+		return;
+	case IR_MUL: {
+		if (ir->r2) {
+			emit_binary(ir, "imul");
+			return;
+		}
+		char *dst = def_reg(ir->r0);
+		mov(dst, loc(ir->r1));
+		gen_mul_imm(dst, ir->imm);
+		store_result(ir->r0, dst);
+		return;
+	}
+	case IR_DIV:
+		mov("rax", loc(ir->r1));
+		if (ir->r2) {
+			printf("	cqo\n");
+			printf("	idiv %s\n", loc(ir->r2));
+		} else {
+			gen_div_imm(ir->imm);
+		}
+		store_result(ir->r0, "rax");
+		return;
+	case IR_EQ:
+		emit_cmp(ir, "sete");
+		return;
+	case IR_NE:
+		emit_cmp(ir, "setne");
+		return;
+	case IR_LT:
+		emit_cmp(ir, "setl");
+		return;
+	case IR_LE:
+		emit_cmp(ir, "setle");
+		return;
+	case IR_LVAR: {
+		char *dst = def_reg(ir->r0);
+		printf("	lea %s, [rbp-%d]\n", dst, ir->var->offset);
+		store_result(ir->r0, dst);
+		return;
+	}
+	case IR_GVAR: {
+		char *dst = def_reg(ir->r0);
+		printf("	lea %s, [rip + %s]\n", dst, ir->var->name);
+		store_result(ir->r0, dst);
+		return;
+	}
+	case IR_LOAD: {
+		char *addr = use_reg(ir->r1, "rax");
+		char *dst = def_reg(ir->r0);
+		if (ir->size == 1)
+			printf("	movsx %s, byte ptr [%s]\n", dst, addr);
+		else if (ir->size == 4)
+			printf("	movsxd %s, dword ptr [%s]\n", dst, addr);
+		else
+			printf("	mov %s, [%s]\n", dst, addr);
+		store_result(ir->r0, dst);
+		return;
+	}
+	case IR_STORE: {
+		char *addr = use_reg(ir->r1, "rax");
+		if (ir->size == 8) {
+			printf("	mov [%s], %s\n", addr, use_reg(ir->r2, "rdi"));
+			return;
+		}
+		if (in_reg(ir->r2)) {
+			char **names = (ir->size == 4) ? regs32 : regs8;
+			printf("	mov [%s], %s\n", addr, names[ir->r2->rn]);
+			return;
+		}
+		mov("rdi", loc(ir->r2));
+		printf("	mov [%s], %s\n", addr, ir->size == 4 ? "edi" : "dil");
+		return;
+	}
+	case IR_VFILL:
+	case IR_VCOPY:
+	case IR_VSUM:
+		emit_vec(ir);
+		return;
+	case IR_PARAM:
+		// Done by emit_params() in the prologue
+		return;
+	case IR_COUNT:
+		emit_counter(ir->name, ir->imm);
+		return;
+	case IR_CALL:
+		emit_call(ir);
+		return;
+	case IR_RET:
+		mov("rax", loc(ir->r1));
+		printf("	jmp .Lreturn.%s\n", x86_fn->name);
+		return;
+	case IR_JMP:
+		if (ir->bb1 != next)
+			printf("	jmp .L.bb.%s.%d\n", x86_fn->name, ir->bb1->label);
+		return;
+	case IR_BR:
+		printf("	cmp %s, 0\n", loc(ir->r1));
+		if (ir->bb1 == next) {
+			printf("	je .L.bb.%s.%d\n", x86_fn->name, ir->bb2->label);
+			return;
+		}
+		printf("	jne .L.bb.%s.%d\n", x86_fn->name, ir->bb1->label);
+		if (ir->bb2 != next)
+			printf("	jmp .L.bb.%s.%d\n", x86_fn->name, ir->bb2->label);
+		return;
+	}
+
+	error("unknown IR op: %d", ir->op);
+}
+
+void gen_x86_fn(Function *fn) {
+	x86_fn = fn;
+	nvec = 0;
+
+	int nsaved = 0;
+	for (int rn = 0; rn < 16; rn++)
+		if (fn->callee_saved & (1 << rn))
+			nsaved++;
+	int frame_size = align_to(callee_saved_offset(nsaved - 1), 16);
+
+	emit_fn_start(fn);
+
+	// Prologue
+	emit_frame_setup();
+	printf("	sub rsp, %d\n", frame_size);
+	for (int rn = 0, k = 0; rn < 16; rn++) {
+		if (!(fn->callee_saved & (1 << rn)))
+			continue;
+		printf("	mov [rbp-%d], %s\n", callee_saved_offset(k), regs[rn]);
+		emit_cfi_saved(regs[rn], callee_saved_offset(k++));
+	}
+	if (is_instrumented(fn))
+		emit_enter_hook(fn);
+	emit_params(fn);
+
+	for (BB *bb = fn->bb; bb; bb = bb->next) {
+		printf(".L.bb.%s.%d:\n", fn->name, bb->label);
+		for (IR *ir = bb->ir; ir; ir = ir->next) {
+			emit_loc(ir->tok);
+			emit_ir(ir, bb->next);
+		}
+	}
+
+	// Epilogue
+	printf(".Lreturn.%s:\n", fn->name);
+	if (is_instrumented(fn))
+		emit_exit_hook(fn);
+	emit_epilogue();
+	printf("	ret\n");
+	emit_fn_end(fn);
+
+	if (profile_generate)
+		emit_profile_table(fn);
+	if (is_instrumented(fn))
+		emit_function_name(fn);
+}
+
+void gen_x86(Program *prog) {
+	printf(".intel_syntax noprefix\n");
+	emit_file_directive();
+	emit_data(prog);
+
+	printf(".text\n");
+	for (Function *fn = prog->fns; fn; fn = fn->next)
+		gen_x86_fn(fn);
+}
@@ -0,0 +1,364 @@
+#include "9cc.h"
+
+// Incremental compilation at function granularity.
+//
+// With --incremental, the assembly of each function is kept in a side
+// file next to the input, keyed by a hash of everything it depends on:
+// the function's tokens, the tokens of the functions it calls (which
+// may be inlined into it), the declarations of all global variables,
+// the flags, the profile and the compiler itself, and with -g the file
+// name and the lines of the functions. Only functions whose key is not
+// in the side file are parsed and compiled, along with their callees
+// so that they can be inlined; the rest is spliced in from the side
+// file.
+//
+// Labels and string literals are named after their function, and
+// their numbering starts over in each function, so the assembly of a
+// function doesn't depend on what is compiled before it.
+
+#define MAGIC "9cc-incr 1\n"
+
+// Top-level function or global variable
+typedef struct Item Item;
+struct Item {
+	Item *next;
+	Token *begin;
+	Token *end; // Last token
+	char *name; // Function name, or NULL for a global variable
+
+	unsigned long hash; // Hash of the tokens
+	unsigned long key;  // Hash of everything the output depends on
+	bool visited;
+	bool parse;
+
+	// Assembly of a function
+	char *text;
+	long len;
+};
+
+// Assembly of a function saved by a previous run
+typedef struct Chunk Chunk;
+struct Chunk {
+	Chunk *next;
+	unsigned long key;
+	char *text;
+	long len;
+};
+
+Item *items;
+
+bool is_reserved(Token *tok, char *s) {
+	return tok->kind == TK_RESERVED && tok->len == strlen(s) &&
+		   !memcmp(tok->str, s, tok->len);
+}
+
+// Splits the tokens into top-level items without parsing them.
+// Returns false if they don't have the shape of a program.
+bool split_items(Token *tok) {
+	Item head = {};
+	Item *cur = &head;
+
+	while (tok->kind != TK_EOF) {
+		Item *item = mem_alloc(MEM_DRIVER, sizeof(Item));
+		item->begin = tok;
+
+		// basetype ident
+		if (!is_reserved(tok, "int") && !is_reserved(tok, "char") &&
+			!is_reserved(tok, "long"))
+			return false;
+		tok = tok->next;
+		while (is_reserved(tok, "*"))
+			tok = tok->next;
+		if (tok->kind != TK_IDENT)
+			return false;
+		Token *ident = tok;
+		tok = tok->next;
+
+		if (is_reserved(tok, "(")) {
+			// Function: up to the brace closing its body
+			item->name = mem_strndup(MEM_DRIVER, ident->str, ident->len);
+			while (!is_reserved(tok, "{")) {
+				if (tok->kind == TK_EOF)
+					return false;
+				tok = tok->next;
+			}
+			for (int depth = 0;; tok = tok->next) {
+				if (tok->kind == TK_EOF)
+					return false;
+				if (is_reserved(tok, "{"))
+					depth++;
+				if (is_reserved(tok, "}") && --depth == 0)
+					break;
+			}
+		} else {
+			// Global variable
+			while (!is_reserved(tok, ";")) {
+				if (tok->kind == TK_EOF)
+					return false;
+				tok = tok->next;
+			}
+		}
+
+		item->end = tok;
+		tok = tok->next;
+		cur = cur->next = item;
+	}
+
+	items = head.next;
+	return true;
+}
+
+unsigned long hash_tokens(unsigned long h, Item *item) {
+	for (Token *tok = item->begin;; tok = tok->next) {
+		h = hash_bytes(h, &tok->kind, sizeof(tok->kind));
+		h = hash_bytes(h, &tok->len, sizeof(tok->len));
+		h = hash_bytes(h, tok->str, tok->len);
+		if (tok == item->end)
+			return h;
+	}
+}
+
+Item *find_item(Token *tok) {
+	for (Item *item = items; item; item = item->next)
+		if (item->name && strlen(item->name) == tok->len &&
+			!memcmp(item->name, tok->str, tok->len))
+			return item;
+	return NULL;
+}
+
+// Visits a function and, transitively, the functions it calls
+void visit_calls(Item *item, void (*fn)(Item *item)) {
+	if (item->visited)
+		return;
+	item->visited = true;
+	fn(item);
+
+	for (Token *tok = item->begin; tok != item->end; tok = tok->next) {
+		if (tok->kind != TK_IDENT || !is_reserved(tok->next, "("))
+			continue;
+		Item *callee = find_item(tok);
+		if (callee)
+			visit_calls(callee, fn);
+	}
+}
+
+void clear_visited() {
+	for (Item *item = items; item; item = item->next)
+		item->visited = false;
+}
+
+unsigned long cur_key;
+
+void add_to_key(Item *item) {
+	cur_key = hash_bytes(cur_key, &item->hash, sizeof(item->hash));
+}
+
+void mark_parse(Item *item) {
+	item->parse = true;
+}
+
+// Computes the keys of the functions
+void compute_keys(int argc, char **argv) {
+	unsigned long h = profile_hash(compiler_id());
+	for (int i = 1; i < argc; i++)
+		if (argv[i] != filename && strncmp(argv[i], "--cache", 7))
+			h = hash_bytes(h, argv[i], strlen(argv[i]) + 1);
+
+	if (debug_info)
+		h = hash_bytes(h, filename, strlen(filename) + 1);
+
+	// With -g, the line numbers of a function are part of its output
+	for (Item *item = items; item; item = item->next) {
+		item->hash = hash_tokens(0xcbf29ce484222325, item);
+		if (debug_info) {
+			int line = line_of(item->begin->str);
+			item->hash = hash_bytes(item->hash, &line, sizeof(line));
+		}
+		if (!item->name)
+			h = hash_bytes(h, &item->hash, sizeof(item->hash));
+	}
+
+	for (Item *item = items; item; item = item->next) {
+		if (!item->name)
+			continue;
+		clear_visited();
+		cur_key = h;
+		visit_calls(item, add_to_key);
+		item->key = cur_key;
+	}
+}
+
+char *side_file() {
+	int len = snprintf(NULL, 0, "%s.incr", filename);
+	char *path = mem_alloc(MEM_DRIVER, len + 1);
+	sprintf(path, "%s.incr", filename);
+	return path;
+}
+
+Chunk *read_chunks(char *path) {
+	FILE *fp = fopen(path, "r");
+	if (!fp)
+		return NULL;
+
+	char magic[sizeof(MAGIC) - 1];
+	if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) ||
+		memcmp(magic, MAGIC, sizeof(magic))) {
+		fclose(fp);
+		return NULL;
+	}
+
+	Chunk *chunks = NULL;
+	for (;;) {
+		Chunk *c = mem_alloc(MEM_DRIVER, sizeof(Chunk));
+		if (fread(&c->key, sizeof(c->key), 1, fp) != 1 ||
+			fread(&c->len, sizeof(c->len), 1, fp) != 1 || c->len < 0)
+			break;
+		c->text = mem_alloc(MEM_DRIVER, c->len);
+		if (fread(c->text, 1, c->len, fp) != c->len)
+			break;
+		c->next = chunks;
+		chunks = c;
+	}
+	fclose(fp);
+	return chunks;
+}
+
+void write_chunks(char *path) {
+	char *tmp = mem_alloc(MEM_DRIVER, strlen(path) + 8);
+	sprintf(tmp, "%s.XXXXXX", path);
+	int fd = mkstemp(tmp);
+	if (fd == -1)
+		error("cannot create %s: %s", tmp, strerror(errno));
+
+	FILE *fp = fdopen(fd, "w");
+	fwrite(MAGIC, 1, sizeof(MAGIC) - 1, fp);
+	for (Item *item = items; item; item = item->next) {
+		if (!item->name)
+			continue;
+		fwrite(&item->key, sizeof(item->key), 1, fp);
+		fwrite(&item->len, sizeof(item->len), 1, fp);
+		fwrite(item->text, 1, item->len, fp);
+	}
+
+	if (fclose(fp) || rename(tmp, path)) {
+		unlink(tmp);
+		error("cannot write %s: %s", path, strerror(errno));
+	}
+}
+
+// Compiles the functions that have no saved assembly. Their output
+// is captured in a temporary file and then attached to their items.
+void compile_changed(Program *prog) {
+	if (opt_level > 0) {
+		gen_ir(prog);
+		run_passes(prog, dump_ir_flag);
+		alloc_regs(prog);
+	}
+
+	FILE *tmp = tmpfile();
+	if (!tmp)
+		error("tmpfile: %s", strerror(errno));
+	fflush(stdout);
+	int saved_stdout = dup(1);
+	dup2(fileno(tmp), 1);
+
+	for (Item *item = items; item; item = item->next) {
+		if (!item->name || item->text)
+			continue;
+
+		Function *fn = find_function(prog, item->name);
+		item->len = lseek(1, 0, SEEK_CUR);
+		printf(".data\n");
+		emit_vars(fn->literals);
+		printf(".text\n");
+		if (opt_level == 0)
+			codegen_fn(fn);
+		else
+			gen_x86_fn(fn);
+		fflush(stdout);
+		item->len = lseek(1, 0, SEEK_CUR) - item->len;
+	}
+
+	dup2(saved_stdout, 1);
+	close(saved_stdout);
+
+	rewind(tmp);
+	for (Item *item = items; item; item = item->next) {
+		if (!item->name || item->text)
+			continue;
+		item->text = mem_alloc(MEM_DRIVER, item->len);
+		if (fread(item->text, 1, item->len, tmp) != item->len)
+			error("cannot read back the assembly of %s", item->name);
+	}
+	fclose(tmp);
+}
+
+void compile_incremental(int argc, char **argv) {
+	token = tokenize();
+	Token *eof = token;
+	while (eof->kind != TK_EOF)
+		eof = eof->next;
+
+	// If the input isn't a sequence of top-level items, let the parser
+	// report the error.
+	if (!split_items(token)) {
+		program();
+		error("%s: cannot split into functions", filename);
+	}
+	compute_keys(argc, argv);
+
+	// Find the saved assembly of the functions that haven't changed
+	char *path = side_file();
+	Chunk *chunks = read_chunks(path);
+	int nfns = 0;
+	int nreused = 0;
+	for (Item *item = items; item; item = item->next) {
+		if (!item->name)
+			continue;
+		nfns++;
+		for (Chunk *c = chunks; c; c = c->next) {
+			if (c->key == item->key) {
+				item->text = c->text;
+				item->len = c->len;
+				nreused++;
+				break;
+			}
+		}
+	}
+
+	// Parse global variables, the changed functions and their callees
+	clear_visited();
+	for (Item *item = items; item; item = item->next)
+		if (item->name && !item->text)
+			visit_calls(item, mark_parse);
+
+	Token head = {};
+	Token *cur = &head;
+	for (Item *item = items; item; item = item->next) {
+		if (item->name && !item->parse)
+			continue;
+		cur->next = item->begin;
+		cur = item->end;
+	}
+	cur->next = eof;
+	token = head.next;
+
+	Program *prog = program();
+	add_type(prog);
+	optimize(prog);
+	compile_changed(prog);
+
+	if (opt_info)
+		fprintf(stderr, "%s: reused %d of %d functions\n", filename, nreused, nfns);
+
+	// Splice the functions together
+	printf(".intel_syntax noprefix\n");
+	emit_file_directive();
+	printf(".data\n");
+	emit_vars(prog->globals);
+	for (Item *item = items; item; item = item->next)
+		if (item->name)
+			fwrite(item->text, 1, item->len, stdout);
+
+	write_chunks(path);
+}
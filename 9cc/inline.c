@@ -0,0 +1,279 @@
+#include "9cc.h"
+
+// Inlines calls to small functions defined in the same program.
+//
+// A callee qualifies if its body is a list of statements followed by
+// a return, it doesn't return anywhere else and it doesn't call itself.
+// A call `f(a, b)` to such a function is replaced with a statement
+// expression `({ x = a; y = b; stmts...; expr; })`, where x and y are
+// copies of the callee's parameters added to the caller's locals.
+
+typedef struct VarMap VarMap;
+struct VarMap {
+	VarMap *next;
+	Var *from;
+	Var *to;
+};
+
+Function *caller;
+VarMap *varmap;
+
+Var *remap_var(Var *var) {
+	if (!var->is_local || !caller)
+		return var;
+
+	for (VarMap *m = varmap; m; m = m->next)
+		if (m->from == var)
+			return m->to;
+
+	Var *v = mem_alloc(MEM_OPT, sizeof(Var));
+	*v = *var;
+
+	// The block of the call site isn't known, so the copy is treated
+	// as live throughout the caller
+	v->scope_begin = 0;
+	v->scope_end = INT_MAX;
+
+	VarList *vl = mem_alloc(MEM_OPT, sizeof(VarList));
+	vl->var = v;
+	vl->next = caller->locals;
+	caller->locals = vl;
+
+	VarMap *m = mem_alloc(MEM_OPT, sizeof(VarMap));
+	m->from = var;
+	m->to = v;
+	m->next = varmap;
+	varmap = m;
+	return v;
+}
+
+Node *clone_list(Node *node);
+
+// Returns a deep copy of a subtree, replacing the callee's locals
+// with their copies in the caller.
+Node *clone(Node *node) {
+	if (!node)
+		return NULL;
+
+	Node *n = mem_alloc(MEM_OPT, sizeof(Node));
+	*n = *node;
+	n->next = NULL;
+	n->lhs = clone(node->lhs);
+	n->rhs = clone(node->rhs);
+	n->cond = clone(node->cond);
+	n->then = clone(node->then);
+	n->els = clone(node->els);
+	n->init = clone(node->init);
+	n->inc = clone(node->inc);
+	n->body = clone_list(node->body);
+	n->args = clone_list(node->args);
+	if (n->var)
+		n->var = remap_var(n->var);
+	return n;
+}
+
+Node *clone_list(Node *node) {
+	Node head;
+	head.next = NULL;
+	Node *cur = &head;
+
+	for (Node *n = node; n; n = n->next) {
+		cur->next = clone(n);
+		cur = cur->next;
+	}
+	return head.next;
+}
+
+// Returns a deep copy of a subtree that refers to the same variables
+Node *copy_tree(Node *node) {
+	Function *fn = caller;
+	caller = NULL;
+	Node *n = clone(node);
+	caller = fn;
+	return n;
+}
+
+int count_nodes(Node *node) {
+	if (!node)
+		return 0;
+
+	int n = 1;
+	n += count_nodes(node->lhs) + count_nodes(node->rhs);
+	n += count_nodes(node->cond) + count_nodes(node->then);
+	n += count_nodes(node->els) + count_nodes(node->init);
+	n += count_nodes(node->inc);
+	for (Node *b = node->body; b; b = b->next)
+		n += count_nodes(b);
+	for (Node *a = node->args; a; a = a->next)
+		n += count_nodes(a);
+	return n;
+}
+
+bool contains_return_or_call(Node *node, char *name) {
+	if (!node)
+		return false;
+	if (node->kind == ND_RETURN)
+		return true;
+	if (node->kind == ND_FUNCALL && !strcmp(node->funcname, name))
+		return true;
+
+	if (contains_return_or_call(node->lhs, name) ||
+		contains_return_or_call(node->rhs, name) ||
+		contains_return_or_call(node->cond, name) ||
+		contains_return_or_call(node->then, name) ||
+		contains_return_or_call(node->els, name) ||
+		contains_return_or_call(node->init, name) ||
+		contains_return_or_call(node->inc, name))
+		return true;
+
+	for (Node *n = node->body; n; n = n->next)
+		if (contains_return_or_call(n, name))
+			return true;
+	for (Node *n = node->args; n; n = n->next)
+		if (contains_return_or_call(n, name))
+			return true;
+	return false;
+}
+
+// Returns the top-level return statement of `fn` if it can be inlined.
+// Statements after it are unreachable, so they are ignored.
+Node *inlinable_return(Function *fn, int limit) {
+	int size = 0;
+
+	for (Node *node = fn->node; node; node = node->next) {
+		if (node->kind == ND_RETURN) {
+			if (contains_return_or_call(node->lhs, fn->name))
+				return NULL;
+			if (node->lhs->ty->base)
+				return NULL;
+			// A call would truncate a value wider than the return type
+			if (size_of(node->lhs->ty) > size_of(fn->ty))
+				return NULL;
+			if (size + count_nodes(node->lhs) > limit)
+				return NULL;
+			return node;
+		}
+
+		if (contains_return_or_call(node, fn->name))
+			return NULL;
+		size += count_nodes(node);
+	}
+	return NULL;
+}
+
+Function *find_function(Program *prog, char *name) {
+	for (Function *fn = prog->fns; fn; fn = fn->next)
+		if (!strcmp(fn->name, name))
+			return fn;
+	return NULL;
+}
+
+Program *inline_prog;
+int max_inline_size;
+int inlined_calls;
+
+// Returns the inlined body of a call, or NULL if it isn't inlinable
+Node *inline_call(Node *node) {
+	Function *fn = find_function(inline_prog, node->funcname);
+	if (!fn || fn == caller)
+		return NULL;
+
+	// With a profile, calls to functions that never ran stay calls,
+	// and hot functions may be larger
+	if (is_cold(fn->name))
+		return NULL;
+	int limit = is_hot(fn->name) ? max_inline_size * 2 : max_inline_size;
+
+	Node *ret = inlinable_return(fn, limit);
+	if (!ret)
+		return NULL;
+
+	int nparams = 0, nargs = 0;
+	for (VarList *vl = fn->params; vl; vl = vl->next)
+		nparams++;
+	for (Node *arg = node->args; arg; arg = arg->next)
+		nargs++;
+	if (nparams != nargs)
+		return NULL;
+
+	varmap = NULL;
+
+	Node head;
+	head.next = NULL;
+	Node *cur = &head;
+
+	// Assign arguments to the copies of parameters
+	Node *arg = node->args;
+	for (VarList *vl = fn->params; vl; vl = vl->next) {
+		Node *next = arg->next;
+		arg->next = NULL;
+
+		Node *var = new_var(remap_var(vl->var), arg->tok);
+		var->ty = var->var->ty;
+		Node *assign = new_binary(ND_ASSIGN, var, arg, arg->tok);
+		assign->ty = var->ty;
+		cur = cur->next = new_unary(ND_EXPR_STMT, assign, arg->tok);
+		arg = next;
+	}
+
+	for (Node *n = fn->node; n != ret; n = n->next)
+		cur = cur->next = clone(n);
+
+	Node *expr = clone(ret->lhs);
+	if (!head.next)
+		return expr;
+
+	cur->next = expr;
+	Node *stmt_expr = new_node(ND_STMT_EXPR, node->tok);
+	stmt_expr->body = head.next;
+	stmt_expr->ty = node->ty;
+	return stmt_expr;
+}
+
+void inline_list(Node *node);
+
+void inline_walk(Node *node) {
+	if (!node)
+		return;
+
+	inline_walk(node->lhs);
+	inline_walk(node->rhs);
+	inline_walk(node->cond);
+	inline_walk(node->then);
+	inline_walk(node->els);
+	inline_walk(node->init);
+	inline_walk(node->inc);
+	inline_list(node->body);
+	inline_list(node->args);
+
+	if (node->kind != ND_FUNCALL)
+		return;
+
+	Node *body = inline_call(node);
+	if (!body)
+		return;
+
+	Node *next = node->next;
+	*node = *body;
+	node->next = next;
+	inlined_calls++;
+}
+
+void inline_list(Node *node) {
+	for (Node *n = node; n; n = n->next)
+		inline_walk(n);
+}
+
+// Inlines calls to functions whose body has at most `size_limit` nodes.
+// Returns the number of inlined call sites.
+int inline_functions(Program *prog, int size_limit) {
+	inline_prog = prog;
+	max_inline_size = size_limit;
+	inlined_calls = 0;
+
+	for (Function *fn = prog->fns; fn; fn = fn->next) {
+		caller = fn;
+		inline_list(fn->node);
+	}
+	return inlined_calls;
+}
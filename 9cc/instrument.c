@@ -0,0 +1,83 @@
+#include "9cc.h"
+
+// Function entry and exit hooks (-finstrument-functions).
+//
+// Every function calls an entry hook after its prologue and an exit
+// hook before its epilogue, both with the address of the function and
+// the call site, like gcc's hooks of the same name:
+//
+//   void __cyg_profile_func_enter(void *fn, void *call_site);
+//   void __cyg_profile_func_exit(void *fn, void *call_site);
+//
+// -finstrument-enter=NAME and -finstrument-exit=NAME change the hooks.
+// The name of each function is also recorded in the __9cc_fnames
+// section, which runtime/instrument.c reads to print its profile.
+//
+// The hooks are called with the argument registers saved and the
+// return value saved, so the rest of the code generators can ignore
+// them. A tail call calls the exit hook right before its jump, so the
+// callee is entered after the caller has exited, and deep tail
+// recursion still runs in constant stack space.
+
+char *enter_hook = "__cyg_profile_func_enter"; // -finstrument-enter=NAME
+char *exit_hook = "__cyg_profile_func_exit";   // -finstrument-exit=NAME
+
+// Returns true if `fn` gets hooks. The hooks themselves don't, or
+// they would call themselves.
+bool is_instrumented(Function *fn) {
+	return instrument_functions && strcmp(fn->name, enter_hook) &&
+		   strcmp(fn->name, exit_hook);
+}
+
+// Calls a hook with the function and call site. RBP must be set up,
+// and RSP 16-byte aligned.
+void call_hook(char *hook, Function *fn) {
+	printf("	lea rdi, [rip + %s]\n", fn->name);
+	printf("	mov rsi, [rbp+8]\n");
+	printf("	call %s\n", hook);
+}
+
+// Calls a hook, preserving the argument registers. Six pushes keep
+// RSP aligned.
+void call_hook_saving_args(char *hook, Function *fn) {
+	for (int i = 0; i < 6; i++)
+		printf("	push %s\n", argreg8[i]);
+	call_hook(hook, fn);
+	for (int i = 5; i >= 0; i--)
+		printf("	pop %s\n", argreg8[i]);
+}
+
+// Emitted after the prologue, before the arguments are moved
+void emit_enter_hook(Function *fn) {
+	call_hook_saving_args(enter_hook, fn);
+}
+
+// Emitted at the return label, with the return value in RAX. Anything
+// left below the frame is dead, so RSP is just rounded down.
+void emit_exit_hook(Function *fn) {
+	printf("	and rsp, -16\n");
+	printf("	push rax\n");
+	printf("	sub rsp, 8\n");
+	call_hook(exit_hook, fn);
+	printf("	add rsp, 8\n");
+	printf("	pop rax\n");
+}
+
+// Emitted before the epilogue of a tail call, with the callee's
+// arguments in registers
+void emit_tail_exit_hook(Function *fn) {
+	printf("	and rsp, -16\n");
+	call_hook_saving_args(exit_hook, fn);
+}
+
+// Records the name of a function for the runtime
+void emit_function_name(Function *fn) {
+	printf(".data\n");
+	printf(".L.fname.%s:\n", fn->name);
+	printf("	.string \"%s\"\n", fn->name);
+	printf(".section __9cc_fnames,\"aw\"\n");
+	printf(".align 8\n");
+	printf("	.quad %s\n", fn->name);
+	printf("	.quad .L.fname.%s\n", fn->name);
+	printf(".text\n");
+}
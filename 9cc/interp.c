@@ -0,0 +1,679 @@
+#include "9cc.h"
+
+// Interpreter for --interp, which runs a program without assembling
+// and linking it.
+//
+// Functions are compiled to a bytecode for a stack machine that works
+// like the one of codegen.c: values are 64-bit, loads sign-extend and
+// stores truncate. Local variables live in frames on a separate memory
+// stack at the offsets assigned by layout_frame(), and globals and
+// string literals in memory of their own, so that pointers to them can
+// be passed to C functions. Functions that the program doesn't define
+// are looked up in libc with dlsym().
+//
+// The bytecode is direct-threaded: once a program is compiled, each
+// opcode is replaced with the address of its handler, and each handler
+// jumps straight to the next one.
+
+typedef enum {
+	OP_PUSH,     // imm
+	OP_LADDR,    // offset: Address of a local
+	OP_GADDR,    // addr: Address of a global
+	OP_LOADL1,   // offset: Value of a local
+	OP_LOADL4,   // offset
+	OP_LOADL8,   // offset
+	OP_LOAD1,
+	OP_LOAD4,
+	OP_LOAD8,
+	OP_STORE1,   // Pops the value and the address, pushes the value
+	OP_STORE4,
+	OP_STORE8,
+	OP_POP,
+	OP_ADD,
+	OP_SUB,
+	OP_MUL,
+	OP_DIV,
+	OP_EQ,
+	OP_NE,
+	OP_LT,
+	OP_LE,
+	OP_MULI,     // imm
+	OP_CAST1,    // Sign-extends the value from its lowest byte
+	OP_CAST4,    // Sign-extends the value from its lowest 4 bytes
+	OP_JMP,      // target
+	OP_JZ,       // target
+	OP_CALL,     // fn, nargs
+	OP_TAILCALL, // fn, nargs
+	OP_NATIVE,   // addr, nargs
+	OP_ENTER,    // frame size, stack depth
+	OP_ARG1,     // offset: Pops an argument to its parameter
+	OP_ARG4,     // offset
+	OP_ARG8,     // offset
+	OP_RET,
+	OP_VFILL,    // size, n
+	OP_VCOPY,    // size, n
+	OP_VSUM,     // size, n
+	OP_EXIT,
+	NUM_OPS,
+} Op;
+
+int op_len[NUM_OPS] = {
+	[OP_PUSH] = 2, [OP_LADDR] = 2, [OP_GADDR] = 2,
+	[OP_LOADL1] = 2, [OP_LOADL4] = 2, [OP_LOADL8] = 2,
+	[OP_LOAD1] = 1, [OP_LOAD4] = 1, [OP_LOAD8] = 1,
+	[OP_STORE1] = 1, [OP_STORE4] = 1, [OP_STORE8] = 1,
+	[OP_POP] = 1, [OP_ADD] = 1, [OP_SUB] = 1, [OP_MUL] = 1, [OP_DIV] = 1,
+	[OP_EQ] = 1, [OP_NE] = 1, [OP_LT] = 1, [OP_LE] = 1, [OP_MULI] = 2,
+	[OP_CAST1] = 1, [OP_CAST4] = 1,
+	[OP_JMP] = 2, [OP_JZ] = 2, [OP_CALL] = 3, [OP_TAILCALL] = 3,
+	[OP_NATIVE] = 3, [OP_ENTER] = 3,
+	[OP_ARG1] = 2, [OP_ARG4] = 2, [OP_ARG8] = 2, [OP_RET] = 1,
+	[OP_VFILL] = 3, [OP_VCOPY] = 3, [OP_VSUM] = 3, [OP_EXIT] = 1,
+};
+
+#define MEM_STACK_SIZE (8 << 20)
+#define VAL_STACK_SIZE (1 << 20)
+#define CALL_STACK_SIZE (1 << 20)
+#define MAX_NATIVE_ARGS 6
+
+long *bc;
+long bc_len;
+long bc_cap;
+
+Program *bc_prog;
+Function *bc_fn;
+bool bc_can_tail_call;
+
+void *libc;
+
+void bc_emit(long word) {
+	if (bc_len == bc_cap) {
+		bc_cap = bc_cap ? bc_cap * 2 : 4096;
+		bc = mem_realloc(MEM_INTERP, bc, bc_cap * sizeof(long));
+	}
+	bc[bc_len++] = word;
+}
+
+void bc_op1(Op op, long a) {
+	bc_emit(op);
+	bc_emit(a);
+}
+
+void bc_op2(Op op, long a, long b) {
+	bc_emit(op);
+	bc_emit(a);
+	bc_emit(b);
+}
+
+// Emits a forward jump and returns the position of its target
+long bc_jump(Op op) {
+	bc_op1(op, 0);
+	return bc_len - 1;
+}
+
+void bc_sized(Op op1, Type *ty) {
+	int sz = size_of(ty);
+	bc_emit(sz == 1 ? op1 : sz == 4 ? op1 + 1 : op1 + 2);
+}
+
+// Returns the memory of a global variable or string literal
+char *global_mem(Var *var) {
+	if (var->mem)
+		return var->mem;
+	var->mem = mem_alloc(MEM_INTERP, size_of(var->ty));
+	if (var->contents)
+		memcpy(var->mem, var->contents, var->cont_len - 1);
+	return var->mem;
+}
+
+// Returns a C function the program calls without defining it
+void *native_fn(Node *node) {
+	if (!libc && !(libc = dlopen("libc.so.6", RTLD_NOW)))
+		error("cannot load libc: %s", dlerror());
+	void *fn = dlsym(libc, node->funcname);
+	if (!fn)
+		error_tok(node->tok, "undefined function: %s", node->funcname);
+	return fn;
+}
+
+void bc_expr(Node *node);
+
+void bc_addr(Node *node) {
+	switch (node->kind) {
+	case ND_VAR:
+		if (node->var->is_local)
+			bc_op1(OP_LADDR, node->var->offset);
+		else
+			bc_op1(OP_GADDR, (long)global_mem(node->var));
+		return;
+	case ND_DEREF:
+		bc_expr(node->lhs);
+		return;
+	}
+
+	error_tok(node->tok, "not an lvalue");
+}
+
+void bc_funcall(Node *node, bool is_tail) {
+	int nargs = 0;
+	for (Node *arg = node->args; arg; arg = arg->next) {
+		bc_expr(arg);
+		nargs++;
+	}
+
+	Function *fn = find_function(bc_prog, node->funcname);
+	if (fn && is_tail) {
+		bc_op2(OP_TAILCALL, (long)fn, nargs);
+		return;
+	}
+
+	if (fn) {
+		bc_op2(OP_CALL, (long)fn, nargs);
+	} else {
+		if (nargs > MAX_NATIVE_ARGS)
+			error_tok(node->tok, "too many arguments to a library function");
+		bc_op2(OP_NATIVE, (long)native_fn(node), nargs);
+	}
+
+	// The upper bits of a char or int result are unspecified, like
+	// in native code
+	if (node->ty->kind == TY_CHAR)
+		bc_emit(OP_CAST1);
+	else if (node->ty->kind == TY_INT)
+		bc_emit(OP_CAST4);
+	if (is_tail)
+		bc_emit(OP_RET);
+}
+
+void bc_stmt(Node *node) {
+	switch (node->kind) {
+	case ND_NULL:
+		return;
+	case ND_EXPR_STMT:
+		bc_expr(node->lhs);
+		bc_emit(OP_POP);
+		return;
+	case ND_RETURN:
+		if (node->lhs->kind == ND_FUNCALL && bc_can_tail_call &&
+			can_return_call(bc_fn, node->lhs)) {
+			bc_funcall(node->lhs, true);
+			return;
+		}
+		bc_expr(node->lhs);
+		bc_emit(OP_RET);
+		return;
+	case ND_IF: {
+		bc_expr(node->cond);
+		long els = bc_jump(OP_JZ);
+		bc_stmt(node->then);
+		if (node->els) {
+			long end = bc_jump(OP_JMP);
+			bc[els] = bc_len;
+			bc_stmt(node->els);
+			bc[end] = bc_len;
+		} else {
+			bc[els] = bc_len;
+		}
+		return;
+	}
+	case ND_WHILE: {
+		long begin = bc_len;
+		bc_expr(node->cond);
+		long end = bc_jump(OP_JZ);
+		bc_stmt(node->then);
+		bc_op1(OP_JMP, begin);
+		bc[end] = bc_len;
+		return;
+	}
+	case ND_FOR: {
+		if (node->init)
+			bc_stmt(node->init);
+		long begin = bc_len;
+		long end = -1;
+		if (node->cond) {
+			bc_expr(node->cond);
+			end = bc_jump(OP_JZ);
+		}
+		bc_stmt(node->then);
+		if (node->inc)
+			bc_stmt(node->inc);
+		bc_op1(OP_JMP, begin);
+		if (end >= 0)
+			bc[end] = bc_len;
+		return;
+	}
+	case ND_BLOCK:
+		for (Node *n = node->body; n; n = n->next)
+			bc_stmt(n);
+		return;
+	}
+
+	error_tok(node->tok, "invalid statement");
+}
+
+void bc_expr(Node *node) {
+	switch (node->kind) {
+	case ND_NUM:
+		bc_op1(OP_PUSH, node->val);
+		return;
+	case ND_VAR:
+		if (node->ty->kind == TY_ARRAY) {
+			bc_addr(node);
+			return;
+		}
+		if (node->var->is_local) {
+			bc_sized(OP_LOADL1, node->ty);
+			bc_emit(node->var->offset);
+			return;
+		}
+		bc_addr(node);
+		bc_sized(OP_LOAD1, node->ty);
+		return;
+	case ND_ASSIGN:
+		if (node->lhs->ty->kind == TY_ARRAY)
+			error_tok(node->lhs->tok, "not an lvalue");
+		bc_addr(node->lhs);
+		bc_expr(node->rhs);
+		bc_sized(OP_STORE1, node->ty);
+		return;
+	case ND_ADDR:
+		bc_addr(node->lhs);
+		return;
+	case ND_DEREF:
+		bc_expr(node->lhs);
+		if (node->ty->kind != TY_ARRAY)
+			bc_sized(OP_LOAD1, node->ty);
+		return;
+	case ND_STMT_EXPR: {
+		// The last statement is an expression, whose value is the result
+		Node *n = node->body;
+		for (; n->next; n = n->next)
+			bc_stmt(n);
+		bc_expr(n);
+		return;
+	}
+	case ND_FUNCALL:
+		bc_funcall(node, false);
+		return;
+	case ND_VFILL:
+	case ND_VCOPY:
+	case ND_VSUM:
+		bc_expr(node->lhs);
+		if (node->kind != ND_VSUM)
+			bc_expr(node->rhs);
+		bc_op2(node->kind == ND_VFILL ? OP_VFILL :
+			   node->kind == ND_VCOPY ? OP_VCOPY : OP_VSUM,
+			   size_of(node->ty), node->val);
+		return;
+	}
+
+	bc_expr(node->lhs);
+	bc_expr(node->rhs);
+
+	switch (node->kind) {
+	case ND_ADD:
+	case ND_SUB:
+		if (node->ty->base)
+			bc_op1(OP_MULI, size_of(node->ty->base));
+		bc_emit(node->kind == ND_ADD ? OP_ADD : OP_SUB);
+		return;
+	case ND_MUL:
+		bc_emit(OP_MUL);
+		return;
+	case ND_DIV:
+		bc_emit(OP_DIV);
+		return;
+	case ND_EQ:
+		bc_emit(OP_EQ);
+		return;
+	case ND_NE:
+		bc_emit(OP_NE);
+		return;
+	case ND_LT:
+		bc_emit(OP_LT);
+		return;
+	case ND_LE:
+		bc_emit(OP_LE);
+		return;
+	}
+
+	error_tok(node->tok, "invalid expression");
+}
+
+// Returns the maximum depth of the value stack in the code from
+// `begin`. Only statements branch, and each leaves the stack as deep
+// as it found it on every path, so a linear scan gives the maximum.
+// Inside a statement expression, values of the enclosing expression
+// stay below the statements, and a return there leaves them behind
+// for OP_RET to drop.
+long max_stack_depth(long begin) {
+	long depth = 0;
+	long max = 0;
+	for (long pc = begin; pc < bc_len; pc += op_len[bc[pc]]) {
+		switch (bc[pc]) {
+		case OP_PUSH: case OP_LADDR: case OP_GADDR:
+		case OP_LOADL1: case OP_LOADL4: case OP_LOADL8:
+			depth++;
+			break;
+		case OP_CALL: case OP_NATIVE:
+			depth += 1 - bc[pc + 2];
+			break;
+		case OP_TAILCALL:
+			depth -= bc[pc + 2];
+			break;
+		case OP_LOAD1: case OP_LOAD4: case OP_LOAD8: case OP_MULI:
+		case OP_CAST1: case OP_CAST4:
+		case OP_JMP: case OP_ENTER: case OP_VSUM:
+			break;
+		default:
+			depth--;
+		}
+		if (depth > max)
+			max = depth;
+	}
+	return max;
+}
+
+void bc_function(Function *fn) {
+	fn->entry = bc_len;
+	bc_fn = fn;
+	bc_can_tail_call = !fn_any_node(fn, is_local_addr);
+
+	long enter = bc_len;
+	bc_op2(OP_ENTER, align_to(fn->stack_size, 16), 0);
+
+	// The arguments are on the stack with the last one on top
+	int nparams = 0;
+	for (VarList *vl = fn->params; vl; vl = vl->next)
+		nparams++;
+	Var **params = mem_alloc(MEM_INTERP, nparams * sizeof(Var *));
+	int i = 0;
+	for (VarList *vl = fn->params; vl; vl = vl->next)
+		params[i++] = vl->var;
+	for (i = nparams - 1; i >= 0; i--) {
+		bc_sized(OP_ARG1, params[i]->ty);
+		bc_emit(params[i]->offset);
+	}
+
+	long body = bc_len;
+	for (Node *node = fn->node; node; node = node->next)
+		bc_stmt(node);
+
+	// Falling off the end returns 0
+	bc_op1(OP_PUSH, 0);
+	bc_emit(OP_RET);
+
+	bc[enter + 2] = max_stack_depth(body);
+}
+
+// Replaces opcodes with the addresses of their handlers and jump
+// and call operands with the addresses of their targets
+void thread_code(void **handlers) {
+	Op op;
+	for (long pc = 0; pc < bc_len; pc += op_len[op]) {
+		op = bc[pc];
+		bc[pc] = (long)handlers[op];
+		if (op == OP_JMP || op == OP_JZ)
+			bc[pc + 1] = (long)(bc + bc[pc + 1]);
+		else if (op == OP_CALL || op == OP_TAILCALL)
+			bc[pc + 1] = (long)(bc + ((Function *)bc[pc + 1])->entry);
+	}
+}
+
+typedef struct {
+	long *pc;
+	char *fp;
+	long *sp; // Where the result goes, below the arguments
+} CallFrame;
+
+// Runs threaded code from `pc` until OP_EXIT, which returns the value
+// on top of the stack. If `pc` is NULL, threads the code instead.
+long run(long *pc) {
+	static void *handlers[NUM_OPS] = {
+		[OP_PUSH] = &&op_push, [OP_LADDR] = &&op_laddr, [OP_GADDR] = &&op_push,
+		[OP_LOADL1] = &&op_loadl1, [OP_LOADL4] = &&op_loadl4,
+		[OP_LOADL8] = &&op_loadl8, [OP_LOAD1] = &&op_load1,
+		[OP_LOAD4] = &&op_load4, [OP_LOAD8] = &&op_load8,
+		[OP_STORE1] = &&op_store1, [OP_STORE4] = &&op_store4,
+		[OP_STORE8] = &&op_store8, [OP_POP] = &&op_pop, [OP_ADD] = &&op_add,
+		[OP_SUB] = &&op_sub, [OP_MUL] = &&op_mul, [OP_DIV] = &&op_div,
+		[OP_EQ] = &&op_eq, [OP_NE] = &&op_ne, [OP_LT] = &&op_lt,
+		[OP_LE] = &&op_le, [OP_MULI] = &&op_muli,
+		[OP_CAST1] = &&op_cast1, [OP_CAST4] = &&op_cast4, [OP_JMP] = &&op_jmp,
+		[OP_JZ] = &&op_jz, [OP_CALL] = &&op_call, [OP_TAILCALL] = &&op_tailcall,
+		[OP_NATIVE] = &&op_native, [OP_ENTER] = &&op_enter,
+		[OP_ARG1] = &&op_arg1, [OP_ARG4] = &&op_arg4, [OP_ARG8] = &&op_arg8,
+		[OP_RET] = &&op_ret, [OP_VFILL] = &&op_vfill, [OP_VCOPY] = &&op_vcopy,
+		[OP_VSUM] = &&op_vsum, [OP_EXIT] = &&op_exit,
+	};
+
+	if (!pc) {
+		thread_code(handlers);
+		return 0;
+	}
+
+	char *mem = mem_alloc(MEM_INTERP, MEM_STACK_SIZE);
+	long *vals = mem_alloc(MEM_INTERP, VAL_STACK_SIZE * sizeof(long));
+	CallFrame *frames = mem_alloc(MEM_INTERP, CALL_STACK_SIZE * sizeof(CallFrame));
+	if (!mem || !vals || !frames)
+		error("out of memory");
+
+	char *fp = mem + MEM_STACK_SIZE; // Frame of the current function
+	char *mp = fp;                   // Top of the memory stack
+	long *sp = vals;                 // Next free slot of the value stack
+	CallFrame *rp = frames;          // Next free call frame
+
+#define NEXT goto *(void *)*pc
+#define BINOP(expr)           \
+	do {                      \
+		long b = *--sp;       \
+		long a = sp[-1];      \
+		sp[-1] = (expr);      \
+		pc++;                 \
+		NEXT;                 \
+	} while (0)
+
+	NEXT;
+
+op_push:
+	*sp++ = pc[1];
+	pc += 2;
+	NEXT;
+op_laddr:
+	*sp++ = (long)(fp - pc[1]);
+	pc += 2;
+	NEXT;
+op_loadl1:
+	*sp++ = *(signed char *)(fp - pc[1]);
+	pc += 2;
+	NEXT;
+op_loadl4:
+	*sp++ = *(int *)(fp - pc[1]);
+	pc += 2;
+	NEXT;
+op_loadl8:
+	*sp++ = *(long *)(fp - pc[1]);
+	pc += 2;
+	NEXT;
+op_load1:
+	sp[-1] = *(signed char *)sp[-1];
+	pc++;
+	NEXT;
+op_load4:
+	sp[-1] = *(int *)sp[-1];
+	pc++;
+	NEXT;
+op_load8:
+	sp[-1] = *(long *)sp[-1];
+	pc++;
+	NEXT;
+op_store1:
+	sp--;
+	*(char *)sp[-1] = *sp;
+	sp[-1] = *sp;
+	pc++;
+	NEXT;
+op_store4:
+	sp--;
+	*(int *)sp[-1] = *sp;
+	sp[-1] = *sp;
+	pc++;
+	NEXT;
+op_store8:
+	sp--;
+	*(long *)sp[-1] = *sp;
+	sp[-1] = *sp;
+	pc++;
+	NEXT;
+op_pop:
+	sp--;
+	pc++;
+	NEXT;
+op_add:
+	BINOP((unsigned long)a + b);
+op_sub:
+	BINOP((unsigned long)a - b);
+op_mul:
+	BINOP((unsigned long)a * b);
+op_div:
+	BINOP(a / b);
+op_eq:
+	BINOP(a == b);
+op_ne:
+	BINOP(a != b);
+op_lt:
+	BINOP(a < b);
+op_le:
+	BINOP(a <= b);
+op_muli:
+	sp[-1] = (unsigned long)sp[-1] * pc[1];
+	pc += 2;
+	NEXT;
+op_cast1:
+	sp[-1] = (signed char)sp[-1];
+	pc++;
+	NEXT;
+op_cast4:
+	sp[-1] = (int)sp[-1];
+	pc++;
+	NEXT;
+op_jmp:
+	pc = (long *)pc[1];
+	NEXT;
+op_jz:
+	pc = *--sp ? pc + 2 : (long *)pc[1];
+	NEXT;
+op_call:
+	if (rp == frames + CALL_STACK_SIZE)
+		error("stack overflow");
+	rp->pc = pc + 3;
+	rp->fp = fp;
+	rp->sp = sp - pc[2];
+	rp++;
+	fp = mp;
+	pc = (long *)pc[1];
+	NEXT;
+op_tailcall:
+	// Our frame is reused by the callee
+	mp = fp;
+	pc = (long *)pc[1];
+	NEXT;
+op_native: {
+	long a[MAX_NATIVE_ARGS] = {};
+	int nargs = pc[2];
+	sp -= nargs;
+	for (int i = 0; i < nargs; i++)
+		a[i] = sp[i];
+	long (*fn)(long, long, long, long, long, long) = (void *)pc[1];
+	*sp++ = fn(a[0], a[1], a[2], a[3], a[4], a[5]);
+	pc += 3;
+	NEXT;
+}
+op_enter:
+	mp = fp - pc[1];
+	if (mp < mem || sp + pc[2] > vals + VAL_STACK_SIZE)
+		error("stack overflow");
+	pc += 3;
+	NEXT;
+op_arg1:
+	*(char *)(fp - pc[1]) = *--sp;
+	pc += 2;
+	NEXT;
+op_arg4:
+	*(int *)(fp - pc[1]) = *--sp;
+	pc += 2;
+	NEXT;
+op_arg8:
+	*(long *)(fp - pc[1]) = *--sp;
+	pc += 2;
+	NEXT;
+op_ret: {
+	long val = sp[-1];
+	mp = fp;
+	rp--;
+	fp = rp->fp;
+	pc = rp->pc;
+	sp = rp->sp;
+	*sp++ = val;
+	NEXT;
+}
+op_vfill: {
+	long val = *--sp;
+	char *p = (char *)sp[-1];
+	for (long i = 0; i < pc[2]; i++, p += pc[1])
+		memcpy(p, &val, pc[1]);
+	pc += 3;
+	NEXT;
+}
+op_vcopy:
+	sp--;
+	memcpy((void *)sp[-1], (void *)*sp, pc[1] * pc[2]);
+	pc += 3;
+	NEXT;
+op_vsum: {
+	char *p = (char *)sp[-1];
+	unsigned long sum = 0;
+	for (long i = 0; i < pc[2]; i++, p += pc[1])
+		sum += pc[1] == 1 ? *(signed char *)p : pc[1] == 4 ? *(int *)p : *(long *)p;
+	sp[-1] = sum;
+	pc += 3;
+	NEXT;
+}
+op_exit:
+	return sp[-1];
+
+#undef BINOP
+#undef NEXT
+}
+
+// Runs main() of `prog` and exits with its return value
+void interpret(Program *prog) {
+	bc_prog = prog;
+
+	// main() is called by two instructions at the start
+	Function *main_fn = find_function(prog, "main");
+	if (!main_fn)
+		error("%s: no main function", filename);
+	int nparams = 0;
+	for (VarList *vl = main_fn->params; vl; vl = vl->next)
+		nparams++;
+	char *argv[] = {filename, NULL};
+	if (nparams > 0)
+		bc_op1(OP_PUSH, 1);
+	if (nparams > 1)
+		bc_op1(OP_PUSH, (long)argv);
+	bc_op2(OP_CALL, (long)main_fn, nparams);
+	bc_emit(OP_EXIT);
+
+	for (Function *fn = prog->fns; fn; fn = fn->next)
+		bc_function(fn);
+
+	run(NULL);
+	int status = run(bc);
+
+	// What the program printed is buffered in the libc it called
+	if (libc)
+		((int (*)(FILE *))dlsym(libc, "fflush"))(NULL);
+	mem_exit();
+	exit(status);
+}
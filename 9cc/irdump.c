@@ -0,0 +1,126 @@
+#include "9cc.h"
+
+// Prints IR in a human-readable form for debugging.
+//
+// add2:
+//   bb1:
+//     v0 = param 0
+//     v1 = lvar x
+//     store8 [v1], v0
+//     ...
+
+char *ir_name[] = {
+	[IR_IMM] = "imm",
+	[IR_MOV] = "mov",
+	[IR_ADD] = "add",
+	[IR_SUB] = "sub",
+	[IR_MUL] = "mul",
+	[IR_DIV] = "div",
+	[IR_EQ] = "eq",
+	[IR_NE] = "ne",
+	[IR_LT] = "lt",
+	[IR_LE] = "le",
+	[IR_LVAR] = "lvar",
+	[IR_GVAR] = "gvar",
+	[IR_LOAD] = "load",
+	[IR_STORE] = "store",
+	[IR_PARAM] = "param",
+	[IR_CALL] = "call",
+	[IR_RET] = "ret",
+	[IR_JMP] = "jmp",
+	[IR_BR] = "br",
+	[IR_CAST] = "cast",
+	[IR_PHI] = "phi",
+	[IR_VFILL] = "vfill",
+	[IR_VCOPY] = "vcopy",
+	[IR_VSUM] = "vsum",
+	[IR_COUNT] = "count",
+};
+
+void dump_operand(IR *ir) {
+	if (ir->r2)
+		fprintf(stderr, "v%d", ir->r2->vn);
+	else
+		fprintf(stderr, "%ld", ir->imm);
+}
+
+void dump_ir_inst(IR *ir) {
+	fprintf(stderr, "    ");
+
+	switch (ir->op) {
+	case IR_IMM:
+		fprintf(stderr, "v%d = %ld\n", ir->r0->vn, ir->imm);
+		return;
+	case IR_MOV:
+		fprintf(stderr, "v%d = v%d\n", ir->r0->vn, ir->r1->vn);
+		return;
+	case IR_CAST:
+		fprintf(stderr, "v%d = cast%d v%d\n", ir->r0->vn, ir->size, ir->r1->vn);
+		return;
+	case IR_VFILL:
+	case IR_VCOPY:
+		fprintf(stderr, "%s%d [v%d], v%d, %ld\n", ir_name[ir->op], ir->size,
+				ir->r1->vn, ir->r2->vn, ir->imm);
+		return;
+	case IR_VSUM:
+		fprintf(stderr, "v%d = vsum%d [v%d], %ld\n", ir->r0->vn, ir->size,
+				ir->r1->vn, ir->imm);
+		return;
+	case IR_PHI:
+		fprintf(stderr, "v%d = phi", ir->r0->vn);
+		for (int i = 0; i < ir->nargs; i++)
+			fprintf(stderr, "%s [bb%d: v%d]", i ? "," : "", ir->bbs[i]->label,
+					ir->args[i]->vn);
+		fprintf(stderr, "\n");
+		return;
+	case IR_LVAR:
+	case IR_GVAR:
+		fprintf(stderr, "v%d = %s %s\n", ir->r0->vn, ir_name[ir->op], ir->var->name);
+		return;
+	case IR_LOAD:
+		fprintf(stderr, "v%d = load%d [v%d]\n", ir->r0->vn, ir->size, ir->r1->vn);
+		return;
+	case IR_STORE:
+		fprintf(stderr, "store%d [v%d], v%d\n", ir->size, ir->r1->vn, ir->r2->vn);
+		return;
+	case IR_PARAM:
+		fprintf(stderr, "v%d = param %ld\n", ir->r0->vn, ir->imm);
+		return;
+	case IR_CALL:
+		fprintf(stderr, "v%d = %s %s(", ir->r0->vn,
+				ir->is_tail ? "tailcall" : "call", ir->name);
+		for (int i = 0; i < ir->nargs; i++)
+			fprintf(stderr, "%sv%d", i ? ", " : "", ir->args[i]->vn);
+		fprintf(stderr, ")\n");
+		return;
+	case IR_RET:
+		fprintf(stderr, "ret v%d\n", ir->r1->vn);
+		return;
+	case IR_COUNT:
+		fprintf(stderr, "count %s %ld\n", ir->name, ir->imm);
+		return;
+	case IR_JMP:
+		fprintf(stderr, "jmp bb%d\n", ir->bb1->label);
+		return;
+	case IR_BR:
+		fprintf(stderr, "br v%d, bb%d, bb%d\n", ir->r1->vn,
+				ir->bb1->label, ir->bb2->label);
+		return;
+	}
+
+	// Binary operators
+	fprintf(stderr, "v%d = %s v%d, ", ir->r0->vn, ir_name[ir->op], ir->r1->vn);
+	dump_operand(ir);
+	fprintf(stderr, "\n");
+}
+
+void dump_ir(Function *fn, char *title) {
+	fprintf(stderr, "%s: (%s)\n", fn->name, title);
+
+	for (BB *bb = fn->bb; bb; bb = bb->next) {
+		fprintf(stderr, "  bb%d:\n", bb->label);
+		for (IR *ir = bb->ir; ir; ir = ir->next)
+			dump_ir_inst(ir);
+	}
+	fprintf(stderr, "\n");
+}
@@ -0,0 +1,195 @@
+#include "9cc.h"
+
+// Liveness analysis for register allocation.
+//
+// Instructions are numbered in the order of the basic block list.
+// The live range of each virtual register is approximated by a
+// single interval from its first to its last live position, which is
+// what a linear scan allocator needs.
+
+typedef struct {
+	int from;       // Position of the first instruction
+	int to;         // Position of the last instruction
+	int depth;      // Loop nesting depth
+	bool *live_in;  // Indexed by virtual register number
+	bool *live_out;
+} BlockInfo;
+
+BB **blocks;
+BlockInfo *info;
+int nblocks;
+
+int block_index(BB *bb) {
+	for (int i = 0; i < nblocks; i++)
+		if (blocks[i] == bb)
+			return i;
+	error("unknown basic block: bb%d", bb->label);
+}
+
+// Records a read of `r` unless the block has already written it
+void add_use(bool *use, bool *def, Reg *r) {
+	if (r && !def[r->vn])
+		use[r->vn] = true;
+}
+
+void compute_live_sets(int nreg) {
+	bool **use = mem_alloc(MEM_IR, nblocks * sizeof(bool *));
+	bool **def = mem_alloc(MEM_IR, nblocks * sizeof(bool *));
+
+	for (int i = 0; i < nblocks; i++) {
+		use[i] = mem_alloc(MEM_IR, nreg * sizeof(bool));
+		def[i] = mem_alloc(MEM_IR, nreg * sizeof(bool));
+		info[i].live_in = mem_alloc(MEM_IR, nreg * sizeof(bool));
+		info[i].live_out = mem_alloc(MEM_IR, nreg * sizeof(bool));
+
+		for (IR *ir = blocks[i]->ir; ir; ir = ir->next) {
+			Reg **r;
+			for (int j = 0; (r = use_at(ir, j)); j++)
+				add_use(use[i], def[i], *r);
+			if (ir->r0)
+				def[i][ir->r0->vn] = true;
+		}
+	}
+
+	// Iterate backward dataflow to a fixed point:
+	//   out = union of the successors' in
+	//   in  = use + (out - def)
+	for (bool changed = true; changed;) {
+		changed = false;
+
+		for (int i = nblocks - 1; i >= 0; i--) {
+			BB *succ[2];
+			int n = get_succs(blocks[i], succ);
+			for (int j = 0; j < n; j++) {
+				bool *in = info[block_index(succ[j])].live_in;
+				for (int k = 0; k < nreg; k++)
+					info[i].live_out[k] |= in[k];
+			}
+
+			for (int k = 0; k < nreg; k++) {
+				bool in = use[i][k] || (info[i].live_out[k] && !def[i][k]);
+				if (in && !info[i].live_in[k]) {
+					info[i].live_in[k] = true;
+					changed = true;
+				}
+			}
+		}
+	}
+}
+
+// Every jump to an earlier block closes a loop. Blocks in between are
+// inside the loop.
+void compute_loop_depth() {
+	for (int i = 0; i < nblocks; i++) {
+		BB *succ[2];
+		int n = get_succs(blocks[i], succ);
+		for (int j = 0; j < n; j++) {
+			int header = block_index(succ[j]);
+			if (header <= i)
+				for (int k = header; k <= i; k++)
+					info[k].depth++;
+		}
+	}
+}
+
+Interval *get_interval(Interval **intervals, Reg *r, int pos) {
+	Interval *iv = intervals[r->vn];
+	if (!iv) {
+		iv = mem_alloc(MEM_IR, sizeof(Interval));
+		iv->reg = r;
+		iv->start = pos;
+		iv->end = pos;
+		intervals[r->vn] = iv;
+	}
+	if (pos < iv->start)
+		iv->start = pos;
+	if (pos > iv->end)
+		iv->end = pos;
+	return iv;
+}
+
+// Returns live intervals indexed by virtual register number.
+// Registers that don't appear in the function have no interval.
+Interval **compute_intervals(Function *fn) {
+	nblocks = 0;
+	for (BB *bb = fn->bb; bb; bb = bb->next)
+		nblocks++;
+
+	blocks = mem_alloc(MEM_IR, nblocks * sizeof(BB *));
+	info = mem_alloc(MEM_IR, nblocks * sizeof(BlockInfo));
+
+	int i = 0;
+	int pos = 0;
+	for (BB *bb = fn->bb; bb; bb = bb->next) {
+		blocks[i] = bb;
+		info[i].from = pos;
+		for (IR *ir = bb->ir; ir; ir = ir->next)
+			pos++;
+		info[i++].to = pos - 1;
+	}
+
+	compute_live_sets(fn->nreg);
+	compute_loop_depth();
+
+	Reg **regs = mem_alloc(MEM_IR, fn->nreg * sizeof(Reg *));
+	for (BB *bb = fn->bb; bb; bb = bb->next) {
+		for (IR *ir = bb->ir; ir; ir = ir->next) {
+			Reg **r;
+			for (int j = 0; (r = use_at(ir, j)); j++)
+				if (*r)
+					regs[(*r)->vn] = *r;
+			if (ir->r0)
+				regs[ir->r0->vn] = ir->r0;
+		}
+	}
+
+	Interval **intervals = mem_alloc(MEM_IR, fn->nreg * sizeof(Interval *));
+	int *calls = mem_alloc(MEM_IR, pos * sizeof(int));
+	int ncalls = 0;
+
+	for (i = 0; i < nblocks; i++) {
+		// Spilling a register used in a loop costs more. With a
+		// profile, the cost is how often the block ran.
+		int weight = 1;
+		for (int d = 0; d < info[i].depth && d < 4; d++)
+			weight *= 8;
+		long count = blocks[i]->count;
+		if (count >= 0)
+			weight = (count < 65535 ? count : 65535) + 1;
+
+		for (int k = 0; k < fn->nreg; k++) {
+			if (info[i].live_in[k])
+				get_interval(intervals, regs[k], info[i].from);
+			if (info[i].live_out[k])
+				get_interval(intervals, regs[k], info[i].to);
+		}
+
+		pos = info[i].from;
+		for (IR *ir = blocks[i]->ir; ir; ir = ir->next, pos++) {
+			Reg **r;
+			for (int j = 0; (r = use_at(ir, j)); j++)
+				if (*r)
+					get_interval(intervals, *r, pos)->weight += weight;
+
+			if (ir->r0) {
+				// Parameters arrive in registers at the function entry
+				if (ir->op == IR_PARAM)
+					get_interval(intervals, ir->r0, 0);
+				get_interval(intervals, ir->r0, pos)->weight += weight;
+			}
+
+			if (ir->op == IR_CALL)
+				calls[ncalls++] = pos;
+		}
+	}
+
+	for (int k = 0; k < fn->nreg; k++) {
+		Interval *iv = intervals[k];
+		if (!iv)
+			continue;
+		for (int j = 0; j < ncalls; j++)
+			if (iv->start < calls[j] && calls[j] < iv->end)
+				iv->crosses_call = true;
+	}
+	return intervals;
+}
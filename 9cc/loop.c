@@ -0,0 +1,311 @@
+#include "9cc.h"
+
+// Optimizes counted loops of the form
+//
+//   for (i = C0; i < C1; i = i + 1) body
+//
+// where C0 and C1 are constants and the body doesn't modify `i`.
+//
+// Loops whose body is a fill `a[i] = x`, a copy `a[i] = b[i]` or a
+// sum `s = s + a[i]` are replaced with vector operations, which the
+// code generator emits as SSE2 loops over 16 bytes at a time. Other
+// loops are unrolled: completely if the result is small, or else by a
+// factor that divides the trip count.
+
+#define UNROLL_LIMIT 64 // Maximum number of nodes after unrolling
+
+Function *loop_fn;
+Var *loop_var;
+int unrolled;
+int vectorized;
+
+bool is_var(Node *node, Var *var) {
+	return node->kind == ND_VAR && node->var == var;
+}
+
+bool takes_loop_var_addr(Node *node) {
+	return node->kind == ND_ADDR && is_var(node->lhs, loop_var);
+}
+
+bool modifies_loop_var(Node *node) {
+	return (node->kind == ND_ASSIGN || node->kind == ND_ADDR) &&
+		   is_var(node->lhs, loop_var);
+}
+
+bool any_in(Node *node, bool (*pred)(Node *)) {
+	if (!node)
+		return false;
+	if (pred(node))
+		return true;
+	if (any_in(node->lhs, pred) || any_in(node->rhs, pred) ||
+		any_in(node->cond, pred) || any_in(node->then, pred) ||
+		any_in(node->els, pred) || any_in(node->init, pred) ||
+		any_in(node->inc, pred))
+		return true;
+	for (Node *n = node->body; n; n = n->next)
+		if (any_in(n, pred))
+			return true;
+	for (Node *n = node->args; n; n = n->next)
+		if (any_in(n, pred))
+			return true;
+	return false;
+}
+
+// Returns the trip count of a counted loop, or -1. Sets `loop_var`
+// and `start` to its induction variable and initial value.
+long trip_count(Node *node, long *start) {
+	Node *init = node->init;
+	Node *cond = node->cond;
+	Node *inc = node->inc;
+	if (!init || !cond || !inc)
+		return -1;
+
+	// i = C0
+	if (init->kind != ND_EXPR_STMT || init->lhs->kind != ND_ASSIGN ||
+		init->lhs->lhs->kind != ND_VAR || init->lhs->rhs->kind != ND_NUM)
+		return -1;
+	Var *var = init->lhs->lhs->var;
+	if (!var->is_local || (var->ty->kind != TY_INT && var->ty->kind != TY_LONG))
+		return -1;
+
+	// i < C1 or i <= C1
+	if ((cond->kind != ND_LT && cond->kind != ND_LE) ||
+		!is_var(cond->lhs, var) || cond->rhs->kind != ND_NUM)
+		return -1;
+
+	// i = i + 1
+	Node *e = inc->lhs;
+	if (inc->kind != ND_EXPR_STMT || e->kind != ND_ASSIGN || !is_var(e->lhs, var) ||
+		e->rhs->kind != ND_ADD || !is_var(e->rhs->lhs, var) ||
+		e->rhs->rhs->kind != ND_NUM || e->rhs->rhs->val != 1)
+		return -1;
+
+	// The variable must not change other than by the increment. Its
+	// address must not be taken anywhere, or a store through a pointer
+	// could change it.
+	loop_var = var;
+	if (any_in(node->then, modifies_loop_var))
+		return -1;
+	for (Node *n = loop_fn->node; n; n = n->next)
+		if (any_in(n, takes_loop_var_addr))
+			return -1;
+
+	*start = init->lhs->rhs->val;
+	long end = cond->rhs->val + (cond->kind == ND_LE);
+	return end > *start ? end - *start : -1;
+}
+
+// Returns the array of an `a[i]` expression, where `a` is an array or
+// pointer variable and `i` is the loop variable
+Node *indexed_array(Node *node) {
+	if (node->kind != ND_DEREF || node->lhs->kind != ND_ADD)
+		return NULL;
+
+	Node *base = node->lhs->lhs;
+	if (base->kind != ND_VAR || !base->ty->base || !is_var(node->lhs->rhs, loop_var))
+		return NULL;
+
+	int sz = size_of(node->ty);
+	if (node->ty->kind == TY_ARRAY || (sz != 1 && sz != 4 && sz != 8))
+		return NULL;
+	return base;
+}
+
+// Returns true if `start` + `n` elements are in bounds of `base`
+bool in_bounds(Node *base, long start, long n) {
+	if (start < 0)
+		return false;
+	return base->ty->kind != TY_ARRAY || start + n <= base->ty->array_size;
+}
+
+// Returns the address of the element `start` of an array
+Node *element_addr(Node *base, long start) {
+	Node *addr = copy_tree(base);
+	if (start == 0)
+		return addr;
+	Node *node = new_binary(ND_ADD, addr, new_num(start, base->tok), base->tok);
+	node->rhs->ty = int_type();
+	node->ty = base->ty;
+	return node;
+}
+
+Node *new_vec(NodeKind kind, Node *base, long start, long n, Type *ty) {
+	Node *node = new_node(kind, base->tok);
+	node->lhs = element_addr(base, start);
+	node->val = n;
+	node->ty = ty;
+	return node;
+}
+
+// Returns a vector operation equivalent to the loop, or NULL
+Node *vectorize(Node *loop, long start, long n) {
+	Node *body = loop->then;
+	if (body->kind == ND_BLOCK && body->body && !body->body->next)
+		body = body->body;
+	if (body->kind != ND_EXPR_STMT || body->lhs->kind != ND_ASSIGN)
+		return NULL;
+
+	Node *lhs = body->lhs->lhs;
+	Node *rhs = body->lhs->rhs;
+
+	// Stores through a pointer could alias a local variable whose
+	// address is taken
+	bool may_alias = fn_any_node(loop_fn, is_local_addr);
+
+	// a[i] = x
+	Node *dst = indexed_array(lhs);
+	if (dst && in_bounds(dst, start, n)) {
+		bool invariant = rhs->kind == ND_NUM ||
+						 (rhs->kind == ND_VAR && !rhs->ty->base && rhs->var != loop_var &&
+						  dst->ty->kind == TY_ARRAY);
+		if (invariant) {
+			Node *node = new_vec(ND_VFILL, dst, start, n, lhs->ty);
+			node->rhs = copy_tree(rhs);
+			return new_unary(ND_EXPR_STMT, node, body->tok);
+		}
+
+		// a[i] = b[i], where a and b are different arrays
+		Node *src = indexed_array(rhs);
+		if (src && dst->ty->kind == TY_ARRAY && src->ty->kind == TY_ARRAY &&
+			dst->var != src->var && size_of(lhs->ty) == size_of(rhs->ty) &&
+			in_bounds(src, start, n)) {
+			Node *node = new_vec(ND_VCOPY, dst, start, n, lhs->ty);
+			node->rhs = element_addr(src, start);
+			return new_unary(ND_EXPR_STMT, node, body->tok);
+		}
+		return NULL;
+	}
+
+	// s = s + a[i] or s = a[i] + s
+	if (lhs->kind != ND_VAR || (lhs->ty->kind != TY_INT && lhs->ty->kind != TY_LONG) ||
+		rhs->kind != ND_ADD)
+		return NULL;
+	Node *elem = is_var(rhs->lhs, lhs->var) ? rhs->rhs : rhs->lhs;
+	Node *other = (elem == rhs->rhs) ? rhs->lhs : rhs->rhs;
+	Node *src = indexed_array(elem);
+	if (!src || !is_var(other, lhs->var) || size_of(elem->ty) != size_of(lhs->ty) ||
+		!in_bounds(src, start, n))
+		return NULL;
+	if (src->ty->kind != TY_ARRAY && (!lhs->var->is_local || may_alias))
+		return NULL;
+
+	Node *sum = new_vec(ND_VSUM, src, start, n, elem->ty);
+	Node *add = new_binary(ND_ADD, copy_tree(lhs), sum, body->tok);
+	add->ty = lhs->ty;
+	Node *assign = new_binary(ND_ASSIGN, copy_tree(lhs), add, body->tok);
+	assign->ty = lhs->ty;
+	return new_unary(ND_EXPR_STMT, assign, body->tok);
+}
+
+// Returns a list of `n` copies of the body and increment
+Node *unroll_body(Node *loop, long n) {
+	Node head;
+	head.next = NULL;
+	Node *cur = &head;
+
+	for (long i = 0; i < n; i++) {
+		cur = cur->next = copy_tree(loop->then);
+		cur = cur->next = copy_tree(loop->inc);
+	}
+	return head.next;
+}
+
+// Returns a statement assigning `val` to the loop variable
+Node *set_loop_var(Node *loop, long val) {
+	Node *var = copy_tree(loop->init->lhs->lhs);
+	Node *num = new_num(val, loop->tok);
+	num->ty = int_type();
+	Node *assign = new_binary(ND_ASSIGN, var, num, loop->tok);
+	assign->ty = var->ty;
+	return new_unary(ND_EXPR_STMT, assign, loop->tok);
+}
+
+// Returns the optimized form of a loop, or NULL
+Node *optimize_loop(Node *node) {
+	long start;
+	long n = trip_count(node, &start);
+	if (n <= 0)
+		return NULL;
+
+	Node *vec = vectorize(node, start, n);
+	if (vec) {
+		vec->next = set_loop_var(node, start + n);
+		Node *block = new_node(ND_BLOCK, node->tok);
+		block->body = vec;
+		vectorized++;
+		return block;
+	}
+
+	int size = count_nodes(node->then) + count_nodes(node->inc);
+
+	if (n * size <= UNROLL_LIMIT) {
+		Node *block = new_node(ND_BLOCK, node->tok);
+		block->body = node->init;
+		node->init->next = unroll_body(node, n);
+		unrolled++;
+		return block;
+	}
+
+	for (int factor = 4; factor >= 2; factor /= 2) {
+		if (n % factor || factor * size > UNROLL_LIMIT)
+			continue;
+
+		// The last increment is the one in the loop header
+		Node *body = unroll_body(node, factor - 1);
+		Node *last = body;
+		while (last->next)
+			last = last->next;
+		last->next = node->then;
+
+		Node *block = new_node(ND_BLOCK, node->tok);
+		block->body = body;
+		node->then = block;
+		unrolled++;
+		return node;
+	}
+	return NULL;
+}
+
+void optimize_list(Node *node);
+
+void optimize_walk(Node *node) {
+	if (!node)
+		return;
+
+	// Optimize inner loops first
+	optimize_walk(node->lhs);
+	optimize_walk(node->rhs);
+	optimize_walk(node->then);
+	optimize_walk(node->els);
+	optimize_list(node->body);
+	optimize_list(node->args);
+
+	if (node->kind != ND_FOR)
+		return;
+
+	Node *res = optimize_loop(node);
+	if (!res || res == node)
+		return;
+
+	Node *next = node->next;
+	*node = *res;
+	node->next = next;
+}
+
+void optimize_list(Node *node) {
+	for (Node *n = node; n; n = n->next)
+		optimize_walk(n);
+}
+
+void optimize_loops(Program *prog, int *nunrolled, int *nvectorized) {
+	unrolled = 0;
+	vectorized = 0;
+
+	for (Function *fn = prog->fns; fn; fn = fn->next) {
+		loop_fn = fn;
+		optimize_list(fn->node);
+	}
+
+	*nunrolled = unrolled;
+	*nvectorized = vectorized;
+}
@@ -7,11 +7,23 @@ char *read_file(char *path) {
 	if (!fp)
 		error("cannot open %s: %s", path, strerror(errno));
 
-	int filemax = 10 * 1024 * 1024;
-	char *buf = malloc(filemax);
-	int size = fread(buf, 1, filemax - 2, fp);
-	if (!feof(fp))
-		error("%s: file too large");
+	// Read it into a buffer that grows as needed, with room for "\n\0"
+	long filemax = 10 * 1024 * 1024;
+	long cap = 4096;
+	char *buf = mem_realloc(MEM_DRIVER, NULL, cap);
+	long size = 0;
+	for (;;) {
+		size += fread(buf + size, 1, cap - size - 2, fp);
+		if (ferror(fp))
+			error("cannot read %s: %s", path, strerror(errno));
+		if (feof(fp))
+			break;
+		if (cap == filemax)
+			error("%s: file too large", path);
+		cap = (cap * 2 < filemax) ? cap * 2 : filemax;
+		buf = mem_realloc(MEM_DRIVER, buf, cap);
+	}
+	fclose(fp);
 
 	// Make sure that the string ends with "\n\0"
 	if (size == 0 || buf[size - 1] != '\n')
@@ -24,31 +36,301 @@ int align_to(int n, int align) {
 	return (n + align - 1) & ~(align - 1);
 }
 
-int main(int argc, char **argv) {
-	if (argc != 2) {
+// Command line options
+int opt_level;         // -O, -O<N>
+int inline_limit = 32; // -finline-limit=N
+bool opt_info;         // -fopt-info
+bool dump_ir_flag;     // -fdump-ir
+bool profile_generate; // -fprofile-generate
+bool profile_use;      // -fprofile-use, -fprofile-use=PATH
+bool instrument_functions; // -finstrument-functions
+bool debug_info;       // -g
+bool use_cache;        // --cache
+bool cache_stats;      // --cache-stats
+bool incremental;      // --incremental
+bool emit_ast;         // --emit-ast
+bool from_ast;         // --from-ast
+bool server_mode;      // --server
+bool use_server;       // --use-server, --no-server
+bool tokenize_bench;   // --bench-tokenize
+bool interp;           // --interp
+bool mem_report;       // --mem-report
+
+void parse_args(int argc, char **argv) {
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-O")) {
+			opt_level = 1;
+			continue;
+		}
+
+		if (!strncmp(argv[i], "-O", 2) && isdigit(argv[i][2])) {
+			opt_level = atoi(argv[i] + 2);
+			continue;
+		}
+
+		if (!strcmp(argv[i], "-g")) {
+			debug_info = true;
+			continue;
+		}
+
+		if (!strcmp(argv[i], "-fdump-ir")) {
+			dump_ir_flag = true;
+			continue;
+		}
+
+		if (!strncmp(argv[i], "-finline-limit=", 15)) {
+			inline_limit = atoi(argv[i] + 15);
+			continue;
+		}
+
+		if (!strcmp(argv[i], "-fopt-info")) {
+			opt_info = true;
+			continue;
+		}
+
+		if (!strcmp(argv[i], "-fprofile-generate")) {
+			profile_generate = true;
+			continue;
+		}
+
+		if (!strcmp(argv[i], "-fprofile-use")) {
+			profile_use = true;
+			continue;
+		}
+
+		if (!strncmp(argv[i], "-fprofile-use=", 14)) {
+			profile_use = true;
+			profile_path = argv[i] + 14;
+			continue;
+		}
+
+		if (!strcmp(argv[i], "-finstrument-functions")) {
+			instrument_functions = true;
+			continue;
+		}
+
+		if (!strncmp(argv[i], "-finstrument-enter=", 19)) {
+			enter_hook = argv[i] + 19;
+			continue;
+		}
+
+		if (!strncmp(argv[i], "-finstrument-exit=", 18)) {
+			exit_hook = argv[i] + 18;
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--cache")) {
+			use_cache = true;
+			continue;
+		}
+
+		if (!strncmp(argv[i], "--cache-dir=", 12)) {
+			cache_dir = argv[i] + 12;
+			continue;
+		}
+
+		if (!strncmp(argv[i], "--cache-size=", 13)) {
+			cache_limit = atol(argv[i] + 13);
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--cache-stats")) {
+			cache_stats = true;
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--incremental")) {
+			incremental = true;
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--emit-ast")) {
+			emit_ast = true;
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--from-ast")) {
+			from_ast = true;
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--server")) {
+			server_mode = true;
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--use-server")) {
+			use_server = true;
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--no-server")) {
+			use_server = false;
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--interp")) {
+			interp = true;
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--mem-report")) {
+			mem_report = true;
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--bench-tokenize")) {
+			tokenize_bench = true;
+			continue;
+		}
+
+		if (!strncmp(argv[i], "--socket=", 9)) {
+			socket_path = argv[i] + 9;
+			continue;
+		}
+
+		if (argv[i][0] == '-' && argv[i][1] != '\0')
+			error("unknown argument: %s", argv[i]);
+		if (filename)
+			error("%s: invalid number of arguments", argv[0]);
+		filename = argv[i];
+	}
+
+	if (!filename && !cache_stats && !server_mode)
 		error("%s: invalid number of arguments", argv[0]);
+	if (incremental && (emit_ast || from_ast))
+		error("%s: --incremental cannot be used with AST snapshots", argv[0]);
+	if (use_cache && from_ast)
+		error("%s: --cache cannot be used with --from-ast", argv[0]);
+	if (interp && (incremental || emit_ast || use_cache))
+		error("%s: --interp cannot be used with options that save output", argv[0]);
+}
+
+// Runs the optimizations on the AST and assigns stack frames
+void optimize(Program *prog) {
+	// Number the profile counters before the AST changes
+	if (profile_generate || profile_use)
+		assign_counters(prog);
+	if (profile_use)
+		load_profile();
+
+	// Inline small functions. An instrumented program counts or
+	// hooks the calls of every function.
+	if (inline_limit > 0 && !profile_generate && !instrument_functions) {
+		int n = inline_functions(prog, inline_limit);
+		if (opt_info)
+			fprintf(stderr, "%s: inlined %d call sites\n", filename, n);
 	}
 
-	// Tokenize and parse
-	filename = argv[1];
-	user_input = read_file(filename);
-	token = tokenize();
-	Program *prog = program();
-	add_type(prog);
+	// Remove unreachable code and unused locals
+	int nstmts, nvars;
+	eliminate_dead_code(prog, &nstmts, &nvars);
+	if (opt_info)
+		fprintf(stderr, "%s: removed %d dead statements and %d unused locals\n",
+				filename, nstmts, nvars);
+
+	// Unroll and vectorize counted loops, unless their iterations
+	// are being counted
+	if (opt_level > 0 && !profile_generate) {
+		int nunrolled, nvectorized;
+		optimize_loops(prog, &nunrolled, &nvectorized);
+		if (opt_info)
+			fprintf(stderr, "%s: unrolled %d loops and vectorized %d loops\n",
+					filename, nunrolled, nvectorized);
+	}
 
 	// Assign offsets to local variables
-	for (Function *fn = prog->fns; fn; fn = fn->next) {
-		int offset = 0;
-		for (VarList *vl = fn->locals; vl; vl = vl->next) {
-			Var *var = vl->var;
-			offset += size_of(var->ty);
-			var->offset = offset;
+	int saved = 0;
+	for (Function *fn = prog->fns; fn; fn = fn->next)
+		saved += layout_frame(fn);
+	if (opt_info)
+		fprintf(stderr, "%s: saved %d bytes of stack frames\n", filename, saved);
+}
+
+// Compiles `user_input` and writes assembly to stdout
+void compile(int argc, char **argv) {
+	// Reuse the output of a previous compilation of the same input
+	if (use_cache && cache_lookup(user_input, argc, argv)) {
+		if (cache_stats)
+			print_cache_stats();
+		return;
+	}
+
+	if (incremental) {
+		compile_incremental(argc, argv);
+	} else if (emit_ast) {
+		// Tokenize and parse, and save the typed program
+		token = tokenize();
+		Program *prog = program();
+		add_type(prog);
+		save_ast(prog);
+	} else {
+		// Tokenize and parse, or load a saved program
+		Program *prog;
+		if (from_ast) {
+			prog = load_ast(filename);
+		} else {
+			token = tokenize();
+			prog = program();
+			add_type(prog);
 		}
-		fn->stack_size = align_to(offset, 8);
+		optimize(prog);
+
+		// Run the program instead of emitting it
+		if (interp)
+			interpret(prog);
+
+		// Traverse the AST to emit assembly, or lower it to IR,
+		// optimize it and emit assembly from the IR.
+		if (opt_level == 0) {
+			codegen(prog);
+		} else {
+			gen_ir(prog);
+			run_passes(prog, dump_ir_flag);
+			alloc_regs(prog);
+			gen_x86(prog);
+		}
+	}
+
+	if (use_cache)
+		cache_store();
+	if (cache_stats)
+		print_cache_stats();
+}
+
+int main(int argc, char **argv) {
+	parse_args(argc, argv);
+
+	if (server_mode) {
+		if (filename)
+			error("%s: --server takes no input file", argv[0]);
+		run_server();
+		return 0;
 	}
 
-	// Traverse the AST to emit assembly
-	codegen(prog);
+	if (!filename) {
+		print_cache_stats();
+		return 0;
+	}
+
+	// With --use-server, let a running compile server do the work if
+	// there is one. Only the input is sent, not the side files of
+	// incremental compilation or the profile, a snapshot is mapped
+	// rather than read, and an interpreted program runs in this process.
+	if (!from_ast) {
+		user_input = read_file(filename);
+		if (tokenize_bench) {
+			bench_tokenize();
+			return 0;
+		}
+
+		int status;
+		if (use_server && !incremental && !profile_use && !interp && !mem_report &&
+			request_compile(argc, argv, &status))
+			return status;
+	}
 
+	compile(argc, argv);
+	mem_exit();
 	return 0;
 }
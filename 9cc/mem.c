@@ -0,0 +1,190 @@
+#include "9cc.h"
+
+// Memory allocation with ownership and accounting.
+//
+// Every allocation belongs to the subsystem that made it. The compiler
+// doesn't free objects one by one, since the AST and the IR share them
+// freely, so small objects are carved out of large chunks, a chain per
+// subsystem. Memory that grows or is freed early comes from
+// mem_realloc() as a block of its own. Chunks and blocks are linked
+// into a list, so that mem_teardown() can free everything at exit and
+// LeakSanitizer and long-running callers see no leaks.
+
+#define CHUNK_SIZE (64 * 1024)
+
+// Under ASan every object is a block of its own, with redzones around it
+#ifdef __SANITIZE_ADDRESS__
+#define SANITIZED true
+#else
+#define SANITIZED false
+#endif
+
+typedef struct Block Block;
+struct Block {
+	Block *prev;
+	Block *next;
+	size_t size;
+	MemPool pool;
+};
+
+// Keeps the memory after the header aligned like malloc()'s
+_Static_assert(sizeof(Block) % 16 == 0, "misaligned block header");
+
+char *pool_names[] = {
+	[MEM_DRIVER] = "driver",
+	[MEM_TOKENIZE] = "tokenizer",
+	[MEM_PARSE] = "parser",
+	[MEM_TYPE] = "types",
+	[MEM_OPT] = "optimizer",
+	[MEM_IR] = "ir",
+	[MEM_CODEGEN] = "codegen",
+	[MEM_INTERP] = "interp",
+};
+
+typedef struct {
+	long live;
+	long peak;
+	long total;
+	long allocs;
+} MemStats;
+
+MemStats mem_stats[MEM_NPOOLS];
+MemStats mem_all;
+
+Block mem_blocks = {&mem_blocks, &mem_blocks};
+
+// Free space in the current chunk of each pool
+char *chunk_ptr[MEM_NPOOLS];
+long chunk_left[MEM_NPOOLS];
+
+// Counts `size` bytes allocated, or freed if it is negative
+void add_stats(MemStats *s, long size) {
+	s->live += size;
+	if (size > 0) {
+		s->total += size;
+		s->allocs++;
+	}
+	if (s->live > s->peak)
+		s->peak = s->live;
+}
+
+void count_bytes(MemPool pool, long size) {
+	add_stats(&mem_stats[pool], size);
+	add_stats(&mem_all, size);
+}
+
+void *link_block(Block *b, MemPool pool, size_t size) {
+	if (!b)
+		error("out of memory");
+	b->size = size;
+	b->pool = pool;
+	b->prev = &mem_blocks;
+	b->next = mem_blocks.next;
+	mem_blocks.next->prev = b;
+	mem_blocks.next = b;
+	return b + 1;
+}
+
+void unlink_block(Block *b) {
+	b->prev->next = b->next;
+	b->next->prev = b->prev;
+}
+
+// Returns `size` bytes of zeroed memory owned by `pool`, which live
+// until the teardown
+void *mem_alloc(MemPool pool, size_t size) {
+	count_bytes(pool, size);
+	if (size > CHUNK_SIZE / 4 || SANITIZED)
+		return link_block(calloc(1, sizeof(Block) + size), pool, size);
+
+	// Objects are cleared as they are carved out, since a server worker
+	// gets its chunks back from free() and would clear them in full
+	size = align_to(size, 8);
+	if (size > chunk_left[pool]) {
+		chunk_ptr[pool] = link_block(malloc(sizeof(Block) + CHUNK_SIZE), pool, 0);
+		chunk_left[pool] = CHUNK_SIZE;
+	}
+	void *p = chunk_ptr[pool];
+	chunk_ptr[pool] += size;
+	chunk_left[pool] -= size;
+	return memset(p, 0, size);
+}
+
+// Resizes a block, or allocates one if `p` is NULL. Bytes added to the
+// block are zeroed. Only memory from this function may be resized or
+// freed.
+void *mem_realloc(MemPool pool, void *p, size_t size) {
+	size_t old = 0;
+	if (p) {
+		Block *b = (Block *)p - 1;
+		old = b->size;
+		pool = b->pool;
+		unlink_block(b);
+		p = realloc(b, sizeof(Block) + size);
+	} else {
+		p = malloc(sizeof(Block) + size);
+	}
+	count_bytes(pool, (long)size - (long)old);
+
+	char *mem = link_block(p, pool, size);
+	if (size > old)
+		memset(mem + old, 0, size - old);
+	return mem;
+}
+
+char *mem_strndup(MemPool pool, char *s, size_t n) {
+	size_t len = strnlen(s, n);
+	char *p = mem_alloc(pool, len + 1);
+	memcpy(p, s, len);
+	return p;
+}
+
+char *mem_strdup(MemPool pool, char *s) {
+	return mem_strndup(pool, s, strlen(s));
+}
+
+void mem_free(void *p) {
+	if (!p)
+		return;
+	Block *b = (Block *)p - 1;
+	count_bytes(b->pool, -(long)b->size);
+	unlink_block(b);
+	free(b);
+}
+
+// Frees every chunk and block
+void mem_teardown() {
+	while (mem_blocks.next != &mem_blocks) {
+		Block *b = mem_blocks.next;
+		unlink_block(b);
+		free(b);
+	}
+	for (int i = 0; i < MEM_NPOOLS; i++) {
+		chunk_ptr[i] = NULL;
+		chunk_left[i] = 0;
+	}
+}
+
+// Prints the bytes that each subsystem allocated in total and had at
+// most at once, and those still live
+void print_mem_report() {
+	fprintf(stderr, "%-10s %12s %12s %12s %10s\n", "subsystem", "total", "peak", "live",
+			"allocs");
+	for (int i = 0; i < MEM_NPOOLS; i++) {
+		MemStats *s = &mem_stats[i];
+		fprintf(stderr, "%-10s %12ld %12ld %12ld %10ld\n", pool_names[i], s->total,
+				s->peak, s->live, s->allocs);
+	}
+	fprintf(stderr, "%-10s %12ld %12ld %12ld %10ld\n", "all", mem_all.total, mem_all.peak,
+			mem_all.live, mem_all.allocs);
+}
+
+// Called when a run ends normally. Builds with AddressSanitizer always
+// tear down, so that LeakSanitizer checks that every allocation is
+// owned and ASan that none is freed twice.
+void mem_exit() {
+	if (mem_report)
+		print_mem_report();
+	if (mem_report || SANITIZED)
+		mem_teardown();
+}
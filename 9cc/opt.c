@@ -0,0 +1,602 @@
+#include "9cc.h"
+
+// IR pass manager and optimization passes.
+//
+// Passes run in order on each function. With -fdump-ir, the IR of
+// every function is printed to stderr after lowering and after each
+// pass.
+//
+// The passes between "ssa" and "leave-ssa" rely on every virtual
+// register having a single definition that dominates its uses.
+
+// Returns the final destination of a chain of blocks consisting of
+// just an unconditional jump
+BB *jump_target(BB *bb) {
+	// Bound the number of steps in case of an empty infinite loop
+	for (int i = 0; i < 8 && bb->ir->op == IR_JMP; i++)
+		bb = bb->ir->bb1;
+	return bb;
+}
+
+// Redirects jumps to jump-only blocks to their final destination
+void thread_jumps(Function *fn) {
+	for (BB *bb = fn->bb; bb; bb = bb->next) {
+		IR *ir = last_inst(bb);
+		if (ir->op == IR_JMP || ir->op == IR_BR)
+			ir->bb1 = jump_target(ir->bb1);
+		if (ir->op == IR_BR)
+			ir->bb2 = jump_target(ir->bb2);
+	}
+}
+
+// Returns the defining instruction of each register
+IR **find_defs(Function *fn) {
+	IR **def = mem_alloc(MEM_IR, fn->nreg * sizeof(IR *));
+	for (BB *bb = fn->bb; bb; bb = bb->next)
+		for (IR *ir = bb->ir; ir; ir = ir->next)
+			if (ir->r0)
+				def[ir->r0->vn] = ir;
+	return def;
+}
+
+bool is_binary(IR *ir) {
+	switch (ir->op) {
+	case IR_ADD:
+	case IR_SUB:
+	case IR_MUL:
+	case IR_DIV:
+	case IR_EQ:
+	case IR_NE:
+	case IR_LT:
+	case IR_LE:
+		return true;
+	}
+	return false;
+}
+
+bool is_commutative(IROp op) {
+	return op == IR_ADD || op == IR_MUL || op == IR_EQ || op == IR_NE;
+}
+
+// Evaluates a binary operator on constants the way the generated code
+// would. Returns false if it would trap.
+bool fold(IROp op, long l, long r, long *val) {
+	switch (op) {
+	case IR_ADD:
+		*val = (unsigned long)l + r;
+		return true;
+	case IR_SUB:
+		*val = (unsigned long)l - r;
+		return true;
+	case IR_MUL:
+		*val = (unsigned long)l * r;
+		return true;
+	case IR_DIV:
+		if (r == 0 || (r == -1 && l == (long)(1UL << 63)))
+			return false;
+		*val = l / r;
+		return true;
+	case IR_EQ:
+		*val = l == r;
+		return true;
+	case IR_NE:
+		*val = l != r;
+		return true;
+	case IR_LT:
+		*val = l < r;
+		return true;
+	case IR_LE:
+		*val = l <= r;
+		return true;
+	}
+	return false;
+}
+
+void to_mov(IR *ir, Reg *r) {
+	ir->op = IR_MOV;
+	ir->r1 = r;
+	ir->r2 = NULL;
+}
+
+void to_imm(IR *ir, long val) {
+	ir->op = IR_IMM;
+	ir->r1 = NULL;
+	ir->r2 = NULL;
+	ir->imm = val;
+}
+
+// Simplifies an instruction whose operands may be constants.
+// Returns true if it has changed.
+bool simplify(BB *bb, IR *ir, IR **def) {
+	IR *d1 = ir->r1 ? def[ir->r1->vn] : NULL;
+	IR *d2 = ir->r2 ? def[ir->r2->vn] : NULL;
+	bool c1 = d1 && d1->op == IR_IMM;
+	bool c2 = d2 && d2->op == IR_IMM;
+
+	if (is_binary(ir)) {
+		if (c1 && !c2 && ir->r2 && is_commutative(ir->op)) {
+			Reg *tmp = ir->r1;
+			ir->r1 = ir->r2;
+			ir->r2 = tmp;
+			return true;
+		}
+
+		if (c2 && d2->imm == (int)d2->imm && (ir->op != IR_DIV || d2->imm != 0)) {
+			ir->imm = d2->imm;
+			ir->r2 = NULL;
+			return true;
+		}
+
+		if (ir->r2)
+			return false;
+
+		long val;
+		if (c1 && fold(ir->op, d1->imm, ir->imm, &val)) {
+			to_imm(ir, val);
+			return true;
+		}
+
+		// Algebraic identities
+		if (((ir->op == IR_ADD || ir->op == IR_SUB) && ir->imm == 0) ||
+			((ir->op == IR_MUL || ir->op == IR_DIV) && ir->imm == 1)) {
+			to_mov(ir, ir->r1);
+			return true;
+		}
+		if (ir->op == IR_MUL && ir->imm == 0) {
+			to_imm(ir, 0);
+			return true;
+		}
+		return false;
+	}
+
+	switch (ir->op) {
+	case IR_CAST:
+		if (c1) {
+			to_imm(ir, ir->size == 4 ? (int)d1->imm : (signed char)d1->imm);
+			return true;
+		}
+		return false;
+	case IR_PHI: {
+		// A phi whose arguments are all the same register is a copy
+		Reg *same = NULL;
+		for (int i = 0; i < ir->nargs; i++) {
+			if (ir->args[i] == ir->r0 || ir->args[i] == same)
+				continue;
+			if (same)
+				return false;
+			same = ir->args[i];
+		}
+		if (!same)
+			return false;
+		ir->nargs = 0;
+		to_mov(ir, same);
+		return true;
+	}
+	case IR_BR:
+		if (c1) {
+			BB *taken = d1->imm ? ir->bb1 : ir->bb2;
+			BB *other = d1->imm ? ir->bb2 : ir->bb1;
+			if (other != taken)
+				remove_phi_edge(other, bb);
+			ir->op = IR_JMP;
+			ir->r1 = NULL;
+			ir->bb1 = taken;
+			return true;
+		}
+		return false;
+	}
+	return false;
+}
+
+// Copy and constant propagation. Uses of copies are replaced with
+// their sources, and instructions with constant operands are folded,
+// including branches on constant conditions.
+void propagate(Function *fn) {
+	IR **def = find_defs(fn);
+
+	for (bool changed = true; changed;) {
+		changed = false;
+
+		for (BB *bb = fn->bb; bb; bb = bb->next) {
+			for (IR *ir = bb->ir; ir; ir = ir->next) {
+				Reg **r;
+				for (int i = 0; (r = use_at(ir, i)); i++) {
+					while (*r && def[(*r)->vn] && def[(*r)->vn]->op == IR_MOV &&
+						   def[(*r)->vn]->r1 != *r) {
+						*r = def[(*r)->vn]->r1;
+						changed = true;
+					}
+				}
+
+				if (simplify(bb, ir, def))
+					changed = true;
+			}
+		}
+	}
+
+	compute_cfg(fn);
+}
+
+//
+// Common subexpression elimination
+//
+
+// Returns true if two instructions compute the same value
+bool same_value(IR *a, IR *b) {
+	return a->op == b->op && a->r1 == b->r1 && a->r2 == b->r2 &&
+		   a->imm == b->imm && a->size == b->size && a->var == b->var;
+}
+
+bool is_cse_candidate(IR *ir) {
+	switch (ir->op) {
+	case IR_IMM:
+	case IR_LVAR:
+	case IR_GVAR:
+	case IR_CAST:
+		return true;
+	}
+	return is_binary(ir);
+}
+
+#define CSE_BUCKETS 1024
+
+IR **cse_table[CSE_BUCKETS];
+int cse_len[CSE_BUCKETS];
+int cse_cap[CSE_BUCKETS];
+BB ***cse_children;
+int *cse_nchildren;
+
+// Buckets of the values pushed by the blocks being walked, so that
+// they can be popped on the way back up the dominator tree
+unsigned *cse_undo;
+int cse_undo_len;
+int cse_undo_cap;
+
+unsigned cse_hash(IR *ir) {
+	unsigned long h = ir->op;
+	h = h * 31 + (ir->r1 ? ir->r1->vn : -1);
+	h = h * 31 + (ir->r2 ? ir->r2->vn : -1);
+	h = h * 31 + ir->imm;
+	h = h * 31 + (unsigned long)ir->var;
+	return h % CSE_BUCKETS;
+}
+
+void cse_push(unsigned h, IR *ir) {
+	if (cse_len[h] == cse_cap[h]) {
+		cse_cap[h] = cse_cap[h] ? cse_cap[h] * 2 : 8;
+		cse_table[h] = mem_realloc(MEM_IR, cse_table[h], cse_cap[h] * sizeof(IR *));
+	}
+	cse_table[h][cse_len[h]++] = ir;
+
+	if (cse_undo_len == cse_undo_cap) {
+		cse_undo_cap = cse_undo_cap ? cse_undo_cap * 2 : 256;
+		cse_undo = mem_realloc(MEM_IR, cse_undo, cse_undo_cap * sizeof(unsigned));
+	}
+	cse_undo[cse_undo_len++] = h;
+}
+
+// Walks the dominator tree. A value computed in a block is available
+// in all blocks it dominates.
+void cse_bb(BB *bb) {
+	int undo = cse_undo_len;
+
+	// Loads from the same address within a block, with no store or
+	// call in between, read the same value.
+	IR **loads = NULL;
+	int nloads = 0;
+	int loads_cap = 0;
+
+	for (IR *ir = bb->ir; ir; ir = ir->next) {
+		if (!is_pure(ir)) {
+			nloads = 0;
+			continue;
+		}
+
+		if (ir->op == IR_LOAD) {
+			IR *found = NULL;
+			for (int i = 0; i < nloads; i++)
+				if (loads[i]->r1 == ir->r1 && loads[i]->size == ir->size)
+					found = loads[i];
+			if (found) {
+				to_mov(ir, found->r0);
+				continue;
+			}
+			if (nloads == loads_cap) {
+				loads_cap = loads_cap ? loads_cap * 2 : 8;
+				loads = mem_realloc(MEM_IR, loads, loads_cap * sizeof(IR *));
+			}
+			loads[nloads++] = ir;
+			continue;
+		}
+
+		if (!is_cse_candidate(ir))
+			continue;
+
+		unsigned h = cse_hash(ir);
+		IR *found = NULL;
+		for (int i = 0; i < cse_len[h]; i++)
+			if (same_value(cse_table[h][i], ir))
+				found = cse_table[h][i];
+
+		if (found) {
+			to_mov(ir, found->r0);
+			continue;
+		}
+
+		cse_push(h, ir);
+	}
+	mem_free(loads);
+
+	for (int i = 0; i < cse_nchildren[bb->rpo]; i++)
+		cse_bb(cse_children[bb->rpo][i]);
+
+	while (cse_undo_len > undo)
+		cse_len[cse_undo[--cse_undo_len]]--;
+}
+
+void cse(Function *fn) {
+	compute_cfg(fn);
+
+	int nbb = 0;
+	for (BB *bb = fn->bb; bb; bb = bb->next)
+		nbb++;
+
+	cse_children = mem_alloc(MEM_IR, nbb * sizeof(BB **));
+	cse_nchildren = mem_alloc(MEM_IR, nbb * sizeof(int));
+	for (BB *bb = fn->bb; bb; bb = bb->next)
+		if (bb != fn->bb)
+			cse_nchildren[bb->idom->rpo]++;
+	for (int i = 0; i < nbb; i++) {
+		cse_children[i] = mem_alloc(MEM_IR, cse_nchildren[i] * sizeof(BB *));
+		cse_nchildren[i] = 0;
+	}
+	for (BB *bb = fn->bb; bb; bb = bb->next)
+		if (bb != fn->bb)
+			cse_children[bb->idom->rpo][cse_nchildren[bb->idom->rpo]++] = bb;
+
+	cse_bb(fn->bb);
+}
+
+//
+// Loop-invariant code motion
+//
+
+// Returns true if the instruction can be executed even when the loop
+// it came from wouldn't have been
+bool is_speculatable(IR *ir) {
+	switch (ir->op) {
+	case IR_IMM:
+	case IR_MOV:
+	case IR_ADD:
+	case IR_SUB:
+	case IR_MUL:
+	case IR_EQ:
+	case IR_NE:
+	case IR_LT:
+	case IR_LE:
+	case IR_LVAR:
+	case IR_GVAR:
+	case IR_CAST:
+		return true;
+	case IR_DIV:
+		return !ir->r2 && ir->imm != 0 && ir->imm != -1;
+	}
+	return false;
+}
+
+BB **loop_blocks;
+int nloop_blocks;
+bool *in_loop; // Indexed by reverse postorder
+
+void add_to_loop(BB *bb) {
+	if (in_loop[bb->rpo])
+		return;
+	in_loop[bb->rpo] = true;
+	loop_blocks[nloop_blocks++] = bb;
+	for (int i = 0; i < bb->npred; i++)
+		add_to_loop(bb->pred[i]);
+}
+
+// Finds the blocks of the natural loop with the given header.
+// Returns false if `header` isn't a loop header.
+bool find_loop(BB *header, int nbb) {
+	in_loop = mem_alloc(MEM_IR, nbb * sizeof(bool));
+	loop_blocks = mem_alloc(MEM_IR, nbb * sizeof(BB *));
+	nloop_blocks = 0;
+
+	in_loop[header->rpo] = true;
+	loop_blocks[nloop_blocks++] = header;
+
+	bool found = false;
+	for (int i = 0; i < header->npred; i++) {
+		if (dominates(header, header->pred[i])) {
+			add_to_loop(header->pred[i]);
+			found = true;
+		}
+	}
+	return found;
+}
+
+// Returns the only predecessor of a loop header outside the loop
+BB *outside_pred(BB *header) {
+	BB *pred = NULL;
+	for (int i = 0; i < header->npred; i++) {
+		if (in_loop[header->pred[i]->rpo])
+			continue;
+		if (pred)
+			return NULL;
+		pred = header->pred[i];
+	}
+	return pred;
+}
+
+// Inserts a block on the edge from `from` to `to`
+BB *split_loop_edge(BB *from, BB *to) {
+	BB *bb = new_bb();
+	IR *jmp = new_ir(IR_JMP);
+	jmp->bb1 = to;
+	bb->ir = jmp;
+
+	IR *ir = last_inst(from);
+	if (ir->bb1 == to)
+		ir->bb1 = bb;
+	if (ir->op == IR_BR && ir->bb2 == to)
+		ir->bb2 = bb;
+
+	for (IR *phi = to->ir; phi && phi->op == IR_PHI; phi = phi->next)
+		for (int i = 0; i < phi->nargs; i++)
+			if (phi->bbs[i] == from)
+				phi->bbs[i] = bb;
+
+	bb->next = from->next;
+	from->next = bb;
+	return bb;
+}
+
+int count_bbs(Function *fn) {
+	int n = 0;
+	for (BB *bb = fn->bb; bb; bb = bb->next)
+		n++;
+	return n;
+}
+
+// Hoists computations whose operands don't change in a loop to the
+// loop's preheader, the block that enters the loop.
+void licm(Function *fn) {
+	compute_cfg(fn);
+
+	// Give each loop a preheader whose only successor is the header
+	int nbb = count_bbs(fn);
+	for (BB *bb = fn->bb; bb; bb = bb->next) {
+		if (!find_loop(bb, nbb))
+			continue;
+		BB *pred = outside_pred(bb);
+		BB *succ[2];
+		if (pred && get_succs(pred, succ) > 1)
+			split_loop_edge(pred, bb);
+	}
+	compute_cfg(fn);
+	nbb = count_bbs(fn);
+
+	BB **order = mem_alloc(MEM_IR, nbb * sizeof(BB *));
+	for (BB *bb = fn->bb; bb; bb = bb->next)
+		order[bb->rpo] = bb;
+
+	// Process inner loops first. Their headers come later in
+	// reverse postorder than the headers of enclosing loops.
+	for (int i = nbb - 1; i >= 0; i--) {
+		BB *header = order[i];
+		if (!find_loop(header, nbb))
+			continue;
+
+		BB *pre = outside_pred(header);
+		BB *succ[2];
+		if (!pre || get_succs(pre, succ) > 1)
+			continue;
+
+		bool *def_in_loop = mem_alloc(MEM_IR, fn->nreg * sizeof(bool));
+		bool has_store = false;
+		for (int j = 0; j < nloop_blocks; j++) {
+			for (IR *ir = loop_blocks[j]->ir; ir; ir = ir->next) {
+				if (ir->r0)
+					def_in_loop[ir->r0->vn] = true;
+				if (!is_pure(ir) && ir->op != IR_JMP && ir->op != IR_BR)
+					has_store = true;
+			}
+		}
+
+		// Loads can move out only from the header, which runs whenever
+		// the preheader does, and only if nothing in the loop writes memory.
+		for (bool changed = true; changed;) {
+			changed = false;
+
+			for (int j = 0; j < nloop_blocks; j++) {
+				BB *bb = loop_blocks[j];
+				for (IR **p = &bb->ir; *p;) {
+					IR *ir = *p;
+					bool ok = is_speculatable(ir) ||
+							  (ir->op == IR_LOAD && bb == header && !has_store);
+
+					Reg **r;
+					for (int k = 0; ok && (r = use_at(ir, k)); k++)
+						if (*r && def_in_loop[(*r)->vn])
+							ok = false;
+
+					if (!ok) {
+						p = &ir->next;
+						continue;
+					}
+
+					*p = ir->next;
+					insert_before_terminator(pre, ir);
+					def_in_loop[ir->r0->vn] = false;
+					changed = true;
+				}
+			}
+		}
+	}
+}
+
+// Removes instructions whose results are never used
+void dead_code(Function *fn) {
+	int *uses = mem_alloc(MEM_IR, fn->nreg * sizeof(int));
+
+	for (bool changed = true; changed;) {
+		changed = false;
+		memset(uses, 0, fn->nreg * sizeof(int));
+
+		for (BB *bb = fn->bb; bb; bb = bb->next) {
+			for (IR *ir = bb->ir; ir; ir = ir->next) {
+				Reg **r;
+				for (int i = 0; (r = use_at(ir, i)); i++)
+					if (*r)
+						uses[(*r)->vn]++;
+			}
+		}
+
+		for (BB *bb = fn->bb; bb; bb = bb->next) {
+			for (IR **p = &bb->ir; *p;) {
+				IR *ir = *p;
+				if (is_pure(ir) && ir->r0 && !uses[ir->r0->vn]) {
+					*p = ir->next;
+					changed = true;
+				} else {
+					p = &ir->next;
+				}
+			}
+		}
+	}
+}
+
+typedef struct {
+	char *name;
+	void (*run)(Function *fn);
+} Pass;
+
+Pass passes[] = {
+	{"thread-jumps", thread_jumps},
+	{"remove-unreachable", remove_unreachable},
+	{"ssa", build_ssa},
+	{"propagate", propagate},
+	{"cse", cse},
+	{"licm", licm},
+	{"propagate", propagate},
+	{"dead-code", dead_code},
+	{"leave-ssa", leave_ssa},
+	{"thread-jumps", thread_jumps},
+	{"remove-unreachable", remove_unreachable},
+};
+
+void run_passes(Program *prog, bool dump) {
+	for (Function *fn = prog->fns; fn; fn = fn->next) {
+		ir_fn = fn;
+		if (dump)
+			dump_ir(fn, "lower");
+
+		for (int i = 0; i < sizeof(passes) / sizeof(*passes); i++) {
+			passes[i].run(fn);
+			if (dump)
+				dump_ir(fn, passes[i].name);
+		}
+	}
+}
@@ -2,11 +2,18 @@
 
 VarList *locals;
 VarList *globals;
+VarList *literals;
+VarList *scope; // Local variables visible in the current block
+
+// Blocks are numbered in the order they are opened. A block's own
+// number and those of the blocks nested in it form an interval.
+int nscope;
+int cur_scope;
 
 // Find a local or global variable by name
 Var *find_var(Token *tok) {
 	// Local
-	for (VarList *vl = locals; vl; vl = vl->next) {
+	for (VarList *vl = scope; vl; vl = vl->next) {
 		Var *var = vl->var;
 		if (strlen(var->name) == tok->len && !memcmp(tok->str, var->name, tok->len))
 			return var;
@@ -23,7 +30,7 @@ Var *find_var(Token *tok) {
 }
 
 Node *new_node(NodeKind kind, Token *tok) {
-	Node *node = calloc(1, sizeof(Node));
+	Node *node = mem_alloc(MEM_PARSE, sizeof(Node));
 	node->kind = kind;
 	node->tok = tok;
 	return node;
@@ -42,7 +49,7 @@ Node *new_unary(NodeKind kind, Node *expr, Token *tok) {
 	return node;
 }
 
-Node *new_num(int val, Token *tok) {
+Node *new_num(long val, Token *tok) {
 	Node *node = new_node(ND_NUM, tok);
 	node->val = val;
 	return node;
@@ -55,17 +62,23 @@ Node *new_var(Var *var, Token *tok) {
 }
 
 Var *push_var(char *name, Type *ty, bool is_local) {
-	Var *var = calloc(1, sizeof(Var));
+	Var *var = mem_alloc(MEM_PARSE, sizeof(Var));
 	var->name = name;
 	var->ty = ty;
 	var->is_local = is_local;
 
-	VarList *vl = calloc(1, sizeof(VarList));
+	VarList *vl = mem_alloc(MEM_PARSE, sizeof(VarList));
 	vl->var = var;
 
 	if (is_local) {
 		vl->next = locals;
 		locals = vl;
+
+		VarList *sc = mem_alloc(MEM_PARSE, sizeof(VarList));
+		sc->var = var;
+		sc->next = scope;
+		scope = sc;
+		var->scope_begin = cur_scope;
 	} else {
 		vl->next = globals;
 		globals = vl;
@@ -74,11 +87,46 @@ Var *push_var(char *name, Type *ty, bool is_local) {
 	return var;
 }
 
+// String literals are named after their function, so that the
+// output for a function doesn't depend on the functions before it
+char *fn_name;
+int nliteral;
+
 char *new_label() {
-	static int cnt = 0;
-	char buf[20];
-	sprintf(buf, ".L.data.%d", cnt++);
-	return strndup(buf, 20);
+	int len = snprintf(NULL, 0, ".L.data.%s.%d", fn_name, nliteral);
+	char *buf = mem_alloc(MEM_PARSE, len + 1);
+	sprintf(buf, ".L.data.%s.%d", fn_name, nliteral++);
+	return buf;
+}
+
+// Adds a string literal to the current function
+Var *push_literal(Token *tok) {
+	Var *var = mem_alloc(MEM_PARSE, sizeof(Var));
+	var->name = new_label();
+	var->ty = array_of(char_type(), tok->cont_len);
+	var->contents = tok->contents;
+	var->cont_len = tok->cont_len;
+
+	VarList *vl = mem_alloc(MEM_PARSE, sizeof(VarList));
+	vl->var = var;
+	vl->next = literals;
+	literals = vl;
+	return var;
+}
+
+// Opens a block. Returns the number of the enclosing block.
+int enter_scope() {
+	int parent = cur_scope;
+	cur_scope = nscope++;
+	return parent;
+}
+
+// Closes a block, hiding the variables declared in it
+void leave_scope(VarList *sc, int parent) {
+	for (VarList *vl = scope; vl != sc; vl = vl->next)
+		vl->var->scope_end = nscope - 1;
+	scope = sc;
+	cur_scope = parent;
 }
 
 Function *function();
@@ -120,18 +168,20 @@ Program *program() {
 		}
 	}
 
-	Program *prog = calloc(1, sizeof(Program));
+	Program *prog = mem_alloc(MEM_PARSE, sizeof(Program));
 	prog->globals = globals;
 	prog->fns = head.next;
 	return prog;
 }
 
-// basetype = ("char" | "int") "*"*
+// basetype = ("char" | "int" | "long") "*"*
 Type *basetype() {
 	Type *ty;
 
 	if (consume("char")) {
 		ty = char_type();
+	} else if (consume("long")) {
+		ty = long_type();
 	} else {
 		expect("int");
 		ty = int_type();
@@ -157,7 +207,7 @@ VarList *read_func_param() {
 	char *name = expect_ident();
 	ty = read_type_suffix(ty);
 
-	VarList *vl = calloc(1, sizeof(VarList));
+	VarList *vl = mem_alloc(MEM_PARSE, sizeof(VarList));
 	vl->var = push_var(name, ty, true);
 	return vl;
 }
@@ -183,10 +233,15 @@ VarList *read_func_params() {
 // param    = basetype ident
 Function *function() {
 	locals = NULL;
+	literals = NULL;
+	scope = NULL;
+	int parent = enter_scope();
 
-	Function *fn = calloc(1, sizeof(Function));
-	basetype();
+	Function *fn = mem_alloc(MEM_PARSE, sizeof(Function));
+	fn->ty = basetype();
 	fn->name = expect_ident();
+	fn_name = fn->name;
+	nliteral = 0;
 	expect("(");
 	fn->params = read_func_params();
 	expect("{");
@@ -200,8 +255,11 @@ Function *function() {
 		cur = cur->next;
 	}
 
+	leave_scope(NULL, parent);
+
 	fn->node = head.next;
 	fn->locals = locals;
+	fn->literals = literals;
 	return fn;
 }
 
@@ -239,7 +297,7 @@ Node *read_expr_stmt() {
 }
 
 bool is_typename() {
-	return peek("char") || peek("int");
+	return peek("char") || peek("int") || peek("long");
 }
 
 // stmt = "return" expr ";"
@@ -301,10 +359,13 @@ Node *stmt() {
 		head.next = NULL;
 		Node *cur = &head;
 
+		VarList *sc = scope;
+		int parent = enter_scope();
 		while (!consume("}")) {
 			cur->next = stmt();
 			cur = cur->next;
 		}
+		leave_scope(sc, parent);
 
 		Node *node = new_node(ND_BLOCK, tok);
 		node->body = head.next;
@@ -431,6 +492,9 @@ Node *postfix() {
 //
 // Statement expression is a GNU C extension
 Node *stmt_expr(Token *tok) {
+	VarList *sc = scope;
+	int parent = enter_scope();
+
 	Node *node = new_node(ND_STMT_EXPR, tok);
 	node->body = stmt();
 	Node *cur = node->body;
@@ -440,6 +504,7 @@ Node *stmt_expr(Token *tok) {
 		cur = cur->next;
 	}
 	expect(")");
+	leave_scope(sc, parent);
 
 	if (cur->kind != ND_EXPR_STMT)
 		error_tok(cur->tok, "stmt expr returning void is not supported");
@@ -472,7 +537,7 @@ Node *func_args() {
 Node *primary() {
 	Token *tok;
 
-	if (consume("(")) {
+	if (tok = consume("(")) {
 		if (consume("{"))
 			return stmt_expr(tok);
 
@@ -487,7 +552,7 @@ Node *primary() {
 	if (tok = consume_ident()) {
 		if (consume("(")) {
 			Node *node = new_node(ND_FUNCALL, tok);
-			node->funcname = strndup(tok->str, tok->len);
+			node->funcname = mem_strndup(MEM_PARSE, tok->str, tok->len);
 			node->args = func_args();
 			return node;
 		}
@@ -502,11 +567,7 @@ Node *primary() {
 	if (tok->kind == TK_STR) {
 		token = token->next;
 
-		Type *ty = array_of(char_type(), tok->cont_len);
-		Var *var = push_var(new_label(), ty, false);
-		var->contents = tok->contents;
-		var->cont_len = tok->cont_len;
-		return new_var(var, tok);
+		return new_var(push_literal(tok), tok);
 	}
 
 	if (tok->kind != TK_NUM)
@@ -0,0 +1,174 @@
+#include "9cc.h"
+
+// Profile-guided optimization.
+//
+// With -fprofile-generate, each function gets a table of counters:
+// counter 0 counts calls, and each "if", "while" and "for" statement
+// has two, for the branches of an "if" and for entering the body and
+// leaving a loop. The table is emitted next to the function together
+// with a constructor that registers it with runtime/profile.c, which
+// adds the counts to a profile file at exit.
+//
+// With -fprofile-use, the counts are read back and attached to the
+// same statements, which are numbered the same way. They decide which
+// branch of an "if" falls through, how much callees are inlined and
+// which virtual registers are spilled.
+
+char *profile_path = "9cc.prof"; // -fprofile-use=PATH
+
+// Counts read by load_profile()
+typedef struct Profile Profile;
+struct Profile {
+	Profile *next;
+	char *name;
+	long n;
+	long *counts;
+};
+
+Profile *profiles;
+long max_entry_count;
+
+int ncounters;
+
+void number_statements(Function *fn, Node *node) {
+	if (!node)
+		return;
+
+	if (node->kind == ND_IF || node->kind == ND_WHILE || node->kind == ND_FOR) {
+		node->prof_fn = fn->name;
+		node->prof_id = ncounters;
+		ncounters += 2;
+	}
+
+	number_statements(fn, node->lhs);
+	number_statements(fn, node->rhs);
+	number_statements(fn, node->cond);
+	number_statements(fn, node->then);
+	number_statements(fn, node->els);
+	number_statements(fn, node->init);
+	number_statements(fn, node->inc);
+	for (Node *n = node->body; n; n = n->next)
+		number_statements(fn, n);
+	for (Node *n = node->args; n; n = n->next)
+		number_statements(fn, n);
+}
+
+// Numbers the counters of the statements of each function. This must
+// run before the AST is optimized, so that the numbering depends only
+// on the source.
+void assign_counters(Program *prog) {
+	for (Function *fn = prog->fns; fn; fn = fn->next) {
+		ncounters = 1;
+		for (Node *node = fn->node; node; node = node->next)
+			number_statements(fn, node);
+		fn->ncounters = ncounters;
+	}
+}
+
+// Emits an increment of counter `idx` of function `fn`. The table
+// starts with a link, a name and a count of counters.
+void emit_counter(char *fn, int idx) {
+	printf("	inc qword ptr [rip + .L.prof.%s+%d]\n", fn, 24 + idx * 8);
+}
+
+// Emits the counter table of a function and a constructor
+// registering it with the runtime
+void emit_profile_table(Function *fn) {
+	printf(".data\n");
+	printf(".align 8\n");
+	printf(".L.prof.%s:\n", fn->name);
+	printf("	.quad 0\n");
+	printf("	.quad .L.prof.name.%s\n", fn->name);
+	printf("	.quad %d\n", fn->ncounters);
+	printf("	.zero %d\n", fn->ncounters * 8);
+	printf(".L.prof.name.%s:\n", fn->name);
+	printf("	.string \"%s\"\n", fn->name);
+
+	printf(".section .init_array,\"aw\"\n");
+	printf(".align 8\n");
+	printf("	.quad .L.prof.init.%s\n", fn->name);
+
+	printf(".text\n");
+	printf(".L.prof.init.%s:\n", fn->name);
+	printf("	lea rdi, [rip + .L.prof.%s]\n", fn->name);
+	printf("	jmp __9cc_profile_register\n");
+}
+
+// Reads the profile written by runtime/profile.c. Each line has a
+// function name, the number of its counters and their values.
+void load_profile() {
+	FILE *fp = fopen(profile_path, "r");
+	if (!fp)
+		error("cannot open %s: %s", profile_path, strerror(errno));
+
+	char name[256];
+	long n;
+	while (fscanf(fp, "%255s %ld", name, &n) == 2) {
+		if (n <= 0)
+			error("%s: broken profile", profile_path);
+		Profile *p = mem_alloc(MEM_DRIVER, sizeof(Profile));
+		p->name = mem_strdup(MEM_DRIVER, name);
+		p->n = n;
+		p->counts = mem_alloc(MEM_DRIVER, n * sizeof(long));
+		for (long i = 0; i < n; i++)
+			if (fscanf(fp, "%ld", &p->counts[i]) != 1)
+				error("%s: broken profile", profile_path);
+		if (p->counts[0] > max_entry_count)
+			max_entry_count = p->counts[0];
+		p->next = profiles;
+		profiles = p;
+	}
+	fclose(fp);
+}
+
+Profile *find_profile(char *name) {
+	for (Profile *p = profiles; p; p = p->next)
+		if (!strcmp(p->name, name))
+			return p;
+	return NULL;
+}
+
+long get_count(char *fn, int idx) {
+	Profile *p = fn ? find_profile(fn) : NULL;
+	if (!p || idx >= p->n)
+		return -1;
+	return p->counts[idx];
+}
+
+// Returns how many times the given counter of a statement was hit,
+// or -1 if it's unknown
+long stmt_count(Node *node, int k) {
+	return get_count(node->prof_fn, node->prof_id + k);
+}
+
+// Returns how many times a function was called, or -1 if it's unknown
+long entry_count(char *name) {
+	return get_count(name, 0);
+}
+
+// Returns true if a function is called at least 1/16 as often as the
+// most frequently called one
+bool is_hot(char *name) {
+	long n = entry_count(name);
+	return n > 0 && n * 16 >= max_entry_count;
+}
+
+// Returns true if the profile shows that a function is never called
+bool is_cold(char *name) {
+	return entry_count(name) == 0;
+}
+
+// Hash of the profile, which the output depends on
+unsigned long profile_hash(unsigned long h) {
+	if (!profile_use)
+		return h;
+	FILE *fp = fopen(profile_path, "r");
+	if (!fp)
+		return h;
+	char buf[4096];
+	long n;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+		h = hash_bytes(h, buf, n);
+	fclose(fp);
+	return h;
+}
@@ -0,0 +1,122 @@
+#include "9cc.h"
+
+// Linear scan register allocator (Poletto and Sarkar).
+//
+// Live intervals are visited in order of their start positions. An
+// interval gets a free register if there is one. Otherwise, of the
+// intervals competing for a register, the one with the lowest spill
+// weight is moved to a stack slot below the local variables.
+//
+// RAX, RDX, RDI and R11 are never allocated; the code generator uses
+// them as scratch registers. An interval that is live across a call
+// may only get a callee-saved register.
+
+char *regs[] = {"rsi", "rcx", "r8", "r9", "r10", "rbx", "r12", "r13", "r14", "r15"};
+char *regs8[] = {"sil", "cl", "r8b", "r9b", "r10b", "bl", "r12b", "r13b", "r14b", "r15b"};
+char *regs32[] = {"esi", "ecx", "r8d", "r9d", "r10d", "ebx", "r12d", "r13d", "r14d", "r15d"};
+
+#define NUM_REGS 10
+#define FIRST_CALLEE_SAVED 5
+
+bool is_callee_saved(int rn) {
+	return rn >= FIRST_CALLEE_SAVED;
+}
+
+Interval *active[NUM_REGS];
+int nactive;
+
+int cmp_start(const void *a, const void *b) {
+	Interval *x = *(Interval **)a;
+	Interval *y = *(Interval **)b;
+	if (x->start != y->start)
+		return x->start - y->start;
+	return x->reg->vn - y->reg->vn;
+}
+
+void spill(Function *fn, Interval *iv) {
+	fn->spill_size += 8;
+	iv->reg->rn = -1;
+	iv->reg->spill = fn->stack_size + fn->spill_size;
+}
+
+// Removes intervals that have ended before `pos` from the active set
+void expire(int pos) {
+	int n = 0;
+	for (int i = 0; i < nactive; i++)
+		if (active[i]->end >= pos)
+			active[n++] = active[i];
+	nactive = n;
+}
+
+bool is_free(int rn) {
+	for (int i = 0; i < nactive; i++)
+		if (active[i]->reg->rn == rn)
+			return false;
+	return true;
+}
+
+void alloc_interval(Function *fn, Interval *iv) {
+	expire(iv->start);
+
+	// Caller-saved registers are cheaper since they don't need to be
+	// saved in the prologue.
+	int first = iv->crosses_call ? FIRST_CALLEE_SAVED : 0;
+	for (int rn = first; rn < NUM_REGS; rn++) {
+		if (is_free(rn)) {
+			iv->reg->rn = rn;
+			active[nactive++] = iv;
+			return;
+		}
+	}
+
+	// No register is free. Spill the cheapest of the intervals that
+	// hold a register `iv` could use.
+	Interval *victim = NULL;
+	int victim_idx = 0;
+	for (int i = 0; i < nactive; i++) {
+		if (active[i]->reg->rn < first)
+			continue;
+		if (!victim || active[i]->weight < victim->weight) {
+			victim = active[i];
+			victim_idx = i;
+		}
+	}
+
+	if (!victim || victim->weight <= iv->weight) {
+		spill(fn, iv);
+		return;
+	}
+
+	iv->reg->rn = victim->reg->rn;
+	active[victim_idx] = iv;
+	spill(fn, victim);
+}
+
+void alloc_regs_fn(Function *fn) {
+	Interval **intervals = compute_intervals(fn);
+
+	int n = 0;
+	Interval **sorted = mem_alloc(MEM_IR, fn->nreg * sizeof(Interval *));
+	for (int i = 0; i < fn->nreg; i++)
+		if (intervals[i])
+			sorted[n++] = intervals[i];
+	qsort(sorted, n, sizeof(Interval *), cmp_start);
+
+	nactive = 0;
+	fn->spill_size = 0;
+	for (int i = 0; i < n; i++)
+		alloc_interval(fn, sorted[i]);
+
+	// Find callee-saved registers the prologue needs to save
+	fn->callee_saved = 0;
+	for (int i = 0; i < n; i++) {
+		int rn = sorted[i]->reg->rn;
+		if (rn >= 0 && is_callee_saved(rn))
+			fn->callee_saved |= 1 << rn;
+	}
+}
+
+void alloc_regs(Program *prog) {
+	for (Function *fn = prog->fns; fn; fn = fn->next)
+		alloc_regs_fn(fn);
+}
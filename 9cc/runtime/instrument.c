@@ -0,0 +1,129 @@
+// Runtime of -finstrument-functions. Link it with programs compiled by
+// 9cc with that flag.
+//
+// The hooks measure each call with rdtsc, and a flat profile sorted by
+// self time (the cycles spent in a function minus those spent in its
+// callees) is printed to stderr at exit. The names of the functions
+// come from the __9cc_fnames section that 9cc emits.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+	void *fn;
+	char *name;
+} FnName;
+
+extern FnName __start___9cc_fnames[] __attribute__((weak));
+extern FnName __stop___9cc_fnames[] __attribute__((weak));
+
+typedef struct {
+	void *fn;
+	long calls;
+	long active; // Number of its calls on the stack
+	unsigned long self;
+	unsigned long total; // Including callees, outermost calls only
+} Stat;
+
+#define MAX_FNS 4096
+#define MAX_DEPTH 4096
+
+Stat stats[MAX_FNS];
+int nstats;
+
+typedef struct {
+	Stat *stat;
+	unsigned long start;
+	unsigned long children; // Cycles spent in callees
+} Frame;
+
+Frame stack[MAX_DEPTH];
+int depth;
+int lost; // Calls deeper than MAX_DEPTH
+
+static unsigned long rdtsc() {
+	return __builtin_ia32_rdtsc();
+}
+
+static Stat *get_stat(void *fn) {
+	for (int i = 0; i < nstats; i++)
+		if (stats[i].fn == fn)
+			return &stats[i];
+	if (nstats == MAX_FNS)
+		return NULL;
+	stats[nstats].fn = fn;
+	return &stats[nstats++];
+}
+
+static char *fn_name(void *fn) {
+	for (FnName *p = __start___9cc_fnames; p < __stop___9cc_fnames; p++)
+		if (p->fn == fn)
+			return p->name;
+	return NULL;
+}
+
+static int by_self(const void *a, const void *b) {
+	const Stat *x = a;
+	const Stat *y = b;
+	return (x->self < y->self) - (x->self > y->self);
+}
+
+static void report() {
+	qsort(stats, nstats, sizeof(Stat), by_self);
+
+	unsigned long sum = 0;
+	for (int i = 0; i < nstats; i++)
+		sum += stats[i].self;
+
+	fprintf(stderr, "  %%self     self cycles    total cycles       calls  function\n");
+	for (int i = 0; i < nstats; i++) {
+		Stat *s = &stats[i];
+		char *name = fn_name(s->fn);
+		fprintf(stderr, "%7.2f %15lu %15lu %11ld  ", sum ? 100.0 * s->self / sum : 0.0,
+				s->self, s->total, s->calls);
+		if (name)
+			fprintf(stderr, "%s\n", name);
+		else
+			fprintf(stderr, "%p\n", s->fn);
+	}
+}
+
+void __cyg_profile_func_enter(void *fn, void *call_site) {
+	static int registered;
+	if (!registered) {
+		registered = 1;
+		atexit(report);
+	}
+
+	if (depth == MAX_DEPTH) {
+		lost++;
+		return;
+	}
+	Stat *s = get_stat(fn);
+	if (s) {
+		s->calls++;
+		s->active++;
+	}
+	stack[depth++] = (Frame){s, rdtsc(), 0};
+}
+
+void __cyg_profile_func_exit(void *fn, void *call_site) {
+	unsigned long now = rdtsc();
+	if (lost) {
+		lost--;
+		return;
+	}
+	if (depth == 0)
+		return;
+
+	Frame *f = &stack[--depth];
+	unsigned long elapsed = now - f->start;
+	if (f->stat) {
+		f->stat->self += elapsed - f->children;
+		if (--f->stat->active == 0)
+			f->stat->total += elapsed;
+	}
+	if (depth > 0)
+		stack[depth - 1].children += elapsed;
+}
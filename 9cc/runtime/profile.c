@@ -0,0 +1,94 @@
+// Runtime of -fprofile-generate. Link it with programs compiled by
+// 9cc with that flag.
+//
+// Each instrumented function registers its counter table from a
+// constructor. At exit, the counts are added to the profile in
+// $NINECC_PROFILE, or 9cc.prof by default, so that several runs
+// accumulate. A table whose function has a different number of
+// counters in the old profile replaces it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Laid out by emit_profile_table() in profile.c
+typedef struct Table Table;
+struct Table {
+	Table *next;
+	char *name;
+	long n;
+	long counts[];
+};
+
+Table *tables;
+
+Table *find_table(char *name) {
+	for (Table *t = tables; t; t = t->next)
+		if (!strcmp(t->name, name))
+			return t;
+	return NULL;
+}
+
+char *profile_path() {
+	char *path = getenv("NINECC_PROFILE");
+	return path ? path : "9cc.prof";
+}
+
+// Adds the counts of the old profile to the tables. Functions that
+// aren't in this program are copied to `keep`.
+void merge(FILE *keep) {
+	FILE *fp = fopen(profile_path(), "r");
+	if (!fp)
+		return;
+
+	char name[256];
+	long n;
+	while (fscanf(fp, "%255s %ld", name, &n) == 2 && n > 0) {
+		Table *t = find_table(name);
+		if (t && t->n != n)
+			t = NULL;
+		if (!t)
+			fprintf(keep, "%s %ld", name, n);
+
+		for (long i = 0; i < n; i++) {
+			long c;
+			if (fscanf(fp, "%ld", &c) != 1)
+				break;
+			if (t)
+				t->counts[i] += c;
+			else
+				fprintf(keep, " %ld", c);
+		}
+		if (!t)
+			fprintf(keep, "\n");
+	}
+	fclose(fp);
+}
+
+void dump() {
+	char *path = profile_path();
+	char *tmp = malloc(strlen(path) + 5);
+	sprintf(tmp, "%s.tmp", path);
+
+	FILE *fp = fopen(tmp, "w");
+	if (!fp) {
+		perror(tmp);
+		return;
+	}
+	merge(fp);
+	for (Table *t = tables; t; t = t->next) {
+		fprintf(fp, "%s %ld", t->name, t->n);
+		for (long i = 0; i < t->n; i++)
+			fprintf(fp, " %ld", t->counts[i]);
+		fprintf(fp, "\n");
+	}
+	if (fclose(fp) || rename(tmp, path))
+		perror(path);
+}
+
+void __9cc_profile_register(Table *t) {
+	if (!tables)
+		atexit(dump);
+	t->next = tables;
+	tables = t;
+}
@@ -0,0 +1,231 @@
+#include "9cc.h"
+
+// Vectorized scanning for the tokenizer.
+//
+// Each scanner advances over a run of bytes of one class: whitespace,
+// identifier characters, the body of a line comment, a block comment
+// or a string literal. With SSE2 or AVX2, 16 or 32 bytes are
+// classified at once into a bit mask of the positions where the run
+// stops, and the first set bit is the end of the run. The instruction
+// set is picked at run time, and $NINECC_SCAN (scalar, sse2 or avx2)
+// overrides the choice. Vector loads are only done while a full vector
+// and one more byte lie before the end of the input; the rest is
+// scanned a byte at a time.
+
+char *input_end;
+
+// Bit i is set if the run stops at p[i]
+typedef unsigned (*StopMask)(char *p);
+
+typedef struct {
+	char *name;
+	int width;
+	StopMask space;
+	StopMask ident;
+	StopMask newline;
+	StopMask comment_end;
+	StopMask str_end;
+} Scanner;
+
+Scanner scalar_scanner = {"scalar"};
+Scanner *scanner;
+
+#ifdef __x86_64__
+#include <immintrin.h>
+
+unsigned sse2_space(char *p) {
+	__m128i b = _mm_loadu_si128((__m128i *)p);
+	__m128i ws = _mm_or_si128(
+		_mm_cmpeq_epi8(b, _mm_set1_epi8(' ')),
+		_mm_and_si128(_mm_cmpgt_epi8(b, _mm_set1_epi8('\t' - 1)),
+					  _mm_cmplt_epi8(b, _mm_set1_epi8('\r' + 1))));
+	return ~_mm_movemask_epi8(ws) & 0xffff;
+}
+
+unsigned sse2_ident(char *p) {
+	__m128i b = _mm_loadu_si128((__m128i *)p);
+	__m128i lower = _mm_or_si128(b, _mm_set1_epi8(0x20));
+	__m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+								  _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+	__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(b, _mm_set1_epi8('0' - 1)),
+								  _mm_cmplt_epi8(b, _mm_set1_epi8('9' + 1)));
+	__m128i under = _mm_cmpeq_epi8(b, _mm_set1_epi8('_'));
+	return ~_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(alpha, digit), under)) & 0xffff;
+}
+
+unsigned sse2_newline(char *p) {
+	__m128i b = _mm_loadu_si128((__m128i *)p);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(b, _mm_set1_epi8('\n')));
+}
+
+unsigned sse2_comment_end(char *p) {
+	__m128i b = _mm_loadu_si128((__m128i *)p);
+	__m128i c = _mm_loadu_si128((__m128i *)(p + 1));
+	return _mm_movemask_epi8(_mm_or_si128(
+		_mm_and_si128(_mm_cmpeq_epi8(b, _mm_set1_epi8('*')),
+					  _mm_cmpeq_epi8(c, _mm_set1_epi8('/'))),
+		_mm_cmpeq_epi8(b, _mm_setzero_si128())));
+}
+
+unsigned sse2_str_end(char *p) {
+	__m128i b = _mm_loadu_si128((__m128i *)p);
+	return _mm_movemask_epi8(_mm_or_si128(
+		_mm_or_si128(_mm_cmpeq_epi8(b, _mm_set1_epi8('"')),
+					 _mm_cmpeq_epi8(b, _mm_set1_epi8('\\'))),
+		_mm_cmpeq_epi8(b, _mm_setzero_si128())));
+}
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 unsigned avx2_space(char *p) {
+	__m256i b = _mm256_loadu_si256((__m256i *)p);
+	__m256i ws = _mm256_or_si256(
+		_mm256_cmpeq_epi8(b, _mm256_set1_epi8(' ')),
+		_mm256_and_si256(_mm256_cmpgt_epi8(b, _mm256_set1_epi8('\t' - 1)),
+						 _mm256_cmpgt_epi8(_mm256_set1_epi8('\r' + 1), b)));
+	return ~_mm256_movemask_epi8(ws);
+}
+
+AVX2 unsigned avx2_ident(char *p) {
+	__m256i b = _mm256_loadu_si256((__m256i *)p);
+	__m256i lower = _mm256_or_si256(b, _mm256_set1_epi8(0x20));
+	__m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+									 _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower));
+	__m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(b, _mm256_set1_epi8('0' - 1)),
+									 _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), b));
+	__m256i under = _mm256_cmpeq_epi8(b, _mm256_set1_epi8('_'));
+	return ~_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(alpha, digit), under));
+}
+
+AVX2 unsigned avx2_newline(char *p) {
+	__m256i b = _mm256_loadu_si256((__m256i *)p);
+	return _mm256_movemask_epi8(_mm256_cmpeq_epi8(b, _mm256_set1_epi8('\n')));
+}
+
+AVX2 unsigned avx2_comment_end(char *p) {
+	__m256i b = _mm256_loadu_si256((__m256i *)p);
+	__m256i c = _mm256_loadu_si256((__m256i *)(p + 1));
+	return _mm256_movemask_epi8(_mm256_or_si256(
+		_mm256_and_si256(_mm256_cmpeq_epi8(b, _mm256_set1_epi8('*')),
+						 _mm256_cmpeq_epi8(c, _mm256_set1_epi8('/'))),
+		_mm256_cmpeq_epi8(b, _mm256_setzero_si256())));
+}
+
+AVX2 unsigned avx2_str_end(char *p) {
+	__m256i b = _mm256_loadu_si256((__m256i *)p);
+	return _mm256_movemask_epi8(_mm256_or_si256(
+		_mm256_or_si256(_mm256_cmpeq_epi8(b, _mm256_set1_epi8('"')),
+						_mm256_cmpeq_epi8(b, _mm256_set1_epi8('\\'))),
+		_mm256_cmpeq_epi8(b, _mm256_setzero_si256())));
+}
+
+Scanner sse2_scanner = {"sse2", 16, sse2_space, sse2_ident, sse2_newline,
+						sse2_comment_end, sse2_str_end};
+Scanner avx2_scanner = {"avx2", 32, avx2_space, avx2_ident, avx2_newline,
+						avx2_comment_end, avx2_str_end};
+#endif
+
+void init_scanner() {
+	if (scanner)
+		return;
+
+	scanner = &scalar_scanner;
+#ifdef __x86_64__
+	__builtin_cpu_init();
+	scanner = __builtin_cpu_supports("avx2") ? &avx2_scanner : &sse2_scanner;
+#endif
+
+	char *name = getenv("NINECC_SCAN");
+	if (!name)
+		return;
+	if (!strcmp(name, "scalar"))
+		scanner = &scalar_scanner;
+#ifdef __x86_64__
+	else if (!strcmp(name, "sse2"))
+		scanner = &sse2_scanner;
+	else if (!strcmp(name, "avx2") && __builtin_cpu_supports("avx2"))
+		scanner = &avx2_scanner;
+#endif
+	else
+		error("NINECC_SCAN: unknown or unsupported scanner: %s", name);
+}
+
+// Advances `p` a vector at a time until `stop` finds a stopping byte
+// or there isn't a full vector left
+char *scan(char *p, StopMask stop) {
+	if (!stop)
+		return p;
+	int width = scanner->width;
+	while (p + width < input_end) {
+		unsigned mask = stop(p);
+		if (mask)
+			return p + __builtin_ctz(mask);
+		p += width;
+	}
+	return p;
+}
+
+// Returns the first non-whitespace byte at or after `p`
+char *skip_space(char *p) {
+	if (!isspace(*p))
+		return p;
+	p = scan(p, scanner->space);
+	while (isspace(*p))
+		p++;
+	return p;
+}
+
+// Returns the first byte at or after `p` that can't be in an identifier
+char *skip_ident(char *p) {
+	p = scan(p, scanner->ident);
+	while (is_alnum(*p))
+		p++;
+	return p;
+}
+
+// Returns the first newline at or after `p`
+char *find_newline(char *p) {
+	p = scan(p, scanner->newline);
+	while (*p != '\n')
+		p++;
+	return p;
+}
+
+// Returns the first "*/" at or after `p`, or the end of the input
+char *find_comment_end(char *p) {
+	p = scan(p, scanner->comment_end);
+	while (*p && !startswith(p, "*/"))
+		p++;
+	return p;
+}
+
+// Returns the first '"', '\\' or the end of the input at or after `p`
+char *find_str_end(char *p) {
+	p = scan(p, scanner->str_end);
+	while (*p && *p != '"' && *p != '\\')
+		p++;
+	return p;
+}
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Tokenizes the input repeatedly for at least a second and prints
+// the throughput of the tokenizer (--bench-tokenize)
+void bench_tokenize() {
+	init_scanner();
+	long size = strlen(user_input);
+	int n = 0;
+	double start = now();
+	double elapsed;
+	do {
+		tokenize();
+		n++;
+		elapsed = now() - start;
+	} while (elapsed < 1);
+
+	printf("%s: %.0f MB/s\n", scanner->name, size * n / elapsed / 1e6);
+}
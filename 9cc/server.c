@@ -0,0 +1,481 @@
+#include "9cc.h"
+
+// Compile server.
+//
+// `9cc --server` listens on a Unix domain socket. A client, which is
+// any `9cc --use-server file.c` run that finds the socket, sends its
+// arguments and the input bytes, and the server replies with the exit
+// status and what the compilation wrote to stdout and stderr.
+//
+// Clients are opt-in since bench/server.sh still measures the server
+// as slower than running the compiler directly on a single CPU: a
+// client starts up like any other 9cc run, and for small files the
+// round trip to a worker costs more than compiling warm saves.
+//
+// Requests are handled by worker processes forked from the server
+// ahead of time, so a request pays neither for exec nor for fork. A
+// worker compiles a sample program before it takes requests, and then
+// serves one request after another. The compiler keeps its state in
+// globals and reports errors by exit(), so after each request the
+// worker frees what mem.c handed out and copies back the globals it
+// saved before the first one. A request that ends in error() ends the
+// worker: the response is sent at exit with exit status 1, and the
+// server forks a replacement.
+//
+// Request:  compiler id, argc, argv[0..argc-1], cwd, environment, input
+// Response: exit status, stdout, stderr
+//
+// The worker changes to the client's cwd and takes the environment
+// variables that affect compilation from the client, so that relative
+// paths and settings mean the same as without the server. The
+// variables are sent as a count followed by name and value pairs.
+//
+// Strings are sent as a length followed by the bytes. A server built
+// from a different binary answers STALE_SERVER to the compiler id, and
+// the client then compiles by itself.
+//
+// The socket is in $XDG_RUNTIME_DIR, or else in /tmp/9cc-<uid>, and
+// that directory must belong to us and be closed to everyone else.
+// Both ends also check that the other one runs as the same user
+// before they send anything, so no one else can see the sources or
+// answer with assembly of their own.
+
+#define STALE_SERVER -1
+#define NUM_WORKERS 4
+
+// Environment variables that affect compilation
+char *forwarded_env[] = {"HOME", "NINECC_CACHE_DIR", "NINECC_SCAN", NULL};
+
+char *socket_path; // --socket=PATH
+char *socket_dir;  // Directory of the default socket
+
+char *get_socket_path() {
+	if (!socket_path)
+		socket_path = getenv("NINECC_SOCKET");
+	if (!socket_path) {
+		static char dir[64];
+		static char buf[PATH_MAX];
+		socket_dir = getenv("XDG_RUNTIME_DIR");
+		if (!socket_dir || !*socket_dir) {
+			snprintf(dir, sizeof(dir), "/tmp/9cc-%d", (int)getuid());
+			socket_dir = dir;
+		}
+		snprintf(buf, sizeof(buf), "%s/9cc.sock", socket_dir);
+		socket_path = buf;
+	}
+	return socket_path;
+}
+
+// Returns true if `dir` is a directory of ours that no one else can
+// look into or create files in
+bool is_private_dir(char *dir) {
+	struct stat st;
+	return !lstat(dir, &st) && S_ISDIR(st.st_mode) && st.st_uid == getuid() &&
+		   !(st.st_mode & 077);
+}
+
+// Returns true if the process at the other end of `fd` runs as us
+bool is_own_peer(int fd) {
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	return !getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) && cred.uid == getuid();
+}
+
+bool write_all(int fd, void *buf, long len) {
+	char *p = buf;
+	while (len > 0) {
+		long n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n <= 0) {
+			if (n == -1 && errno == EINTR)
+				continue;
+			return false;
+		}
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+bool read_all(int fd, void *buf, long len) {
+	char *p = buf;
+	while (len > 0) {
+		long n = read(fd, p, len);
+		if (n <= 0) {
+			if (n == -1 && errno == EINTR)
+				continue;
+			return false;
+		}
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+// A message is built up in a buffer and sent with a single write, so
+// that the other end wakes up once for it rather than once per field
+char *msg;
+long msg_len;
+long msg_cap;
+
+// Makes room for `len` more bytes of the message and returns them
+char *grow_msg(long len) {
+	if (msg_len + len > msg_cap) {
+		while (msg_len + len > msg_cap)
+			msg_cap = msg_cap ? msg_cap * 2 : 4096;
+		msg = mem_realloc(MEM_DRIVER, msg, msg_cap);
+	}
+	char *p = msg + msg_len;
+	msg_len += len;
+	return p;
+}
+
+void put(void *src, long len) {
+	memcpy(grow_msg(len), src, len);
+}
+
+void put_str(char *s, long len) {
+	put(&len, sizeof(len));
+	put(s, len);
+}
+
+bool send_msg(int fd) {
+	bool ok = write_all(fd, msg, msg_len);
+	msg_len = 0;
+	return ok;
+}
+
+// Copies a string to `out` as it arrives. The string is binary with
+// --emit-ast.
+bool copy_str(int fd, FILE *out) {
+	long len;
+	if (!read_all(fd, &len, sizeof(len)) || len < 0)
+		return false;
+
+	char buf[65536];
+	while (len > 0) {
+		long n = read(fd, buf, len < sizeof(buf) ? len : sizeof(buf));
+		if (n <= 0) {
+			if (n == -1 && errno == EINTR)
+				continue;
+			return false;
+		}
+		fwrite(buf, 1, n, out);
+		len -= n;
+	}
+	return true;
+}
+
+// Reads a string and terminates it with '\0'
+char *read_str(int fd) {
+	long len;
+	if (!read_all(fd, &len, sizeof(len)) || len < 0)
+		return NULL;
+	char *s = mem_alloc(MEM_DRIVER, len + 1);
+	if (!read_all(fd, s, len))
+		return NULL;
+	s[len] = '\0';
+	return s;
+}
+
+// Adds the contents of a file to the message. Bytes that cannot be
+// read are left zero.
+void put_file(int src) {
+	struct stat st;
+	long len = fstat(src, &st) ? 0 : st.st_size;
+	put(&len, sizeof(len));
+	pread(src, grow_msg(len), len, 0);
+}
+
+// A worker serves up to MAX_REQUESTS requests, which bounds what
+// compilations leave behind outside the globals, such as the atexit()
+// handlers of the cache. Under ASan the globals are surrounded by
+// redzones that must not be copied, so there a worker serves one.
+#ifdef __SANITIZE_ADDRESS__
+#define MAX_REQUESTS 1
+#else
+#define MAX_REQUESTS 1000
+#endif
+
+// The compiler's globals lie between these symbols of the linker
+extern char __data_start[], _end[];
+
+char *saved_globals;
+
+// Saves the globals so that reset_state() can undo what a compilation
+// did to them. The pools of mem.c are emptied first, so that the saved
+// lists stay valid, and the copy is allocated outside of them.
+void save_globals() {
+	mem_teardown();
+	long size = _end - __data_start;
+	if (!saved_globals)
+		saved_globals = malloc(size); // Before the copy, so that it survives resets
+	if (!saved_globals)
+		error("out of memory");
+	memcpy(saved_globals, __data_start, size);
+}
+
+// Frees everything the compiler allocated and puts its globals back as
+// they were at save_globals(). The freed chunks go back to malloc(),
+// which hands them out again to the next compilation.
+void reset_state() {
+	mem_teardown();
+	memcpy(__data_start, saved_globals, _end - __data_start);
+}
+
+// A sample program to warm up the server with
+char *warm_up_src =
+	"int g[8];\n"
+	"char *s;\n"
+	"long sum(long *p, int n) { long t = 0; int i; for (i = 0; i < n; i = i + 1) t = t + "
+	"p[i]; return t; }\n"
+	"int fib(int n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); }\n"
+	"int main() { long a[4]; int x = 3; int *p = &x; int i; s = \"9cc\"; while (*p < 100) "
+	"{ if (*p / 2 * 2 == *p) *p = *p + 1; else *p = *p * 3; } for (i = 0; i < 4; i = i + "
+	"1) a[i] = i * x; g[1] = sizeof(a) + s[0]; return sum(a, 4) + fib(x / 20) + g[1]; }\n";
+
+// Compiles the sample at -O0 and -O and throws the output away, so
+// that the first request finds the code, the libraries and the heap of
+// every stage already paged in. A worker does this itself before it
+// takes requests, since pages warmed up in the server would still be
+// copied on the first write after fork().
+void warm_up() {
+	fflush(stdout);
+	int out = dup(1);
+	int null = open("/dev/null", O_WRONLY);
+	dup2(null, 1);
+	close(null);
+
+	char *argv[] = {"9cc", "<warm-up>", NULL};
+	for (int level = 0; level <= 1; level++) {
+		opt_level = level;
+		use_cache = false;
+		filename = argv[1];
+		user_input = warm_up_src;
+		compile(2, argv);
+		fflush(stdout);
+		reset_state();
+	}
+
+	dup2(out, 1);
+	close(out);
+}
+
+int conn = -1;
+int conn_out; // Output of the request
+int conn_err;
+bool serving; // The request has been read, and exit() sends the response
+bool compiled;
+
+// Called after compile(), or at exit of a worker by error()
+void respond() {
+	if (!serving)
+		return;
+	fflush(stdout);
+	fflush(stderr);
+
+	int status = compiled ? 0 : 1;
+	put(&status, sizeof(status));
+	put_file(conn_out);
+	put_file(conn_err);
+	send_msg(conn);
+	serving = false;
+}
+
+void serve() {
+	unsigned long id;
+	int argc;
+	if (!read_all(conn, &id, sizeof(id)) || !read_all(conn, &argc, sizeof(argc)) ||
+		argc <= 0)
+		return;
+
+	int status = STALE_SERVER;
+	if (id != compiler_id()) {
+		put(&status, sizeof(status));
+		send_msg(conn);
+		return;
+	}
+
+	char **argv = mem_alloc(MEM_DRIVER, (argc + 1) * sizeof(char *));
+	for (int i = 0; i < argc; i++)
+		if (!(argv[i] = read_str(conn)))
+			return;
+	char *cwd = read_str(conn);
+	int nenv;
+	if (!cwd || !read_all(conn, &nenv, sizeof(nenv)))
+		return;
+	for (char **name = forwarded_env; *name; name++)
+		unsetenv(*name);
+	for (int i = 0; i < nenv; i++) {
+		char *name = read_str(conn);
+		char *val = read_str(conn);
+		if (!name || !val)
+			return;
+		for (char **p = forwarded_env; *p; p++)
+			if (!strcmp(*p, name))
+				setenv(name, val, 1);
+	}
+	char *input = read_str(conn);
+	if (!input)
+		return;
+
+	// From here on, the output goes to the client
+	dup2(conn_out, 1);
+	dup2(conn_err, 2);
+	serving = true;
+
+	if (chdir(cwd))
+		error("cannot change directory to %s: %s", cwd, strerror(errno));
+	parse_args(argc, argv);
+	user_input = input;
+	compile(argc, argv);
+	compiled = true;
+	respond();
+}
+
+// Handles requests one at a time. An idle worker exits along with the
+// server, which may have died before we got here. A request that ends
+// in error() ends the worker too, and the server replaces it.
+void worker(int fd, pid_t server) {
+	signal(SIGCHLD, SIG_DFL);
+	int out = dup(1);
+	int err = dup(2);
+	conn_out = memfd_create("9cc-out", 0);
+	conn_err = memfd_create("9cc-err", 0);
+	if (out == -1 || err == -1 || conn_out == -1 || conn_err == -1)
+		error("cannot set up a worker: %s", strerror(errno));
+	atexit(respond);
+
+	// Keep large buffers in the heap, where their pages stay mapped
+	// for the next request
+	mallopt(M_MMAP_THRESHOLD, 16 << 20);
+	mallopt(M_TRIM_THRESHOLD, 64 << 20);
+
+	compiler_id(); // Cached before the globals are saved, for every request
+	if (MAX_REQUESTS > 1) {
+		save_globals();
+		warm_up();
+	}
+
+	for (int n = 0; n < MAX_REQUESTS; n++) {
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		if (getppid() != server)
+			exit(0);
+		do {
+			conn = accept(fd, NULL, NULL);
+		} while (conn == -1 && errno == EINTR);
+		if (conn == -1)
+			error("accept: %s", strerror(errno));
+		prctl(PR_SET_PDEATHSIG, 0);
+		if (is_own_peer(conn))
+			serve();
+		close(conn);
+
+		// Get ready for the next request
+		fflush(stdout);
+		fflush(stderr);
+		dup2(out, 1);
+		dup2(err, 2);
+		ftruncate(conn_out, 0);
+		ftruncate(conn_err, 0);
+		lseek(conn_out, 0, SEEK_SET);
+		lseek(conn_err, 0, SEEK_SET);
+		if (n + 1 < MAX_REQUESTS)
+			reset_state();
+	}
+	exit(0);
+}
+
+void run_server() {
+	char *path = get_socket_path();
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	if (strlen(path) >= sizeof(addr.sun_path))
+		error("socket path too long: %s", path);
+	strcpy(addr.sun_path, path);
+
+	if (socket_dir) {
+		if (mkdir(socket_dir, 0700) && errno != EEXIST)
+			error("cannot create %s: %s", socket_dir, strerror(errno));
+		if (!is_private_dir(socket_dir))
+			error("%s must be a directory of ours that only we can access", socket_dir);
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+		error("socket: %s", strerror(errno));
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 128))
+		error("cannot listen on %s: %s", path, strerror(errno));
+
+	// Keep NUM_WORKERS processes waiting for requests, and replace
+	// each one that exits
+	pid_t server = getpid();
+	for (int i = 0; i < NUM_WORKERS; i++)
+		if (fork() == 0)
+			worker(fd, server);
+
+	for (;;) {
+		if (wait(NULL) == -1) {
+			if (errno == EINTR)
+				continue;
+			error("wait: %s", strerror(errno));
+		}
+		if (fork() == 0)
+			worker(fd, server);
+	}
+}
+
+// Sends a compile request to a running server. Returns false if
+// there is no server to handle it.
+bool request_compile(int argc, char **argv, int *status) {
+	char *path = get_socket_path();
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return false;
+	if (socket_dir && !is_private_dir(socket_dir))
+		return false;
+	strcpy(addr.sun_path, path);
+
+	char cwd[PATH_MAX];
+	if (!getcwd(cwd, sizeof(cwd)))
+		return false;
+	int nenv = 0;
+	for (char **name = forwarded_env; *name; name++)
+		if (getenv(*name))
+			nenv++;
+
+	// Build the request before connecting, so that the worker that
+	// takes the connection finds all of it there
+	unsigned long id = compiler_id();
+	put(&id, sizeof(id));
+	put(&argc, sizeof(argc));
+	for (int i = 0; i < argc; i++)
+		put_str(argv[i], strlen(argv[i]));
+	put_str(cwd, strlen(cwd));
+	put(&nenv, sizeof(nenv));
+	for (char **name = forwarded_env; *name; name++) {
+		char *val = getenv(*name);
+		if (val) {
+			put_str(*name, strlen(*name));
+			put_str(val, strlen(val));
+		}
+	}
+	put_str(user_input, strlen(user_input));
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		msg_len = 0;
+		return false;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) || !is_own_peer(fd) ||
+		!send_msg(fd) || !read_all(fd, status, sizeof(*status)) ||
+		*status == STALE_SERVER) {
+		msg_len = 0;
+		close(fd);
+		return false;
+	}
+
+	if (!copy_str(fd, stdout) || !copy_str(fd, stderr))
+		error("%s: compile server closed the connection", filename);
+	close(fd);
+	return true;
+}
@@ -0,0 +1,296 @@
+#include "9cc.h"
+
+// Binary snapshots of a typed program.
+//
+// --emit-ast writes the program right after add_type(), and --from-ast
+// loads it and continues with the optimizations and code generation.
+//
+// A snapshot is an image of the objects themselves (Types, Vars,
+// VarLists, Nodes, Tokens and Functions, plus the strings they point
+// to and the source text) in which each pointer holds the offset of
+// its target from the start of the file. A relocation table lists
+// every such pointer. Loading maps the file privately and adds the
+// address of the mapping to each of them, so nothing is copied or
+// allocated, and only the pages holding pointers are written to.
+//
+// Since the objects are stored in their in-memory layout, a snapshot
+// can only be loaded by the compiler binary that wrote it.
+
+#define MAGIC "9cc-ast\n"
+
+typedef struct {
+	char magic[8];
+	unsigned long compiler;
+	long size;
+	long prog;     // Offset of the Program
+	long input;    // Offset of the source text
+	long filename; // Offset of the source file name
+	long relocs;   // Offset of the relocation table
+	long nrelocs;
+} Header;
+
+// Output buffer
+char *buf;
+long buf_len;
+long buf_cap;
+
+long *relocs;
+long nrelocs;
+long relocs_cap;
+
+// Offsets of the objects already written, keyed by their address
+void **seen_keys;
+long *seen_vals;
+long seen_cap;
+long seen_len;
+
+long seen_hash(void *p) {
+	return ((unsigned long)p >> 3) * 0x9e3779b97f4a7c15 & (seen_cap - 1);
+}
+
+long seen_get(void *p) {
+	if (!seen_cap)
+		return 0;
+	for (long i = seen_hash(p);; i = (i + 1) & (seen_cap - 1)) {
+		if (seen_keys[i] == p)
+			return seen_vals[i];
+		if (!seen_keys[i])
+			return 0;
+	}
+}
+
+void seen_put(void *p, long off) {
+	if (seen_len * 2 >= seen_cap) {
+		void **keys = seen_keys;
+		long *vals = seen_vals;
+		long cap = seen_cap;
+
+		seen_cap = cap ? cap * 2 : 1024;
+		seen_keys = mem_realloc(MEM_DRIVER, NULL, seen_cap * sizeof(void *));
+		seen_vals = mem_realloc(MEM_DRIVER, NULL, seen_cap * sizeof(long));
+		seen_len = 0;
+		for (long i = 0; i < cap; i++)
+			if (keys[i])
+				seen_put(keys[i], vals[i]);
+		mem_free(keys);
+		mem_free(vals);
+	}
+
+	long i = seen_hash(p);
+	while (seen_keys[i])
+		i = (i + 1) & (seen_cap - 1);
+	seen_keys[i] = p;
+	seen_vals[i] = off;
+	seen_len++;
+}
+
+// Appends `size` bytes and returns their offset
+long append(void *src, long size, int align) {
+	long off = align_to(buf_len, align);
+	if (off + size > buf_cap) {
+		while (off + size > buf_cap)
+			buf_cap = buf_cap ? buf_cap * 2 : 65536;
+		buf = mem_realloc(MEM_DRIVER, buf, buf_cap);
+	}
+	memset(buf + buf_len, 0, off - buf_len);
+	memcpy(buf + off, src, size);
+	buf_len = off + size;
+	return off;
+}
+
+// Makes the pointer at `field` point to the object at offset `target`
+void set_ptr(long field, long target) {
+	*(long *)(buf + field) = target;
+	if (!target)
+		return;
+
+	if (nrelocs == relocs_cap) {
+		relocs_cap = relocs_cap ? relocs_cap * 2 : 1024;
+		relocs = mem_realloc(MEM_DRIVER, relocs, relocs_cap * sizeof(long));
+	}
+	relocs[nrelocs++] = field;
+}
+
+#define PTR(off, type, field, target) set_ptr((off) + offsetof(type, field), target)
+
+long input_off;
+long input_len;
+
+long save_bytes(char *p, long len) {
+	if (!p)
+		return 0;
+	long off = seen_get(p);
+	if (!off) {
+		off = append(p, len, 1);
+		seen_put(p, off);
+	}
+	return off;
+}
+
+// String literals may point into the input
+long save_contents(char *p, long cont_len) {
+	if (p >= user_input && p < user_input + input_len)
+		return input_off + (p - user_input);
+	return save_bytes(p, cont_len - 1);
+}
+
+long save_str(char *s) {
+	return s ? save_bytes(s, strlen(s) + 1) : 0;
+}
+
+long save_type(Type *ty) {
+	if (!ty)
+		return 0;
+	long off = seen_get(ty);
+	if (off)
+		return off;
+
+	off = append(ty, sizeof(Type), 8);
+	seen_put(ty, off);
+	PTR(off, Type, base, save_type(ty->base));
+	return off;
+}
+
+// Tokens are saved one at a time. Their text is in the saved input.
+long save_token(Token *tok) {
+	if (!tok)
+		return 0;
+	long off = seen_get(tok);
+	if (off)
+		return off;
+
+	off = append(tok, sizeof(Token), 8);
+	seen_put(tok, off);
+	PTR(off, Token, next, 0);
+	PTR(off, Token, str, input_off + (tok->str - user_input));
+	PTR(off, Token, contents, save_contents(tok->contents, tok->cont_len));
+	return off;
+}
+
+long save_var(Var *var) {
+	if (!var)
+		return 0;
+	long off = seen_get(var);
+	if (off)
+		return off;
+
+	off = append(var, sizeof(Var), 8);
+	seen_put(var, off);
+	PTR(off, Var, name, save_str(var->name));
+	PTR(off, Var, ty, save_type(var->ty));
+	PTR(off, Var, contents, save_contents(var->contents, var->cont_len));
+	return off;
+}
+
+long save_vars(VarList *vl) {
+	if (!vl)
+		return 0;
+	long off = append(vl, sizeof(VarList), 8);
+	PTR(off, VarList, var, save_var(vl->var));
+	PTR(off, VarList, next, save_vars(vl->next));
+	return off;
+}
+
+long save_node(Node *node) {
+	if (!node)
+		return 0;
+	long off = seen_get(node);
+	if (off)
+		return off;
+
+	off = append(node, sizeof(Node), 8);
+	seen_put(node, off);
+	PTR(off, Node, ty, save_type(node->ty));
+	PTR(off, Node, tok, save_token(node->tok));
+	PTR(off, Node, lhs, save_node(node->lhs));
+	PTR(off, Node, rhs, save_node(node->rhs));
+	PTR(off, Node, cond, save_node(node->cond));
+	PTR(off, Node, then, save_node(node->then));
+	PTR(off, Node, els, save_node(node->els));
+	PTR(off, Node, init, save_node(node->init));
+	PTR(off, Node, inc, save_node(node->inc));
+	PTR(off, Node, body, save_node(node->body));
+	PTR(off, Node, funcname, save_str(node->funcname));
+	PTR(off, Node, args, save_node(node->args));
+	PTR(off, Node, var, save_var(node->var));
+	PTR(off, Node, next, save_node(node->next));
+	PTR(off, Node, prof_fn, save_str(node->prof_fn));
+	return off;
+}
+
+long save_function(Function *fn) {
+	if (!fn)
+		return 0;
+	long off = append(fn, sizeof(Function), 8);
+	PTR(off, Function, name, save_str(fn->name));
+	PTR(off, Function, ty, save_type(fn->ty));
+	PTR(off, Function, params, save_vars(fn->params));
+	PTR(off, Function, node, save_node(fn->node));
+	PTR(off, Function, locals, save_vars(fn->locals));
+	PTR(off, Function, literals, save_vars(fn->literals));
+	PTR(off, Function, bb, 0);
+	PTR(off, Function, next, save_function(fn->next));
+	return off;
+}
+
+// Writes a snapshot of `prog` to stdout
+void save_ast(Program *prog) {
+	Header hdr = {};
+	append(&hdr, sizeof(hdr), 8);
+
+	input_off = save_str(user_input);
+	input_len = strlen(user_input);
+	long filename_off = save_str(filename);
+	long prog_off = append(prog, sizeof(Program), 8);
+	PTR(prog_off, Program, globals, save_vars(prog->globals));
+	PTR(prog_off, Program, fns, save_function(prog->fns));
+
+	long relocs_off = append(relocs, nrelocs * sizeof(long), 8);
+
+	Header *h = (Header *)buf;
+	memcpy(h->magic, MAGIC, 8);
+	h->compiler = compiler_id();
+	h->size = buf_len;
+	h->prog = prog_off;
+	h->input = input_off;
+	h->filename = filename_off;
+	h->relocs = relocs_off;
+	h->nrelocs = nrelocs;
+
+	fwrite(buf, 1, buf_len, stdout);
+}
+
+// Maps a snapshot written by save_ast() and returns its program
+Program *load_ast(char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		error("cannot open %s: %s", path, strerror(errno));
+	struct stat st;
+	if (fstat(fd, &st))
+		error("cannot stat %s: %s", path, strerror(errno));
+	if (st.st_size < sizeof(Header))
+		error("%s: not an AST snapshot", path);
+
+	char *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED)
+		error("cannot map %s: %s", path, strerror(errno));
+	close(fd);
+
+	Header *h = (Header *)base;
+	if (memcmp(h->magic, MAGIC, 8) || h->size != st.st_size ||
+		h->relocs + h->nrelocs * (long)sizeof(long) > h->size)
+		error("%s: not an AST snapshot", path);
+	if (h->compiler != compiler_id())
+		error("%s: written by a different build of 9cc", path);
+
+	long *rel = (long *)(base + h->relocs);
+	for (long i = 0; i < h->nrelocs; i++) {
+		if (rel[i] < sizeof(Header) || rel[i] > h->size - sizeof(long))
+			error("%s: broken AST snapshot", path);
+		*(long *)(base + rel[i]) += (long)base;
+	}
+
+	user_input = base + h->input;
+	filename = base + h->filename;
+	return (Program *)(base + h->prog);
+}
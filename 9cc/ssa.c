@@ -0,0 +1,537 @@
+#include "9cc.h"
+
+// Control flow graph analysis and SSA construction.
+//
+// build_ssa() promotes local variables to virtual registers, inserting
+// phi functions at the iterated dominance frontiers of the blocks that
+// assign them (Cytron et al.). Dominators are computed with the
+// iterative algorithm of Cooper, Harvey and Kennedy. leave_ssa()
+// replaces phi functions with copies in their predecessor blocks.
+
+// Returns the last instruction of a basic block
+IR *last_inst(BB *bb) {
+	IR *ir = bb->ir;
+	while (ir && ir->next)
+		ir = ir->next;
+	return ir;
+}
+
+// Stores the successors of `bb` to `succ` and returns their number
+int get_succs(BB *bb, BB **succ) {
+	IR *ir = last_inst(bb);
+	if (ir->op == IR_JMP) {
+		succ[0] = ir->bb1;
+		return 1;
+	}
+	if (ir->op == IR_BR) {
+		succ[0] = ir->bb1;
+		if (ir->bb1 == ir->bb2)
+			return 1;
+		succ[1] = ir->bb2;
+		return 2;
+	}
+	return 0;
+}
+
+BB **postorder;
+int npostorder;
+
+void dfs(BB *bb) {
+	if (bb->reachable)
+		return;
+	bb->reachable = true;
+
+	BB *succ[2];
+	int n = get_succs(bb, succ);
+	for (int i = 0; i < n; i++)
+		dfs(succ[i]);
+	postorder[npostorder++] = bb;
+}
+
+// Removes basic blocks that can't be reached from the entry,
+// such as code after return statements.
+void remove_unreachable(Function *fn) {
+	int n = 0;
+	for (BB *bb = fn->bb; bb; bb = bb->next) {
+		bb->reachable = false;
+		n++;
+	}
+
+	postorder = mem_alloc(MEM_IR, n * sizeof(BB *));
+	npostorder = 0;
+	dfs(fn->bb);
+
+	BB **p = &fn->bb;
+	while (*p) {
+		if ((*p)->reachable)
+			p = &(*p)->next;
+		else
+			*p = (*p)->next;
+	}
+}
+
+// Removes phi arguments for edges that no longer exist
+void prune_phis(BB *bb) {
+	for (IR *ir = bb->ir; ir && ir->op == IR_PHI; ir = ir->next) {
+		int n = 0;
+		for (int i = 0; i < ir->nargs; i++) {
+			for (int j = 0; j < bb->npred; j++) {
+				if (ir->bbs[i] == bb->pred[j]) {
+					ir->args[n] = ir->args[i];
+					ir->bbs[n++] = ir->bbs[i];
+					break;
+				}
+			}
+		}
+		ir->nargs = n;
+	}
+}
+
+BB *intersect(BB *a, BB *b) {
+	while (a != b) {
+		while (a->rpo > b->rpo)
+			a = a->idom;
+		while (b->rpo > a->rpo)
+			b = b->idom;
+	}
+	return a;
+}
+
+// Computes predecessors, reverse postorder numbers and immediate
+// dominators of all basic blocks after removing unreachable ones.
+void compute_cfg(Function *fn) {
+	remove_unreachable(fn);
+
+	for (int i = 0; i < npostorder; i++) {
+		BB *bb = postorder[npostorder - i - 1];
+		bb->rpo = i;
+		bb->npred = 0;
+		bb->idom = NULL;
+	}
+
+	BB *succ[2];
+	for (BB *bb = fn->bb; bb; bb = bb->next) {
+		int n = get_succs(bb, succ);
+		for (int i = 0; i < n; i++)
+			succ[i]->npred++;
+	}
+	for (BB *bb = fn->bb; bb; bb = bb->next) {
+		bb->pred = mem_alloc(MEM_IR, bb->npred * sizeof(BB *));
+		bb->npred = 0;
+	}
+	for (BB *bb = fn->bb; bb; bb = bb->next) {
+		int n = get_succs(bb, succ);
+		for (int i = 0; i < n; i++)
+			succ[i]->pred[succ[i]->npred++] = bb;
+	}
+
+	for (BB *bb = fn->bb; bb; bb = bb->next)
+		prune_phis(bb);
+
+	// The entry block is never a jump target, so it has no predecessors
+	fn->bb->idom = fn->bb;
+
+	for (bool changed = true; changed;) {
+		changed = false;
+		for (int i = npostorder - 2; i >= 0; i--) {
+			BB *bb = postorder[i];
+			BB *idom = NULL;
+			for (int j = 0; j < bb->npred; j++) {
+				BB *p = bb->pred[j];
+				if (p->idom)
+					idom = idom ? intersect(p, idom) : p;
+			}
+			if (bb->idom != idom) {
+				bb->idom = idom;
+				changed = true;
+			}
+		}
+	}
+}
+
+// Returns true if `a` dominates `b`
+bool dominates(BB *a, BB *b) {
+	for (;;) {
+		if (a == b)
+			return true;
+		if (b->idom == b)
+			return false;
+		b = b->idom;
+	}
+}
+
+// Returns the i-th register slot read by `ir`, or NULL if there are
+// no more. A returned slot may contain NULL.
+Reg **use_at(IR *ir, int i) {
+	if (i == 0)
+		return &ir->r1;
+	if (i == 1)
+		return &ir->r2;
+	if (i - 2 < ir->nargs)
+		return &ir->args[i - 2];
+	return NULL;
+}
+
+// Returns true if the instruction has no effect other than setting r0
+bool is_pure(IR *ir) {
+	switch (ir->op) {
+	case IR_STORE:
+	case IR_VFILL:
+	case IR_VCOPY:
+	case IR_CALL:
+	case IR_RET:
+	case IR_JMP:
+	case IR_BR:
+	case IR_COUNT:
+		return false;
+	}
+	return true;
+}
+
+void insert_before_terminator(BB *bb, IR *ir) {
+	IR **p = &bb->ir;
+	while ((*p)->next)
+		p = &(*p)->next;
+	ir->next = *p;
+	*p = ir;
+}
+
+// Removes the phi arguments coming from `pred`
+void remove_phi_edge(BB *bb, BB *pred) {
+	for (IR *ir = bb->ir; ir && ir->op == IR_PHI; ir = ir->next) {
+		int n = 0;
+		for (int i = 0; i < ir->nargs; i++) {
+			if (ir->bbs[i] != pred) {
+				ir->args[n] = ir->args[i];
+				ir->bbs[n++] = ir->bbs[i];
+			}
+		}
+		ir->nargs = n;
+	}
+}
+
+//
+// Promotion of local variables
+//
+
+Var **promoted; // Promoted variables
+int npromoted;
+int *var_of;    // Promoted variable index of each IR_LVAR result, or -1
+int nvar_of;
+BB ***children; // Dominator tree, indexed by reverse postorder
+int *nchildren;
+
+// Returns the promoted variable index of an address register, or -1
+int promoted_var(Reg *r) {
+	return (r && r->vn < nvar_of) ? var_of[r->vn] : -1;
+}
+
+// Returns true if `var` is a parameter of `fn`
+bool is_param(Function *fn, Var *var) {
+	for (VarList *vl = fn->params; vl; vl = vl->next)
+		if (vl->var == var)
+			return true;
+	return false;
+}
+
+// A local variable can live in a register if it's a scalar and all
+// uses of its address are loads and stores of its full size.
+// If `params_only`, other locals stay in memory.
+void find_promotable(Function *fn, bool params_only) {
+	int nvars = 0;
+	for (VarList *vl = fn->locals; vl; vl = vl->next)
+		nvars++;
+
+	Var **vars = mem_alloc(MEM_IR, nvars * sizeof(Var *));
+	bool *ok = mem_alloc(MEM_IR, nvars * sizeof(bool));
+	int *idx = mem_alloc(MEM_IR, fn->nreg * sizeof(int));
+	for (int i = 0; i < fn->nreg; i++)
+		idx[i] = -1;
+
+	nvars = 0;
+	for (VarList *vl = fn->locals; vl; vl = vl->next) {
+		int sz = size_of(vl->var->ty);
+		ok[nvars] = vl->var->ty->kind != TY_ARRAY && (sz == 1 || sz == 4 || sz == 8) &&
+					(!params_only || is_param(fn, vl->var));
+		vars[nvars++] = vl->var;
+	}
+
+	for (BB *bb = fn->bb; bb; bb = bb->next) {
+		for (IR *ir = bb->ir; ir; ir = ir->next) {
+			if (ir->op != IR_LVAR)
+				continue;
+			for (int i = 0; i < nvars; i++)
+				if (vars[i] == ir->var)
+					idx[ir->r0->vn] = i;
+		}
+	}
+
+	for (BB *bb = fn->bb; bb; bb = bb->next) {
+		for (IR *ir = bb->ir; ir; ir = ir->next) {
+			Reg **r;
+			for (int i = 0; (r = use_at(ir, i)); i++) {
+				if (!*r || idx[(*r)->vn] < 0)
+					continue;
+				int v = idx[(*r)->vn];
+				bool is_access = (ir->op == IR_LOAD || ir->op == IR_STORE) && i == 0 &&
+								 ir->size == size_of(vars[v]->ty);
+				if (!is_access)
+					ok[v] = false;
+			}
+		}
+	}
+
+	promoted = mem_alloc(MEM_IR, nvars * sizeof(Var *));
+	npromoted = 0;
+	int *new_idx = mem_alloc(MEM_IR, nvars * sizeof(int));
+	for (int i = 0; i < nvars; i++) {
+		new_idx[i] = ok[i] ? npromoted : -1;
+		if (ok[i])
+			promoted[npromoted++] = vars[i];
+	}
+
+	var_of = idx;
+	nvar_of = fn->nreg;
+	for (int i = 0; i < fn->nreg; i++)
+		if (var_of[i] >= 0)
+			var_of[i] = new_idx[var_of[i]];
+}
+
+void build_dom_tree(Function *fn) {
+	children = mem_alloc(MEM_IR, npostorder * sizeof(BB **));
+	nchildren = mem_alloc(MEM_IR, npostorder * sizeof(int));
+
+	for (BB *bb = fn->bb; bb; bb = bb->next)
+		if (bb != fn->bb)
+			nchildren[bb->idom->rpo]++;
+	for (int i = 0; i < npostorder; i++) {
+		children[i] = mem_alloc(MEM_IR, nchildren[i] * sizeof(BB *));
+		nchildren[i] = 0;
+	}
+	for (BB *bb = fn->bb; bb; bb = bb->next)
+		if (bb != fn->bb)
+			children[bb->idom->rpo][nchildren[bb->idom->rpo]++] = bb;
+}
+
+void insert_phis(Function *fn) {
+	int nbb = npostorder;
+
+	// Dominance frontiers
+	BB ***df = mem_alloc(MEM_IR, nbb * sizeof(BB **));
+	int *ndf = mem_alloc(MEM_IR, nbb * sizeof(int));
+	for (int i = 0; i < nbb; i++)
+		df[i] = mem_alloc(MEM_IR, nbb * sizeof(BB *));
+
+	for (BB *bb = fn->bb; bb; bb = bb->next) {
+		if (bb->npred < 2)
+			continue;
+		for (int i = 0; i < bb->npred; i++) {
+			for (BB *runner = bb->pred[i]; runner != bb->idom; runner = runner->idom) {
+				bool found = false;
+				for (int j = 0; j < ndf[runner->rpo]; j++)
+					if (df[runner->rpo][j] == bb)
+						found = true;
+				if (!found)
+					df[runner->rpo][ndf[runner->rpo]++] = bb;
+			}
+		}
+	}
+
+	for (int v = 0; v < npromoted; v++) {
+		bool *has_phi = mem_alloc(MEM_IR, nbb * sizeof(bool));
+		bool *queued = mem_alloc(MEM_IR, nbb * sizeof(bool));
+		BB **work = mem_alloc(MEM_IR, nbb * sizeof(BB *));
+		int nwork = 0;
+
+		for (BB *bb = fn->bb; bb; bb = bb->next) {
+			for (IR *ir = bb->ir; ir; ir = ir->next) {
+				if (ir->op == IR_STORE && promoted_var(ir->r1) == v && !queued[bb->rpo]) {
+					queued[bb->rpo] = true;
+					work[nwork++] = bb;
+				}
+			}
+		}
+
+		while (nwork > 0) {
+			BB *bb = work[--nwork];
+			for (int i = 0; i < ndf[bb->rpo]; i++) {
+				BB *d = df[bb->rpo][i];
+				if (has_phi[d->rpo])
+					continue;
+				has_phi[d->rpo] = true;
+
+				IR *phi = new_ir(IR_PHI);
+				phi->r0 = new_reg();
+				phi->imm = v;
+				phi->nargs = d->npred;
+				phi->args = mem_alloc(MEM_IR, d->npred * sizeof(Reg *));
+				phi->bbs = mem_alloc(MEM_IR, d->npred * sizeof(BB *));
+				for (int j = 0; j < d->npred; j++)
+					phi->bbs[j] = d->pred[j];
+				phi->next = d->ir;
+				d->ir = phi;
+
+				if (!queued[d->rpo]) {
+					queued[d->rpo] = true;
+					work[nwork++] = d;
+				}
+			}
+		}
+	}
+}
+
+void rename_vars(BB *bb, Reg **cur) {
+	Reg **saved = mem_alloc(MEM_IR, npromoted * sizeof(Reg *));
+	memcpy(saved, cur, npromoted * sizeof(Reg *));
+
+	for (IR *ir = bb->ir; ir; ir = ir->next) {
+		if (ir->op == IR_PHI) {
+			cur[ir->imm] = ir->r0;
+			continue;
+		}
+
+		int v = promoted_var(ir->r1);
+		if (v < 0 || (ir->op != IR_LOAD && ir->op != IR_STORE))
+			continue;
+
+		if (ir->op == IR_LOAD) {
+			ir->op = IR_MOV;
+			ir->r1 = cur[v];
+			continue;
+		}
+
+		// A store becomes a copy, or a truncation for char and int
+		// variables
+		int sz = size_of(promoted[v]->ty);
+		ir->op = (sz == 8) ? IR_MOV : IR_CAST;
+		ir->r0 = new_reg();
+		ir->r1 = ir->r2;
+		ir->r2 = NULL;
+		cur[v] = ir->r0;
+	}
+
+	BB *succ[2];
+	int n = get_succs(bb, succ);
+	for (int i = 0; i < n; i++)
+		for (IR *ir = succ[i]->ir; ir && ir->op == IR_PHI; ir = ir->next)
+			for (int j = 0; j < ir->nargs; j++)
+				if (ir->bbs[j] == bb)
+					ir->args[j] = cur[ir->imm];
+
+	for (int i = 0; i < nchildren[bb->rpo]; i++)
+		rename_vars(children[bb->rpo][i], cur);
+
+	memcpy(cur, saved, npromoted * sizeof(Reg *));
+}
+
+// Converts a function to SSA form by promoting local variables whose
+// address doesn't escape to virtual registers.
+void build_ssa(Function *fn) {
+	// Programs may step from one local to another with pointer
+	// arithmetic, as in *(&x+1), so once an address of a local is
+	// taken, locals other than parameters stay in memory. Parameters
+	// still live in registers unless their own address is taken.
+	compute_cfg(fn);
+	find_promotable(fn, fn_any_node(fn, is_local_addr));
+	if (npromoted == 0)
+		return;
+
+	build_dom_tree(fn);
+	insert_phis(fn);
+
+	// Uninitialized variables read as 0. Insert their initial values
+	// after IR_PARAMs, which must stay at the beginning.
+	Reg **cur = mem_alloc(MEM_IR, npromoted * sizeof(Reg *));
+	IR **p = &fn->bb->ir;
+	while ((*p)->op == IR_PARAM)
+		p = &(*p)->next;
+	for (int v = 0; v < npromoted; v++) {
+		IR *ir = new_ir(IR_IMM);
+		ir->r0 = cur[v] = new_reg();
+		ir->next = *p;
+		*p = ir;
+	}
+
+	rename_vars(fn->bb, cur);
+}
+
+//
+// Out of SSA
+//
+
+// Inserts a new block on the edge from `from` to `to`
+BB *split_edge(BB *from, BB *to) {
+	BB *bb = new_bb();
+	IR *jmp = new_ir(IR_JMP);
+	jmp->bb1 = to;
+	bb->ir = jmp;
+
+	IR *ir = last_inst(from);
+	if (ir->bb1 == to)
+		ir->bb1 = bb;
+	if (ir->op == IR_BR && ir->bb2 == to)
+		ir->bb2 = bb;
+
+	for (IR *phi = to->ir; phi && phi->op == IR_PHI; phi = phi->next)
+		for (int i = 0; i < phi->nargs; i++)
+			if (phi->bbs[i] == from)
+				phi->bbs[i] = bb;
+
+	bb->next = from->next;
+	from->next = bb;
+	return bb;
+}
+
+// Replaces phi functions with copies at the end of predecessors.
+// Critical edges are split first so that a copy is executed only on
+// the edge to the block with the phi.
+void leave_ssa(Function *fn) {
+	compute_cfg(fn);
+
+	for (BB *bb = fn->bb; bb; bb = bb->next) {
+		if (!bb->ir || bb->ir->op != IR_PHI)
+			continue;
+
+		for (int i = 0; i < bb->npred; i++) {
+			BB *succ[2];
+			BB *pred = bb->pred[i];
+			if (get_succs(pred, succ) > 1)
+				pred = split_edge(pred, bb);
+
+			int nphi = 0;
+			for (IR *phi = bb->ir; phi && phi->op == IR_PHI; phi = phi->next)
+				nphi++;
+
+			// Phis are evaluated in parallel, so copy their arguments
+			// to temporaries first if there are more than one.
+			Reg **tmp = mem_alloc(MEM_IR, nphi * sizeof(Reg *));
+			int j = 0;
+			for (IR *phi = bb->ir; phi && phi->op == IR_PHI; phi = phi->next, j++) {
+				Reg *arg = NULL;
+				for (int k = 0; k < phi->nargs; k++)
+					if (phi->bbs[k] == pred)
+						arg = phi->args[k];
+
+				IR *mov = new_ir(IR_MOV);
+				mov->r0 = (nphi == 1) ? phi->r0 : new_reg();
+				mov->r1 = arg;
+				insert_before_terminator(pred, mov);
+				tmp[j] = mov->r0;
+			}
+
+			if (nphi == 1)
+				continue;
+
+			j = 0;
+			for (IR *phi = bb->ir; phi && phi->op == IR_PHI; phi = phi->next, j++) {
+				IR *mov = new_ir(IR_MOV);
+				mov->r0 = phi->r0;
+				mov->r1 = tmp[j];
+				insert_before_terminator(pred, mov);
+			}
+		}
+
+		while (bb->ir->op == IR_PHI)
+			bb->ir = bb->ir->next;
+	}
+}
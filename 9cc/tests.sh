@@ -0,0 +1,128 @@
+#!/bin/bash
+# Splits `tests` into one program per assert, compiles and runs them
+# on all cores, and reports the compile and run time of each case.
+#
+# Each case has the functions and globals of `tests` and a main()
+# with the statements before its assert that aren't asserts. Run times
+# are compared with a baseline written by --save-baseline for the same
+# options, and a case that got much slower fails the run.
+#
+#   ./tests.sh [--save-baseline] [--shard=I/N] [9cc options...]
+#
+# --shard=I/N runs only every Nth case starting from the Ith, so that
+# the suite can be split across machines.
+set -e
+cd "$(dirname "$0")"
+
+SLOWDOWN=${SLOWDOWN:-150} # Percent of the baseline run time
+MIN_MS=${MIN_MS:-10}      # Differences below this are noise
+
+save=
+shard=0/1
+opts=()
+for arg in "$@"; do
+	case $arg in
+	--save-baseline) save=1 ;;
+	--shard=*) shard=${arg#--shard=} ;;
+	*) opts+=("$arg") ;;
+	esac
+done
+
+# Each set of options has its own baseline, like tests-O.baseline
+opt_str="${opts[*]}"
+BASELINE="tests${opt_str// /}.baseline"
+
+dir=tmp-check
+rm -rf $dir
+mkdir $dir
+
+# Writes $dir/NNN.c for each case and $dir/NNN.name with its label
+awk -v dir=$dir -v shard=$shard '
+BEGIN { split(shard, s, "/") }
+/^int main\(\) \{/ { in_main = 1; next }
+!in_main { prelude = prelude $0 "\n"; next }
+/^}/ { exit }
+/^[ \t]*assert\(/ {
+	n++
+	if ((n - 1) % s[2] != s[1])
+		next
+	file = sprintf("%s/%03d", dir, n)
+	printf "%sint main() {\n%s%s\n\treturn 0;\n}\n", prelude, setup, $0 > (file ".c")
+	label = $0
+	sub(/.*, "/, "", label)
+	sub(/"\);[ \t]*$/, "", label)
+	print label > (file ".name")
+	close(file ".c")
+	close(file ".name")
+	next
+}
+/printf\("OK|^[ \t]*return/ { next }
+{ setup = setup $0 "\n" }
+' tests
+
+# Prints the milliseconds between two $EPOCHREALTIME values
+ms() {
+	echo $(( (${2/[.,]/} - ${1/[.,]/}) / 1000 ))
+}
+
+# Compiles and runs a case, and writes "compile-ms run-ms" to NNN.time
+run_case() {
+	local c=${1%.c}
+	local t0=$EPOCHREALTIME
+	if ! ./9cc "${opts[@]}" $c.c > $c.s 2> $c.out; then
+		echo "compile error" >> $c.out
+		return
+	fi
+	local t1=$EPOCHREALTIME
+	if ! gcc -static -o $c $c.s 2> /dev/null; then
+		echo "link error" >> $c.out
+		return
+	fi
+	local t2=$EPOCHREALTIME
+	if ! ./$c >> $c.out 2>&1; then
+		echo "exit status $?" >> $c.out
+		return
+	fi
+	local t3=$EPOCHREALTIME
+	echo "$(ms $t0 $t1) $(ms $t2 $t3)" > $c.time
+}
+
+export -f ms run_case
+export OPTS="${opts[*]}"
+ls $dir/*.c | xargs -P "$(nproc)" -n 1 bash -c 'opts=($OPTS); run_case "$0"'
+
+printf "%-6s %8s %8s %8s  %s\n" case cc-ms run-ms base-ms name
+failed=0
+slower=0
+for f in $dir/*.c; do
+	c=${f%.c}
+	n=$(basename $c)
+	name=$(cat $c.name)
+	if [ ! -f $c.time ]; then
+		printf "%-6s %8s %8s %8s  %s  FAILED\n" $n - - - "$name"
+		sed 's/^/    /' $c.out
+		failed=$((failed + 1))
+		continue
+	fi
+	read cc_ms run_ms < $c.time
+	base=$(awk -v n=$n '$1 == n { print $2 }' $BASELINE 2> /dev/null || true)
+	flag=
+	if [ -n "$base" ] && [ $((run_ms * 100)) -gt $((base * SLOWDOWN)) ] &&
+		   [ $((run_ms - base)) -gt $MIN_MS ]; then
+		flag="  SLOWER"
+		slower=$((slower + 1))
+	fi
+	printf "%-6s %8d %8d %8s  %s%s\n" $n $cc_ms $run_ms "${base:--}" "$name" "$flag"
+done
+
+total=$(ls $dir/*.c | wc -l)
+echo "$total cases: $failed failed, $slower slower than the baseline"
+
+if [ -n "$save" ] && [ $failed = 0 ]; then
+	for f in $dir/*.time; do
+		echo "$(basename ${f%.time}) $(cut -d' ' -f2 $f)"
+	done > $BASELINE
+	echo "saved the run times to $BASELINE"
+fi
+
+[ $failed = 0 ] && [ $slower = 0 ]
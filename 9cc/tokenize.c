@@ -16,7 +16,7 @@ void error(char *fmt, ...) {
 //
 // foo.c:10: x = y + 1;
 //               ^ <error message here>
-void verror_at(char *loc, char *fmt, va_list ap) {
+__attribute__((noreturn)) void verror_at(char *loc, char *fmt, va_list ap) {
 	// Find a line containing `loc`.
 	char *line = loc;
 	while (user_input < line && line[-1] != '\n')
@@ -63,13 +63,6 @@ void error_tok(Token *tok, char *fmt, ...) {
 	exit(1);
 }
 
-char *strndup(char *p, int len) {
-	char *buf = malloc(len + 1);
-	strncpy(buf, p, len);
-	buf[len] = '\0';
-	return buf;
-}
-
 // Returns true if the current token matches a given string
 Token *peek(char *s) {
 	if (token->kind != TK_RESERVED ||
@@ -102,10 +95,10 @@ void expect(char *s) {
 	token = token->next;
 }
 
-int expect_number() {
+long expect_number() {
 	if (token->kind != TK_NUM)
 		error_tok(token, "expected a number");
-	int val = token->val;
+	long val = token->val;
 	token = token->next;
 	return val;
 }
@@ -114,7 +107,7 @@ int expect_number() {
 char *expect_ident() {
 	if (token->kind != TK_IDENT)
 		error_tok(token, "expected an identifier");
-	char *s = strndup(token->str, token->len);
+	char *s = mem_strndup(MEM_PARSE, token->str, token->len);
 	token = token->next;
 	return s;
 }
@@ -124,7 +117,7 @@ bool at_eof() {
 }
 
 Token *new_token(TokenKind kind, Token *cur, char *str, int len) {
-	Token *tok = calloc(1, sizeof(Token));
+	Token *tok = mem_alloc(MEM_TOKENIZE, sizeof(Token));
 	tok->kind = kind;
 	tok->str = str;
 	tok->len = len;
@@ -146,7 +139,8 @@ bool is_alnum(char c) {
 
 char *starts_with_reserved(char *p) {
 	// Keyword
-	static char *kw[] = {"return", "if", "else", "while", "for", "int", "sizeof", "char"};
+	static char *kw[] = {"return", "if", "else", "while", "for", "int", "sizeof", "char",
+						 "long"};
 
 	for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++) {
 		int len = strlen(kw[i]);
@@ -179,31 +173,44 @@ char get_escape_char(char c) {
 	}
 }
 
+// A literal without escape sequences refers to its text in the input.
+// Its contents are not terminated by '\0'; cont_len counts the
+// terminator, which is added when the literal is emitted.
 Token *read_string_literal(Token *cur, char *start) {
+	// Find the closing quote
 	char *p = start + 1;
-	char buf[1024];
-	int len = 0;
-
+	bool escaped = false;
 	for (;;) {
-		if (len == sizeof(buf))
-			error_at(start, "string literal too large");
-		if (*p == '\0')
-			error_at(start, "unclosed string literal");
+		p = find_str_end(p);
 		if (*p == '"')
 			break;
-
-		if (*p == '\\') {
-			p++;
-			buf[len++] = get_escape_char(*p++);
-		} else {
-			buf[len++] = *p++;
-		}
+		if (*p == '\0' || p[1] == '\0')
+			error_at(start, "unclosed string literal");
+		escaped = true;
+		p += 2;
 	}
 
 	Token *tok = new_token(TK_STR, cur, start, p - start + 1);
-	tok->contents = malloc(len + 1);
-	memcpy(tok->contents, buf, len);
-	tok->contents[len] = '\0';
+	if (!escaped) {
+		tok->contents = start + 1;
+		tok->cont_len = p - start;
+		return tok;
+	}
+
+	// Decode the escape sequences
+	char *buf = mem_alloc(MEM_TOKENIZE, p - start - 1);
+	long len = 0;
+	for (char *q = start + 1; q < p;) {
+		char *r = find_str_end(q);
+		memcpy(buf + len, q, r - q);
+		len += r - q;
+		if (r == p)
+			break;
+		buf[len++] = get_escape_char(r[1]);
+		q = r + 2;
+	}
+
+	tok->contents = buf;
 	tok->cont_len = len + 1;
 	return tok;
 }
@@ -215,24 +222,25 @@ Token *tokenize() {
 	head.next = NULL;
 	Token *cur = &head;
 
+	init_scanner();
+	input_end = p + strlen(p);
+
 	while (*p) {
 		if (isspace(*p)) {
-			p++;
+			p = skip_space(p + 1);
 			continue;
 		}
 
 		// Skip line comments
 		if (startswith(p, "//")) {
-			p += 2;
-			while (*p != '\n')
-				p++;
+			p = find_newline(p + 2);
 			continue;
 		}
 
 		// Skip block comments
 		if (startswith(p, "/*")) {
-			char *q = strstr(p + 2, "*/");
-			if (!q)
+			char *q = find_comment_end(p + 2);
+			if (!*q)
 				error_at(p, "unclosed block comment");
 			p = q + 2;
 			continue;
@@ -255,9 +263,8 @@ Token *tokenize() {
 
 		// Identifier
 		if (is_alpha(*p)) {
-			char *q = p++;
-			while (is_alnum(*p))
-				p++;
+			char *q = p;
+			p = skip_ident(p + 1);
 			cur = new_token(TK_IDENT, cur, q, p - q);
 			continue;
 		}
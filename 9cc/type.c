@@ -1,7 +1,7 @@
 #include "9cc.h"
 
 Type *new_type(TypeKind kind) {
-	Type *ty = calloc(1, sizeof(Type));
+	Type *ty = mem_alloc(MEM_TYPE, sizeof(Type));
 	ty->kind = kind;
 	return ty;
 }
@@ -14,6 +14,10 @@ Type *int_type() {
 	return new_type(TY_INT);
 }
 
+Type *long_type() {
+	return new_type(TY_LONG);
+}
+
 Type *pointer_to(Type *base) {
 	Type *ty = new_type(TY_PTR);
 	ty->base = base;
@@ -32,6 +36,8 @@ int size_of(Type *ty) {
 	case TY_CHAR:
 		return 1;
 	case TY_INT:
+		return 4;
+	case TY_LONG:
 	case TY_PTR:
 		return 8;
 	default:
@@ -40,6 +46,36 @@ int size_of(Type *ty) {
 	}
 }
 
+// Variables are aligned to their natural size. An array is aligned
+// like its elements.
+int align_of(Type *ty) {
+	if (ty->kind == TY_ARRAY)
+		return align_of(ty->base);
+	return size_of(ty);
+}
+
+bool is_integer(Type *ty) {
+	return ty->kind == TY_CHAR || ty->kind == TY_INT || ty->kind == TY_LONG;
+}
+
+// Returns true if `fn` can return the result of `call` as it is, so
+// that the call can be a tail call. The caller sign-extends what we
+// return from the width of our return type, which mustn't be wider
+// than that of the call.
+bool can_return_call(Function *fn, Node *call) {
+	return size_of(fn->ty) <= size_of(call->ty);
+}
+
+// Arithmetic is done in 64 bits, and the result is long if either
+// operand is long. Narrower values are truncated when stored.
+Type *arith_type(Node *node) {
+	if (node->lhs->ty->kind == TY_LONG || node->rhs->ty->kind == TY_LONG)
+		return long_type();
+	return int_type();
+}
+
+Program *type_prog;
+
 void visit(Node *node) {
 	if (!node)
 		return;
@@ -60,14 +96,24 @@ void visit(Node *node) {
 	switch (node->kind) {
 	case ND_MUL:
 	case ND_DIV:
+		node->ty = arith_type(node);
+		return;
 	case ND_EQ:
 	case ND_NE:
 	case ND_LT:
 	case ND_LE:
-	case ND_FUNCALL:
-	case ND_NUM:
 		node->ty = int_type();
 		return;
+	case ND_NUM:
+		// Like in C, a literal that doesn't fit in int is long
+		node->ty = (node->val == (int)node->val) ? int_type() : long_type();
+		return;
+	case ND_FUNCALL: {
+		// Functions that the program doesn't define return int
+		Function *fn = find_function(type_prog, node->funcname);
+		node->ty = fn ? fn->ty : int_type();
+		return;
+	}
 	case ND_VAR:
 		node->ty = node->var->ty;
 		return;
@@ -79,12 +125,12 @@ void visit(Node *node) {
 		}
 		if (node->rhs->ty->base)
 			error_tok(node->tok, "invalid pointer arithmetic operands");
-		node->ty = node->lhs->ty;
+		node->ty = node->lhs->ty->base ? node->lhs->ty : arith_type(node);
 		return;
 	case ND_SUB:
 		if (node->rhs->ty->base)
 			error_tok(node->tok, "invalid pointer arithmetic operands");
-		node->ty = node->lhs->ty;
+		node->ty = node->lhs->ty->base ? node->lhs->ty : arith_type(node);
 		return;
 	case ND_ASSIGN:
 		node->ty = node->lhs->ty;
@@ -116,6 +162,7 @@ void visit(Node *node) {
 }
 
 void add_type(Program *prog) {
+	type_prog = prog;
 	for (Function *fn = prog->fns; fn; fn = fn->next)
 		for (Node *node = fn->node; node; node = node->next)
 			visit(node);